@@ -9,6 +9,24 @@
 
 namespace rt {
 
+/**
+	Slab test against box given by its min and max corners. Uses only multiplication
+	by the precomputed reciprocal of ray direction.
+
+	\returns distance to the entry point clipped to [tmin, tmax] or rt::ray_miss
+*/
+inline float ray_box_intersection_distance(const traversal_ray &r, const glm::vec3 &min, const glm::vec3 &max)
+{
+	glm::vec3 a{(min - r.origin) * r.inv_direction};
+	glm::vec3 b{(max - r.origin) * r.inv_direction};
+
+	float tmin = std::max(std::max(std::min(a.x, b.x), std::min(a.y, b.y)), std::max(std::min(a.z, b.z), r.tmin));
+	float tmax = std::min(std::min(std::max(a.x, b.x), std::max(a.y, b.y)), std::min(std::max(a.z, b.z), r.tmax));
+
+	if (tmin > tmax) return rt::ray_miss;
+	else return tmin;
+}
+
 /**
 	Axis-aligned bounding box
 */
@@ -38,6 +56,7 @@ public:
 	inline bool ray_intersect(const ray &r, ray_intersection &hit) const override;
 	inline bool check_ray_intersect(const ray &r) const;
 	inline float ray_intersection_distance(const ray &r) const;
+	inline float ray_intersection_distance(const traversal_ray &r) const;
 
 	const glm::vec3 &get_min() const
 	{
@@ -139,6 +158,15 @@ inline float aabb::ray_intersection_distance(const ray &r) const
 	else return tmin;
 }
 
+/**
+	Returns distance to the entry point of the ray in the box, clipped to the
+	ray's [tmin, tmax] range. Returns rt::ray_miss if the box is not hit within the range.
+*/
+inline float aabb::ray_intersection_distance(const traversal_ray &r) const
+{
+	return ray_box_intersection_distance(r, min, max);
+}
+
 /**
 	Abstract base class for anything that can be bounded with AABB
 */
@@ -0,0 +1,241 @@
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <cstdlib>
+
+#include "ray.hpp"
+#include "camera.hpp"
+#include "scene.hpp"
+#include "bvh_tree.hpp"
+#include "wide_bvh.hpp"
+#include "compressed_bvh.hpp"
+#include "uniform_grid.hpp"
+#include "kd_tree.hpp"
+#include "traversal_stats.hpp"
+#include "blender_jsd_loader.hpp"
+
+/**
+	\file accel_bench.cpp
+
+	Compares ray accelerators on a scene. Each accelerator is built and used to
+	trace one primary ray per pixel and one diffuse bounce ray from each primary
+	hit. Reports build time, memory taken by the structure, tracing speed and
+	visited nodes (grid cells) and tested primitives per ray. A bvh_tree is also
+	optimized for the benchmark rays to show the traversal cost before and after.
+	Parallel BVH builds are compared with single-threaded ones.
+
+	Usage: rt_bench [scene.jsd] [width] [height]
+*/
+
+namespace {
+
+struct trace_result
+{
+	double seconds = 0.0;
+	std::uint64_t rays = 0;
+	std::uint64_t nodes = 0;
+	std::uint64_t primitives = 0;
+};
+
+/**
+	Traces given rays on all hardware threads
+*/
+trace_result trace_rays(const rt::ray_accelerator &accel, const std::vector<rt::ray> &rays, std::vector<rt::ray_hit> &hits)
+{
+	constexpr std::size_t chunk_size = 1024;
+
+	hits.resize(rays.size());
+	std::atomic<std::size_t> next_chunk{0};
+	std::atomic<std::uint64_t> nodes{0}, primitives{0};
+
+	auto t_start = std::chrono::high_resolution_clock::now();
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < std::max(std::thread::hardware_concurrency(), 1u); i++)
+	{
+		threads.emplace_back([&]
+		{
+			rt::traversal_counters &counters = rt::get_traversal_counters();
+			counters = rt::traversal_counters{};
+
+			for (std::size_t first; (first = next_chunk++ * chunk_size) < rays.size();)
+				for (std::size_t j = first; j < std::min(first + chunk_size, rays.size()); j++)
+					if (!accel.cast_ray(rays[j], hits[j]))
+						hits[j].distance = rt::ray_miss;
+
+			nodes += counters.nodes;
+			primitives += counters.primitives;
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	std::chrono::duration<double> t_trace = std::chrono::high_resolution_clock::now() - t_start;
+	return {t_trace.count(), rays.size(), nodes, primitives};
+}
+
+/**
+	Generates diffuse bounce rays from hits of the primary rays
+*/
+std::vector<rt::ray> make_bounce_rays(const std::vector<rt::ray_hit> &hits)
+{
+	std::mt19937 rng{42};
+	std::normal_distribution<float> dist;
+
+	std::vector<rt::ray> rays;
+	for (const auto &hit : hits)
+	{
+		if (hit.distance == rt::ray_miss) continue;
+
+		// Uniform direction in the hemisphere above the surface
+		glm::vec3 dir{dist(rng), dist(rng), dist(rng)};
+		if (glm::dot(dir, hit.normal) < 0.f) dir = -dir;
+		rays.emplace_back(hit.position + hit.normal * 1e-4f, dir);
+	}
+
+	return rays;
+}
+
+void print_result(const std::string &label, const trace_result &res)
+{
+	double rays = std::max<double>(res.rays, 1.0);
+	std::cout << "  " << std::left << std::setw(10) << label << std::right
+		<< std::setw(10) << std::setprecision(2) << res.rays / res.seconds * 1e-6 << " Mrays/s"
+		<< std::setw(10) << std::setprecision(1) << res.nodes / rays << " nodes/ray"
+		<< std::setw(10) << std::setprecision(1) << res.primitives / rays << " prims/ray" << std::endl;
+}
+
+/**
+	Builds the accelerator and traces primary and bounce rays with it
+*/
+template <typename T, typename... Args>
+void benchmark(const std::string &name, const rt::scene &scene, const std::vector<rt::ray> &primary_rays, Args&&... args)
+{
+	auto t_start = std::chrono::high_resolution_clock::now();
+	T accel{scene, std::forward<Args>(args)...};
+	std::chrono::duration<double> t_build = std::chrono::high_resolution_clock::now() - t_start;
+
+	std::cout << name << std::fixed
+		<< " - build " << std::setprecision(3) << t_build.count() << "s"
+		<< ", memory " << std::setprecision(1) << accel.get_memory_usage() / 1048576.0 << " MiB" << std::endl;
+
+	std::vector<rt::ray_hit> hits;
+	print_result("primary", trace_rays(accel, primary_rays, hits));
+
+	std::vector<rt::ray> bounce_rays = make_bounce_rays(hits);
+	print_result("bounce", trace_rays(accel, bounce_rays, hits));
+}
+
+/**
+	Builds a bvh_tree on one thread and on all threads and reports the speedup
+*/
+void benchmark_build_speedup(const std::string &name, const rt::scene &scene, rt::bvh_build_params params)
+{
+	int threads = 1;
+	auto build_time = [&](int thread_count)
+	{
+		params.threads = thread_count;
+		auto t_start = std::chrono::high_resolution_clock::now();
+		rt::bvh_tree tree{scene, params};
+		std::chrono::duration<double> t_build = std::chrono::high_resolution_clock::now() - t_start;
+		threads = tree.get_build_stats().threads;
+		return t_build.count();
+	};
+
+	double t_serial = build_time(1);
+	double t_parallel = build_time(0);
+
+	std::cout << name << " build" << std::fixed << std::setprecision(3)
+		<< " - 1 thread " << t_serial << "s, " << threads << " threads " << t_parallel << "s"
+		<< ", speedup " << std::setprecision(2) << t_serial / t_parallel << "x" << std::endl;
+}
+
+/**
+	Profiles a binned SAH tree with the benchmark rays and optimizes it for them.
+	Reports the SAH cost and the cost measured by the profile before and after.
+*/
+void benchmark_ray_optimization(const rt::scene &scene, const std::vector<rt::ray> &primary_rays)
+{
+	rt::bvh_tree tree{scene};
+	std::vector<rt::ray_hit> hits;
+
+	auto profile = [&]
+	{
+		tree.begin_ray_profile();
+		trace_rays(tree, primary_rays, hits);
+		trace_rays(tree, make_bounce_rays(hits), hits);
+		return tree.get_ray_profile_cost();
+	};
+
+	float sah_before = tree.get_sah_cost();
+	float cost_before = profile();
+
+	auto t_start = std::chrono::high_resolution_clock::now();
+	bool optimized = tree.optimize_for_rays();
+	std::chrono::duration<double> t_optimize = std::chrono::high_resolution_clock::now() - t_start;
+
+	float cost_after = profile();
+	tree.end_ray_profile();
+
+	std::cout << "bvh_tree (ray-optimized)" << std::fixed
+		<< " - optimization " << std::setprecision(3) << t_optimize.count() << "s"
+		<< (optimized ? "" : " (nothing replaced)")
+		<< ", memory " << std::setprecision(1) << tree.get_memory_usage() / 1048576.0 << " MiB" << std::endl;
+	std::cout << "  SAH cost " << std::setprecision(2) << sah_before << " -> " << tree.get_sah_cost()
+		<< ", measured cost " << cost_before << " -> " << cost_after << std::endl;
+
+	print_result("primary", trace_rays(tree, primary_rays, hits));
+	std::vector<rt::ray> bounce_rays = make_bounce_rays(hits);
+	print_result("bounce", trace_rays(tree, bounce_rays, hits));
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	std::string scene_path = argc > 1 ? argv[1] : "resources/test_box.jsd";
+	int width = argc > 2 ? std::stoi(argv[2]) : 512;
+	int height = argc > 3 ? std::stoi(argv[3]) : 512;
+
+	rt::scene scene = rt::load_jsd_scene(scene_path);
+	rt::camera &cam = scene.get_camera();
+	cam.set_aspect_ratio(static_cast<float>(width) / height);
+
+	// Rays through pixel centers
+	std::vector<rt::ray> primary_rays;
+	primary_rays.reserve(width * height);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			primary_rays.push_back(cam.get_ray({(x + 0.5f) / width * 2.f - 1.f, 1.f - (y + 0.5f) / height * 2.f}));
+
+	auto params_for = [](rt::bvh_build_method method)
+	{
+		rt::bvh_build_params params;
+		params.method = method;
+		return params;
+	};
+
+	std::cout << scene_path << " - " << width << "x" << height << " rays" << std::endl;
+#ifndef RT_TRAVERSAL_STATS
+	std::cout << "traversal counters are disabled - node and primitive counts are zero" << std::endl;
+#endif
+
+	benchmark<rt::bvh_tree>("bvh_tree (binned SAH)", scene, primary_rays, params_for(rt::bvh_build_method::BINNED_SAH));
+	benchmark<rt::bvh_tree>("bvh_tree (SBVH)", scene, primary_rays, params_for(rt::bvh_build_method::SPATIAL_SAH));
+	benchmark<rt::bvh_tree>("bvh_tree (LBVH)", scene, primary_rays, params_for(rt::bvh_build_method::LBVH));
+	benchmark_ray_optimization(scene, primary_rays);
+	benchmark_build_speedup("bvh_tree (binned SAH)", scene, params_for(rt::bvh_build_method::BINNED_SAH));
+	benchmark_build_speedup("bvh_tree (SBVH)", scene, params_for(rt::bvh_build_method::SPATIAL_SAH));
+	benchmark_build_speedup("bvh_tree (LBVH)", scene, params_for(rt::bvh_build_method::LBVH));
+	benchmark<rt::wide_bvh>("wide_bvh", scene, primary_rays);
+	benchmark<rt::compressed_bvh>("compressed_bvh", scene, primary_rays);
+	benchmark<rt::uniform_grid>("uniform_grid", scene, primary_rays);
+	benchmark<rt::kd_tree>("kd_tree", scene, primary_rays);
+
+	return EXIT_SUCCESS;
+}
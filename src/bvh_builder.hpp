@@ -0,0 +1,618 @@
+#pragma once
+
+#include <vector>
+#include <stack>
+#include <tuple>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <ctime>
+#include <glm/glm.hpp>
+
+#include "ray.hpp"
+#include "aabb.hpp"
+#include "thread_pool.hpp"
+
+namespace rt {
+
+/**
+	A node of a BVH tree. Nodes are stored in a flat array in depth-first order.
+	Children of a node are always stored next to each other.
+*/
+struct bvh_tree_node
+{
+	inline float ray_intersection_distance(const traversal_ray &r) const;
+
+	bool is_leaf() const
+	{
+		return count != 0;
+	}
+
+	glm::vec3 min;
+
+	//! Index of the first child node (the second one is next to it) or index of the first primitive (block) in leaves
+	std::uint32_t offset;
+
+	glm::vec3 max;
+
+	//! Primitive count - 0 for interior nodes
+	std::uint16_t count;
+
+	//! Split axis
+	std::uint8_t axis;
+
+	std::uint8_t padding;
+};
+
+static_assert(sizeof(bvh_tree_node) == 32, "bvh_tree_node should be 32 bytes");
+
+/**
+	Returns distance to ray-box intersection within ray's range or rt::ray_miss
+*/
+inline float bvh_tree_node::ray_intersection_distance(const traversal_ray &r) const
+{
+	return ray_box_intersection_distance(r, min, max);
+}
+
+/**
+	BVH construction algorithms
+*/
+enum class bvh_build_method
+{
+	SWEEP_SAH,	//!< Exact SAH - sorts primitives and sweeps over all possible splits
+	BINNED_SAH,	//!< Approximate SAH evaluated on centroid bins
+	SPATIAL_SAH,	//!< Binned SAH with spatial splits (SBVH) - triangles straddling split planes may be referenced twice. Other primitives use BINNED_SAH.
+	LBVH	//!< Primitives sorted along a Morton curve - much faster to build than SAH, but gives worse trees. Meant for interactive edits.
+};
+
+/**
+	BVH construction parameters
+*/
+struct bvh_build_params
+{
+	bvh_build_method method = bvh_build_method::BINNED_SAH;
+
+	//! Number of build threads. Non-positive values mean all hardware threads.
+	int threads = 0;
+
+	//! Max number of extra triangle references created by spatial splits, relative to the triangle count
+	float max_duplication = 0.3f;
+
+	//! Whether built nodes should be reordered into treelets for better cache locality during traversal
+	bool optimize_layout = true;
+
+	//! Whether each scene object gets its own subtree. Subtrees are built in parallel and joined by a SAH tree over
+	//! the objects, and unchanged objects keep their subtrees when the tree is rebuilt. Overlapping objects make the tree worse.
+	bool per_object = false;
+};
+
+/**
+	BVH construction timing
+*/
+struct bvh_build_stats
+{
+	//! Wall time of the entire build
+	std::chrono::duration<double> build_time{0};
+
+	//! Total CPU time spent in all build tasks. It includes time threads spend waiting for
+	//! nested tasks, so it's not the single-threaded build time - rt_bench measures the speedup.
+	std::chrono::duration<double> work_time{0};
+
+	int threads = 1;
+};
+
+/**
+	Accumulates CPU time spent in build tasks. Tasks executed by a thread
+	while it waits inside another task are not counted twice.
+*/
+class bvh_work_timer
+{
+public:
+	explicit bvh_work_timer(std::atomic<long long> &total) :
+		m_total(&total),
+		m_nested_start(tl_nested_ns),
+		m_start(get_thread_time())
+	{}
+
+	~bvh_work_timer()
+	{
+		long long elapsed = get_thread_time() - m_start;
+		*m_total += elapsed - (tl_nested_ns - m_nested_start);
+		tl_nested_ns = m_nested_start + elapsed;
+	}
+
+private:
+	//! Returns CPU time used by the calling thread in ns
+	static long long get_thread_time()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+	}
+
+	static inline thread_local long long tl_nested_ns = 0;
+
+	std::atomic<long long> *m_total;
+	long long m_nested_start;
+	long long m_start;
+};
+
+/**
+	Bounding box of a primitive and its index. The builder can shuffle these
+	instead of entire primitives, and the index tells where they came from.
+*/
+struct bvh_primitive_ref
+{
+	aabb get_aabb() const
+	{
+		return aabb{min, max};
+	}
+
+	glm::vec3 min;
+	glm::vec3 max;
+	std::uint32_t index;
+};
+
+/**
+	Builds a binary BVH over primitives of any kind providing get_aabb().
+
+	The primitives are reordered so that each leaf references a contiguous
+	range of them - `offset` of a leaf node is the index of its first primitive.
+*/
+template <typename T>
+class bvh_builder
+{
+public:
+	//! Cost of primitive intersection and cost of traversal used in SAH
+	static constexpr float sah_ci = 1.0f;
+	static constexpr float sah_ct = 4.0f;
+
+	//! Max number of primitives in a leaf (limited by bvh_tree_node::count)
+	static constexpr long max_leaf_size = 255;
+
+	explicit bvh_builder(const bvh_build_params &params = {}) :
+		m_params(params)
+	{}
+
+	void build(std::vector<T> &primitives);
+
+	/**
+		Provides access to the built nodes, so they can be moved out
+	*/
+	std::vector<bvh_tree_node> &get_nodes()
+	{
+		return m_nodes;
+	}
+
+	/**
+		Returns depth of the tree (1 for a single leaf)
+	*/
+	int get_depth() const
+	{
+		return m_depth;
+	}
+
+	const bvh_build_stats &get_stats() const
+	{
+		return m_stats;
+	}
+
+private:
+	/**
+		Temporary BVH node used during parallel construction. Children are
+		allocated separately, so subtrees can be built independently.
+	*/
+	struct build_node
+	{
+		build_node(T *b, T *e) :
+			begin(b),
+			end(e)
+		{
+			aabb vol{b->get_aabb()};
+			for (auto p = b + 1; p < e; p++)
+				vol = aabb{vol, p->get_aabb()};
+			bounding_volume = vol;
+		}
+
+		aabb bounding_volume;
+		T *begin;
+		T *end;
+		int axis = 0;
+
+		std::unique_ptr<build_node> left;
+		std::unique_ptr<build_node> right;
+	};
+
+	//! Number of centroid bins used by the binned SAH builder
+	static constexpr int sah_bin_count = 32;
+
+	//! Number of primitives above which a subtree is built as a separate task
+	static constexpr long parallel_build_threshold = 4096;
+
+	void build_subtree(build_node *root, thread_pool::task_group &group);
+	void flatten_tree(const build_node *root, const T *base);
+	T *split_sweep_sah(build_node &node, thread_pool &pool);
+	T *split_binned_sah(build_node &node);
+
+	bvh_build_params m_params;
+	bvh_build_stats m_stats;
+	std::atomic<long long> m_work_ns{0};
+	std::vector<bvh_tree_node> m_nodes;
+	int m_depth = 0;
+};
+
+template <typename T>
+void bvh_builder<T>::build(std::vector<T> &primitives)
+{
+	m_nodes.clear();
+	m_depth = 0;
+	m_stats = bvh_build_stats{};
+	if (primitives.empty()) return;
+
+	auto t_start = std::chrono::high_resolution_clock::now();
+	m_work_ns = 0;
+
+	// Build the temporary tree in parallel
+	auto root = std::make_unique<build_node>(primitives.data(), primitives.data() + primitives.size());
+	thread_pool pool{m_params.threads};
+	{
+		thread_pool::task_group group{pool};
+		group.run([&]{ build_subtree(root.get(), group); });
+		group.wait();
+	}
+
+	auto t_flatten_start = std::chrono::high_resolution_clock::now();
+	flatten_tree(root.get(), primitives.data());
+	root.reset();
+
+	auto t_end = std::chrono::high_resolution_clock::now();
+	m_stats.threads = pool.get_thread_count();
+	m_stats.build_time = t_end - t_start;
+	m_stats.work_time = std::chrono::nanoseconds{m_work_ns} + (t_end - t_flatten_start);
+}
+
+/**
+	Builds subtree starting at given node. Big enough subtrees are
+	passed to other threads in the task group.
+*/
+template <typename T>
+void bvh_builder<T>::build_subtree(build_node *root, thread_pool::task_group &group)
+{
+	bvh_work_timer timer{m_work_ns};
+
+	std::stack<build_node*> to_process;
+	to_process.push(root);
+
+	while (!to_process.empty())
+	{
+		auto node = to_process.top();
+		to_process.pop();
+
+		// Find split point - nullptr if the node should remain a leaf
+		T *split;
+		if (m_params.method == bvh_build_method::SWEEP_SAH)
+			split = split_sweep_sah(*node, group.get_pool());
+		else
+			split = split_binned_sah(*node);
+
+		// Too big leaves are split in half along the longest axis
+		if (split == nullptr && node->end - node->begin > max_leaf_size)
+		{
+			const glm::vec3 &size = node->bounding_volume.get_size();
+			node->axis = (size.x > size.y && size.x > size.z) ? 0 : (size.y > size.z ? 1 : 2);
+			split = node->begin + (node->end - node->begin) / 2;
+			std::nth_element(node->begin, split, node->end, [&](const T &t1, const T &t2){
+				return t1.get_aabb().get_center()[node->axis] < t2.get_aabb().get_center()[node->axis];
+			});
+		}
+
+		if (split == nullptr)
+			continue;
+
+		// Create children and remove primitives from this node
+		node->left = std::make_unique<build_node>(node->begin, split);
+		node->right = std::make_unique<build_node>(split, node->end);
+		node->begin = nullptr;
+		node->end = nullptr;
+
+		// Process children here or pass them to other threads
+		for (auto child : {node->left.get(), node->right.get()})
+		{
+			if (child->end - child->begin >= parallel_build_threshold)
+				group.run([this, child, &group]{ build_subtree(child, group); });
+			else
+				to_process.push(child);
+		}
+	}
+}
+
+/**
+	Copies the temporary tree into the flat node array. Nodes are stored in
+	depth-first order with siblings next to each other.
+*/
+template <typename T>
+void bvh_builder<T>::flatten_tree(const build_node *root, const T *base)
+{
+	m_nodes.emplace_back();
+
+	// Build node, its index in the array and depth
+	std::stack<std::tuple<const build_node*, std::uint32_t, int>> to_process;
+	to_process.emplace(root, 0, 1);
+
+	while (!to_process.empty())
+	{
+		auto [node, index, depth] = to_process.top();
+		to_process.pop();
+		m_depth = std::max(m_depth, depth);
+
+		bvh_tree_node &n = m_nodes[index];
+		n.min = node->bounding_volume.get_min();
+		n.max = node->bounding_volume.get_max();
+		n.axis = node->axis;
+		n.padding = 0;
+
+		if (node->left)
+		{
+			std::uint32_t child_index = m_nodes.size();
+			m_nodes.emplace_back();
+			m_nodes.emplace_back();
+			m_nodes[index].offset = child_index;
+			m_nodes[index].count = 0;
+
+			// Left subtree goes first
+			to_process.emplace(node->right.get(), child_index + 1, depth + 1);
+			to_process.emplace(node->left.get(), child_index, depth + 1);
+		}
+		else
+		{
+			n.offset = node->begin - base;
+			n.count = node->end - node->begin;
+		}
+	}
+}
+
+/**
+	Finds the best split using exact SAH - primitives are sorted along each axis
+	and all possible splits are evaluated. Sorted primitives are written back to the node.
+
+	\returns split point or nullptr if the node should not be split
+*/
+template <typename T>
+T *bvh_builder<T>::split_sweep_sah(build_node &node, thread_pool &pool)
+{
+	// Parent bounding box surface area and primitive count
+	float Sp = node.bounding_volume.get_surface_area();
+	long np = node.end - node.begin;
+
+	// SAH is undefined for degenerate boxes - such nodes are split at the median if they're too big
+	if (!(Sp > 0.f)) return nullptr;
+
+	using split_info = std::tuple<
+		std::unique_ptr<std::vector<T>>,
+		long,
+		float>;
+
+	// Calculates all possible split costs for given axis
+	auto find_best_split = [&](float glm::vec3::* axis)->split_info
+	{
+		auto data = std::make_unique<std::vector<T>>(node.begin, node.end);
+
+		// Sort the data
+		std::sort(data->begin(), data->end(), [&](auto &t1, auto &t2){
+			return t1.get_aabb().get_center().*axis < t2.get_aabb().get_center().*axis;
+		});
+
+		// Default cost and split
+		float best_cost = HUGE_VALF;
+		long best_split = 0;
+
+		// AAB collection
+		aabb_collection lcol, rcol(data->begin(), data->end());
+
+		// Cost calculation for each possible split
+		for (auto split = data->begin(); split != data->end() - 1; split++)
+		{
+			lcol.push(split->get_aabb());
+			rcol.pop(split->get_aabb());
+			long nl = split - data->begin() + 1;
+			long nr = data->end() - split - 1;
+
+			aabb boxl{lcol.get_aabb()}, boxr{rcol.get_aabb()};
+
+			// Box surfaces
+			float Sl = boxl.get_surface_area();
+			float Sr = boxr.get_surface_area();
+
+			// Calculate split cost
+			float c = sah_ct + Sl / Sp * nl * sah_ci + Sr / Sp * nr * sah_ci;
+			if (c < best_cost)
+			{
+				best_cost = c;
+				best_split = split - data->begin() + 1; // Mind this +1!
+			}
+		}
+
+		return {std::move(data), best_split, best_cost};
+	};
+
+	// Split info for each axis
+	std::unique_ptr<std::vector<T>> data_x, data_y, data_z;
+	float cost_x, cost_y, cost_z;
+	long split_x, split_y, split_z;
+
+	// Find best split point in all axes - in parallel for big nodes,
+	// since there's no subtree parallelism near the root
+	if (np >= parallel_build_threshold)
+	{
+		thread_pool::task_group group{pool};
+		group.run([&]{
+			bvh_work_timer timer{m_work_ns};
+			std::tie(data_y, split_y, cost_y) = find_best_split(&glm::vec3::y);
+		});
+		group.run([&]{
+			bvh_work_timer timer{m_work_ns};
+			std::tie(data_z, split_z, cost_z) = find_best_split(&glm::vec3::z);
+		});
+		std::tie(data_x, split_x, cost_x) = find_best_split(&glm::vec3::x);
+		group.wait();
+	}
+	else
+	{
+		std::tie(data_x, split_x, cost_x) = find_best_split(&glm::vec3::x);
+		std::tie(data_y, split_y, cost_y) = find_best_split(&glm::vec3::y);
+		std::tie(data_z, split_z, cost_z) = find_best_split(&glm::vec3::z);
+	}
+
+	// Best split index and cost
+	std::unique_ptr<std::vector<T>> best_data;
+	float best_cost;
+	long best_split = 0;
+
+	// Assume best split in X
+	best_data = std::move(data_x);
+	best_split = split_x;
+	best_cost = cost_x;
+	node.axis = 0;
+
+	// Check Y
+	if (cost_y < best_cost)
+	{
+		best_data = std::move(data_y);
+		best_split = split_y;
+		best_cost = cost_y;
+		node.axis = 1;
+	}
+
+	// Check Z
+	if (cost_z < best_cost)
+	{
+		best_data = std::move(data_z);
+		best_split = split_z;
+		best_cost = cost_z;
+		node.axis = 2;
+	}
+
+	// Compare best split cost to 'leaving as is' cost
+	if (best_cost > np * sah_ci)
+		return nullptr;
+
+	// Copy the sorted data back and calculate splitting iterator
+	std::copy(best_data->begin(), best_data->end(), node.begin);
+	return node.begin + best_split;
+}
+
+/**
+	Finds the best split using binned SAH. Primitives are assigned to bins
+	based on their AABB centroids and only splits between bins are considered.
+	The primitives are partitioned in place.
+
+	\returns split point or nullptr if the node should not be split
+*/
+template <typename T>
+T *bvh_builder<T>::split_binned_sah(build_node &node)
+{
+	struct sah_bin
+	{
+		glm::vec3 min{HUGE_VALF};
+		glm::vec3 max{-HUGE_VALF};
+		long count = 0;
+
+		void grow(const glm::vec3 &bmin, const glm::vec3 &bmax)
+		{
+			min = glm::min(min, bmin);
+			max = glm::max(max, bmax);
+		}
+
+		float get_surface_area() const
+		{
+			glm::vec3 d = max - min;
+			return 2.f * (d.x * d.y + d.x * d.z + d.y * d.z);
+		}
+	};
+
+	// Parent bounding box surface area and primitive count
+	float Sp = node.bounding_volume.get_surface_area();
+	long np = node.end - node.begin;
+	if (np < 2) return nullptr;
+
+	// SAH is undefined for degenerate boxes - such nodes are split at the median if they're too big
+	if (!(Sp > 0.f)) return nullptr;
+
+	// Centroid bounds - bins are spread over them
+	glm::vec3 cmin{HUGE_VALF}, cmax{-HUGE_VALF};
+	for (auto p = node.begin; p != node.end; p++)
+	{
+		glm::vec3 c = p->get_aabb().get_center();
+		cmin = glm::min(cmin, c);
+		cmax = glm::max(cmax, c);
+	}
+
+	float best_cost = HUGE_VALF;
+	int best_axis = -1;
+	int best_bin = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = cmax[axis] - cmin[axis];
+		if (extent <= 0.f) continue;
+		float scale = sah_bin_count / extent;
+
+		// Fill the bins
+		sah_bin bins[sah_bin_count];
+		for (auto p = node.begin; p != node.end; p++)
+		{
+			aabb box{p->get_aabb()};
+			int b = std::min(static_cast<int>((box.get_center()[axis] - cmin[axis]) * scale), sah_bin_count - 1);
+			bins[b].grow(box.get_min(), box.get_max());
+			bins[b].count++;
+		}
+
+		// Sweep from the right to get right-side areas and counts
+		float right_area[sah_bin_count];
+		long right_count[sah_bin_count];
+		sah_bin acc;
+		for (int i = sah_bin_count - 1; i > 0; i--)
+		{
+			acc.grow(bins[i].min, bins[i].max);
+			acc.count += bins[i].count;
+			right_area[i] = acc.get_surface_area();
+			right_count[i] = acc.count;
+		}
+
+		// Sweep from the left and evaluate split after each bin
+		acc = sah_bin{};
+		for (int i = 0; i < sah_bin_count - 1; i++)
+		{
+			acc.grow(bins[i].min, bins[i].max);
+			acc.count += bins[i].count;
+			long nl = acc.count;
+			long nr = right_count[i + 1];
+			if (nl == 0 || nr == 0) continue;
+
+			float c = sah_ct + acc.get_surface_area() / Sp * nl * sah_ci + right_area[i + 1] / Sp * nr * sah_ci;
+			if (c < best_cost)
+			{
+				best_cost = c;
+				best_axis = axis;
+				best_bin = i;
+			}
+		}
+	}
+
+	// Compare best split cost to 'leaving as is' cost
+	if (best_axis < 0 || best_cost > np * sah_ci)
+		return nullptr;
+
+	// Partition primitives in place
+	node.axis = best_axis;
+	float scale = sah_bin_count / (cmax[best_axis] - cmin[best_axis]);
+	return std::partition(node.begin, node.end, [&](const T &t){
+		int b = std::min(static_cast<int>((t.get_aabb().get_center()[best_axis] - cmin[best_axis]) * scale), sah_bin_count - 1);
+		return b <= best_bin;
+	});
+}
+
+}
@@ -0,0 +1,565 @@
+#include "bvh_cache.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <type_traits>
+#include <unordered_map>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using rt::bvh_cache;
+
+namespace {
+
+//! Bumped whenever the file layout or the tree contents change
+constexpr std::uint32_t cache_version = 3;
+
+constexpr char cache_magic[8] = {'R', 'T', 'B', 'V', 'H', 0, 0, 0};
+
+//! Sections are aligned, so triangle blocks can be used straight from the mapping
+constexpr std::uint64_t section_alignment = 64;
+
+static_assert(std::is_trivially_copyable_v<rt::bvh_tree_node>);
+static_assert(std::is_trivially_copyable_v<rt::triangle_block>);
+static_assert(std::is_trivially_copyable_v<rt::triangle>);
+static_assert(std::is_trivially_copyable_v<rt::sphere>);
+static_assert(std::is_trivially_copyable_v<rt::plane>);
+static_assert(alignof(rt::triangle_block) <= section_alignment);
+static_assert(alignof(rt::triangle) <= section_alignment);
+
+struct cache_section
+{
+	std::uint64_t offset;
+	std::uint64_t count;
+};
+
+struct cache_header
+{
+	char magic[8];
+	std::uint32_t version;
+
+	//! Element sizes - files written by incompatible builds are rejected
+	std::uint32_t node_size;
+	std::uint32_t block_size;
+	std::uint32_t triangle_size;
+	std::uint32_t sphere_size;
+	std::uint32_t plane_size;
+
+	std::uint64_t hash;
+
+	//! FNV-1a hash of the header with this field set to zero
+	std::uint64_t checksum;
+
+	//! Size of the scene's material list primitives refer to
+	std::uint64_t material_count;
+
+	std::int32_t depth;
+	std::int32_t sphere_depth;
+	float sah_cost;
+	float built_sah_cost;
+	float built_sphere_sah_cost;
+	std::uint32_t padding;
+
+	cache_section nodes;
+	cache_section blocks;
+	cache_section triangles;
+	cache_section triangle_materials;
+	cache_section source_index;
+	cache_section sphere_nodes;
+	cache_section spheres;
+	cache_section sphere_materials;
+	cache_section sphere_source_index;
+	cache_section planes;
+	cache_section plane_materials;
+	cache_section object_offsets;
+};
+
+/**
+	Read-only memory mapping of an entire file
+*/
+class mapped_file
+{
+public:
+	explicit mapped_file(const std::string &path)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return;
+
+		struct stat st;
+		if (::fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			void *ptr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (ptr != MAP_FAILED)
+			{
+				m_data = static_cast<const std::uint8_t*>(ptr);
+				m_size = st.st_size;
+			}
+		}
+
+		// The mapping remains valid after the descriptor is closed
+		::close(fd);
+	}
+
+	mapped_file(const mapped_file &) = delete;
+	mapped_file &operator=(const mapped_file &) = delete;
+
+	~mapped_file()
+	{
+		if (m_data)
+			::munmap(const_cast<std::uint8_t*>(m_data), m_size);
+	}
+
+	const std::uint8_t *data() const
+	{
+		return m_data;
+	}
+
+	std::size_t size() const
+	{
+		return m_size;
+	}
+
+private:
+	const std::uint8_t *m_data = nullptr;
+	std::size_t m_size = 0;
+};
+
+std::uint64_t align_offset(std::uint64_t offset)
+{
+	return (offset + section_alignment - 1) / section_alignment * section_alignment;
+}
+
+/**
+	FNV-1a hash of a memory block
+*/
+void hash_bytes(std::uint64_t &hash, const void *data, std::size_t size)
+{
+	const auto *bytes = static_cast<const std::uint8_t*>(data);
+	for (std::size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+}
+
+template <typename T>
+void hash_value(std::uint64_t &hash, const T &value)
+{
+	hash_bytes(hash, &value, sizeof(T));
+}
+
+/**
+	Hashes a memory block 8 bytes at a time - meshes are too large for hash_bytes()
+*/
+void hash_words(std::uint64_t &hash, const void *data, std::size_t size)
+{
+	const auto *bytes = static_cast<const std::uint8_t*>(data);
+	std::size_t i = 0;
+	for (; i + sizeof(std::uint64_t) <= size; i += sizeof(std::uint64_t))
+	{
+		std::uint64_t word;
+		std::memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+		hash ^= hash >> 32;
+	}
+
+	hash_bytes(hash, bytes + i, size - i);
+}
+
+std::unordered_map<const rt::abstract_material*, std::uint32_t> index_materials(const std::vector<std::shared_ptr<rt::abstract_material>> &materials)
+{
+	std::unordered_map<const rt::abstract_material*, std::uint32_t> material_index;
+	for (std::uint32_t i = 0; i < materials.size(); i++)
+		material_index.emplace(materials[i].get(), i);
+	return material_index;
+}
+
+std::uint64_t header_checksum(cache_header header)
+{
+	header.checksum = 0;
+	std::uint64_t hash = 0xcbf29ce484222325ull;
+	hash_value(hash, header);
+	return hash;
+}
+
+/**
+	Checks whether section lies within the file
+*/
+bool check_section(const cache_section &s, std::size_t element_size, std::size_t file_size)
+{
+	return s.offset % section_alignment == 0
+		&& s.offset <= file_size
+		&& s.count <= (file_size - s.offset) / element_size;
+}
+
+/**
+	Copies primitives stored without material pointers and restores them
+
+	\returns false if a material index is out of range
+*/
+template <typename T>
+bool restore_primitives(const T *primitives, const std::uint32_t *material_indices, std::uint64_t count, const std::vector<std::shared_ptr<rt::abstract_material>> &materials, std::vector<T> &result)
+{
+	result.assign(primitives, primitives + count);
+	for (std::uint64_t i = 0; i < count; i++)
+	{
+		if (material_indices[i] >= materials.size())
+			return false;
+
+		result[i].material = materials[material_indices[i]].get();
+	}
+
+	return true;
+}
+
+}
+
+bvh_cache::bvh_cache(std::string directory, std::uint64_t max_size) :
+	m_directory(std::move(directory)),
+	m_max_size(max_size)
+{
+	if (::mkdir(m_directory.c_str(), 0755) != 0 && errno != EEXIST)
+		throw std::runtime_error("Cannot create BVH cache directory '" + m_directory + "'");
+}
+
+std::string bvh_cache::get_path(std::uint64_t hash) const
+{
+	std::stringstream ss;
+	ss << m_directory << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bvh";
+	return ss.str();
+}
+
+std::unique_ptr<rt::bvh_tree> bvh_cache::get_tree(const rt::scene &scene, const bvh_build_params &params) const
+{
+	std::uint64_t hash = hash_scene(scene, params);
+	std::string path = get_path(hash);
+
+	if (auto tree = load(path, hash, scene.get_materials(), params))
+	{
+		// Modification time marks the file as recently used
+		::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+		return tree;
+	}
+
+	std::vector<std::uint32_t> object_offsets;
+	rt::primitive_collection primitives{scene.get_transformed_primitives(&object_offsets)};
+	auto tree = std::make_unique<rt::bvh_tree>(std::move(primitives), std::move(object_offsets), params);
+
+	// The tree is still usable if it can't be cached
+	try
+	{
+		save(*tree, path, hash, scene.get_materials());
+		evict();
+	}
+	catch (const std::exception &ex)
+	{
+		std::cerr << "Could not save BVH to cache - " << ex.what() << std::endl;
+	}
+
+	return tree;
+}
+
+/**
+	Removes least recently used files until the cache fits in its size limit.
+	The newest file is always kept. Files mapped by running renderers stay
+	valid until they're unmapped.
+*/
+void bvh_cache::evict() const
+{
+	struct cached_file
+	{
+		std::string path;
+		std::uint64_t size;
+		std::int64_t time;
+	};
+
+	DIR *dir = ::opendir(m_directory.c_str());
+	if (!dir) return;
+
+	std::vector<cached_file> files;
+	while (const dirent *entry = ::readdir(dir))
+	{
+		std::string name = entry->d_name;
+		if (name.size() < 4 || name.compare(name.size() - 4, 4, ".bvh") != 0)
+			continue;
+
+		std::string path = m_directory + "/" + name;
+		struct stat st;
+		if (::stat(path.c_str(), &st) == 0)
+			files.push_back({path, static_cast<std::uint64_t>(st.st_size), st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec});
+	}
+	::closedir(dir);
+
+	std::sort(files.begin(), files.end(), [](const cached_file &a, const cached_file &b){
+		return a.time > b.time;
+	});
+
+	std::uint64_t total_size = 0;
+	for (std::size_t i = 0; i < files.size(); i++)
+	{
+		total_size += files[i].size;
+		if (i > 0 && total_size > m_max_size)
+			std::remove(files[i].path.c_str());
+	}
+}
+
+std::uint64_t bvh_cache::hash_scene(const rt::scene &scene, const bvh_build_params &params)
+{
+	std::uint64_t hash = 0xcbf29ce484222325ull;
+	hash_value(hash, cache_version);
+	hash_value(hash, params.method);
+	hash_value(hash, params.optimize_layout);
+	if (params.method == bvh_build_method::SPATIAL_SAH)
+		hash_value(hash, params.max_duplication);
+	hash_value(hash, params.per_object);
+
+	// Primitives are stored with indices of their materials
+	auto material_index = index_materials(scene.get_materials());
+	auto hash_material = [&](const abstract_material *material)
+	{
+		auto it = material_index.find(material);
+		hash_value(hash, it != material_index.end() ? it->second : ~std::uint32_t{0});
+	};
+
+	hash_value(hash, scene.get_materials().size());
+	hash_value(hash, scene.get_objects().size());
+	for (const auto &object : scene.get_objects())
+	{
+		const rt::primitive_collection &primitives = object->get_primitives();
+		hash_value(hash, object->get_transform());
+
+		hash_value(hash, primitives.triangles.size());
+		for (const auto &t : primitives.triangles)
+		{
+			hash_words(hash, t.vertices, sizeof(t.vertices));
+			hash_words(hash, t.normals, sizeof(t.normals));
+			hash_words(hash, t.uvs, sizeof(t.uvs));
+			hash_material(t.material);
+		}
+
+		hash_value(hash, primitives.spheres.size());
+		for (const auto &s : primitives.spheres)
+		{
+			hash_value(hash, s.origin);
+			hash_value(hash, s.radius);
+			hash_material(s.material);
+		}
+
+		hash_value(hash, primitives.planes.size());
+		for (const auto &p : primitives.planes)
+		{
+			hash_value(hash, p.origin);
+			hash_value(hash, p.normal);
+			hash_material(p.material);
+		}
+	}
+
+	return hash;
+}
+
+void bvh_cache::save(const rt::bvh_tree &tree, const std::string &path, std::uint64_t hash, const std::vector<std::shared_ptr<abstract_material>> &materials)
+{
+	auto material_index = index_materials(materials);
+	auto get_material_index = [&material_index](const abstract_material *material)
+	{
+		auto it = material_index.find(material);
+		if (it == material_index.end())
+			throw std::runtime_error("primitive material is not in the scene's material list");
+		return it->second;
+	};
+
+	// Primitives are stored without material pointers - they refer to the materials by index
+	std::vector<triangle> triangles(tree.m_triangles.begin(), tree.m_triangles.end());
+	std::vector<std::uint32_t> triangle_materials(triangles.size());
+	for (std::uint32_t i = 0; i < triangles.size(); i++)
+	{
+		triangle_materials[i] = get_material_index(tree.get_triangle_material(i));
+		triangles[i].material = nullptr;
+	}
+
+	auto strip_materials = [&](auto &primitives, std::vector<std::uint32_t> &indices)
+	{
+		indices.resize(primitives.size());
+		for (std::uint32_t i = 0; i < primitives.size(); i++)
+		{
+			indices[i] = get_material_index(primitives[i].material);
+			primitives[i].material = nullptr;
+		}
+	};
+
+	std::vector<sphere> spheres = tree.m_spheres;
+	std::vector<plane> planes = tree.m_planes;
+	std::vector<std::uint32_t> sphere_materials, plane_materials;
+	strip_materials(spheres, sphere_materials);
+	strip_materials(planes, plane_materials);
+
+	cache_header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, cache_magic, sizeof(header.magic));
+	header.version = cache_version;
+	header.node_size = sizeof(bvh_tree_node);
+	header.block_size = sizeof(triangle_block);
+	header.triangle_size = sizeof(triangle);
+	header.sphere_size = sizeof(sphere);
+	header.plane_size = sizeof(plane);
+	header.hash = hash;
+	header.material_count = materials.size();
+	header.depth = tree.m_depth;
+	header.sphere_depth = tree.m_sphere_depth;
+	header.sah_cost = tree.m_sah_cost;
+	header.built_sah_cost = tree.m_built_sah_cost;
+	header.built_sphere_sah_cost = tree.m_built_sphere_sah_cost;
+
+	// Section data in the order of appearance in the file
+	struct section_data
+	{
+		cache_section &section;
+		const void *data;
+		std::uint64_t count;
+		std::size_t element_size;
+	};
+
+	section_data sections[] = {
+		{header.nodes, tree.m_nodes.data(), tree.m_nodes.size(), sizeof(bvh_tree_node)},
+		{header.blocks, tree.m_blocks.data(), tree.m_blocks.size(), sizeof(triangle_block)},
+		{header.triangles, triangles.data(), triangles.size(), sizeof(triangle)},
+		{header.triangle_materials, triangle_materials.data(), triangle_materials.size(), sizeof(std::uint32_t)},
+		{header.source_index, tree.m_source_index.data(), tree.m_source_index.size(), sizeof(std::uint32_t)},
+		{header.sphere_nodes, tree.m_sphere_nodes.data(), tree.m_sphere_nodes.size(), sizeof(bvh_tree_node)},
+		{header.spheres, spheres.data(), spheres.size(), sizeof(sphere)},
+		{header.sphere_materials, sphere_materials.data(), sphere_materials.size(), sizeof(std::uint32_t)},
+		{header.sphere_source_index, tree.m_sphere_source_index.data(), tree.m_sphere_source_index.size(), sizeof(std::uint32_t)},
+		{header.planes, planes.data(), planes.size(), sizeof(plane)},
+		{header.plane_materials, plane_materials.data(), plane_materials.size(), sizeof(std::uint32_t)},
+		{header.object_offsets, tree.m_object_offsets.data(), tree.m_object_offsets.size(), sizeof(std::uint32_t)},
+	};
+
+	std::uint64_t offset = align_offset(sizeof(header));
+	for (auto &s : sections)
+	{
+		s.section.offset = offset;
+		s.section.count = s.count;
+		offset = align_offset(offset + s.count * s.element_size);
+	}
+
+	header.checksum = header_checksum(header);
+
+	// Write to a temporary file first and replace the old one when done
+	std::string tmp_path = path + ".tmp" + std::to_string(::getpid());
+	std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+	if (!f)
+		throw std::runtime_error("Cannot open '" + tmp_path + "' for writing");
+
+	const char zeros[section_alignment] = {};
+	f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	std::uint64_t position = sizeof(header);
+	for (const auto &s : sections)
+	{
+		f.write(zeros, s.section.offset - position);
+		f.write(static_cast<const char*>(s.data), s.count * s.element_size);
+		position = s.section.offset + s.count * s.element_size;
+	}
+
+	f.close();
+	if (!f || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+	{
+		std::remove(tmp_path.c_str());
+		throw std::runtime_error("Cannot write '" + path + "'");
+	}
+}
+
+std::unique_ptr<rt::bvh_tree> bvh_cache::load(const std::string &path, std::uint64_t hash, const std::vector<std::shared_ptr<abstract_material>> &materials, const bvh_build_params &params)
+{
+	auto file = std::make_shared<mapped_file>(path);
+	if (!file->data() || file->size() < sizeof(cache_header))
+		return nullptr;
+
+	cache_header header;
+	std::memcpy(&header, file->data(), sizeof(header));
+
+	// Only the header is checked - sections are paged in when they're used
+	bool valid = std::memcmp(header.magic, cache_magic, sizeof(header.magic)) == 0
+		&& header.checksum == header_checksum(header)
+		&& header.version == cache_version
+		&& header.node_size == sizeof(bvh_tree_node)
+		&& header.block_size == sizeof(triangle_block)
+		&& header.triangle_size == sizeof(triangle)
+		&& header.sphere_size == sizeof(sphere)
+		&& header.plane_size == sizeof(plane)
+		&& header.hash == hash
+		&& header.material_count == materials.size()
+		&& header.triangle_materials.count == header.triangles.count
+		&& header.source_index.count == header.triangles.count
+		&& header.sphere_materials.count == header.spheres.count
+		&& header.sphere_source_index.count == header.spheres.count
+		&& header.plane_materials.count == header.planes.count
+		&& check_section(header.nodes, sizeof(bvh_tree_node), file->size())
+		&& check_section(header.blocks, sizeof(triangle_block), file->size())
+		&& check_section(header.triangles, sizeof(triangle), file->size())
+		&& check_section(header.triangle_materials, sizeof(std::uint32_t), file->size())
+		&& check_section(header.source_index, sizeof(std::uint32_t), file->size())
+		&& check_section(header.sphere_nodes, sizeof(bvh_tree_node), file->size())
+		&& check_section(header.spheres, sizeof(sphere), file->size())
+		&& check_section(header.sphere_materials, sizeof(std::uint32_t), file->size())
+		&& check_section(header.sphere_source_index, sizeof(std::uint32_t), file->size())
+		&& check_section(header.planes, sizeof(plane), file->size())
+		&& check_section(header.plane_materials, sizeof(std::uint32_t), file->size())
+		&& check_section(header.object_offsets, sizeof(std::uint32_t), file->size());
+
+	if (!valid)
+		return nullptr;
+
+	auto section_ptr = [&file](const cache_section &s)
+	{
+		return file->data() + s.offset;
+	};
+
+	auto indices = [&section_ptr](const cache_section &s)
+	{
+		return reinterpret_cast<const std::uint32_t*>(section_ptr(s));
+	};
+
+	std::unique_ptr<rt::bvh_tree> tree{new rt::bvh_tree{params}};
+	tree->m_nodes.map(reinterpret_cast<const bvh_tree_node*>(section_ptr(header.nodes)), header.nodes.count, file);
+	tree->m_blocks.map(reinterpret_cast<const triangle_block*>(section_ptr(header.blocks)), header.blocks.count, file);
+	tree->m_triangles.map(reinterpret_cast<const triangle*>(section_ptr(header.triangles)), header.triangles.count, file);
+	tree->m_triangle_materials.map(indices(header.triangle_materials), header.triangle_materials.count, file);
+	tree->m_source_index.map(indices(header.source_index), header.source_index.count, file);
+	tree->m_sphere_nodes.map(reinterpret_cast<const bvh_tree_node*>(section_ptr(header.sphere_nodes)), header.sphere_nodes.count, file);
+	tree->m_depth = header.depth;
+	tree->m_sphere_depth = header.sphere_depth;
+	tree->m_sah_cost = header.sah_cost;
+	tree->m_built_sah_cost = header.built_sah_cost;
+	tree->m_built_sphere_sah_cost = header.built_sphere_sah_cost;
+
+	tree->m_materials.reserve(materials.size());
+	for (const auto &m : materials)
+		tree->m_materials.push_back(m.get());
+
+	// Spheres and planes are few - they're copied with their material pointers
+	auto spheres = reinterpret_cast<const sphere*>(section_ptr(header.spheres));
+	auto planes = reinterpret_cast<const plane*>(section_ptr(header.planes));
+	if (!restore_primitives(spheres, indices(header.sphere_materials), header.spheres.count, materials, tree->m_spheres)
+		|| !restore_primitives(planes, indices(header.plane_materials), header.planes.count, materials, tree->m_planes))
+		return nullptr;
+
+	auto sphere_source_index = indices(header.sphere_source_index);
+	tree->m_sphere_source_index.assign(sphere_source_index, sphere_source_index + header.sphere_source_index.count);
+
+	auto object_offsets = indices(header.object_offsets);
+	tree->m_object_offsets.assign(object_offsets, object_offsets + header.object_offsets.count);
+
+	tree->check_materials();
+	return tree;
+}
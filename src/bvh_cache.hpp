@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <vector>
+
+#include "bvh_tree.hpp"
+#include "scene.hpp"
+
+namespace rt {
+
+/**
+	Stores built BVH trees on disk, so scenes which have been rendered before
+	don't have to wait for the build.
+
+	Trees are keyed by a hash of the scene's geometry, materials of the primitives
+	and build parameters, so the same scene hits the cache wherever it's loaded
+	from. Objects are hashed along with their transforms, without transforming
+	or copying their primitives. Cached files are memory-mapped when loaded - nodes, triangle blocks
+	and triangles in the tree order are used directly from the mapping and only
+	paged in when traversal touches them. Triangles refer to their materials by
+	index into the scene's material list instead of a pointer. Spheres and planes
+	are few, so they're copied with their material pointers restored.
+
+	Files are replaced atomically, so only the header is validated when a tree is
+	loaded (with a checksum) - the sections are trusted not to be damaged. Least
+	recently used files are removed once the cache outgrows its size limit.
+*/
+class bvh_cache
+{
+public:
+	//! Default limit of the total size of cached files
+	static constexpr std::uint64_t default_max_size = 16ull << 30;
+
+	explicit bvh_cache(std::string directory, std::uint64_t max_size = default_max_size);
+
+	/**
+		Loads tree for the scene from the cache. If there's no valid cached tree,
+		a new one is built and saved.
+	*/
+	std::unique_ptr<bvh_tree> get_tree(const scene &scene, const bvh_build_params &params = {}) const;
+
+	/**
+		Computes hash of everything the tree depends on - primitives of all objects
+		with their transforms and material indices, and build parameters affecting
+		the tree structure
+	*/
+	static std::uint64_t hash_scene(const scene &scene, const bvh_build_params &params);
+
+	/**
+		Writes the tree to a file. The file is replaced atomically, so readers
+		never see it partially written. Materials of all primitives must be
+		in `materials`.
+	*/
+	static void save(const bvh_tree &tree, const std::string &path, std::uint64_t hash, const std::vector<std::shared_ptr<abstract_material>> &materials);
+
+	/**
+		Maps cached tree. Primitives' materials are taken from `materials` -
+		the same list the tree was saved with.
+
+		\returns nullptr if the file doesn't exist or doesn't match the hash or materials
+	*/
+	static std::unique_ptr<bvh_tree> load(const std::string &path, std::uint64_t hash, const std::vector<std::shared_ptr<abstract_material>> &materials, const bvh_build_params &params = {});
+
+private:
+	std::string get_path(std::uint64_t hash) const;
+	void evict() const;
+
+	std::string m_directory;
+	std::uint64_t m_max_size;
+};
+
+}
@@ -1,44 +1,420 @@
 #include "bvh_tree.hpp"
 
+#include <cmath>
 #include <stack>
-#include <memory>
-#include <future>
+#include <chrono>
+#include <algorithm>
 
 #include "ray.hpp"
-#include "containers/linear_stack.hpp"
+#include "sbvh_builder.hpp"
+#include "lbvh_builder.hpp"
+#include "containers/short_stack.hpp"
+#include "traversal_stats.hpp"
 
 using rt::bvh_tree;
 using rt::bvh_tree_node;
 
-bvh_tree_node::bvh_tree_node(rt::triangle *b, rt::triangle *e) :
-	begin(b),
-	end(e)
+namespace {
+
+/**
+	Builds a tree over primitive references with the method selected in the
+	parameters and reorders the references to match the leaves
+*/
+rt::bvh_build_stats build_over_refs(std::vector<rt::bvh_primitive_ref> &refs, const rt::bvh_build_params &params, std::vector<bvh_tree_node> &nodes, int &depth)
+{
+	if (params.method == rt::bvh_build_method::LBVH)
+	{
+		rt::lbvh_builder builder{params};
+		builder.build(refs);
+		nodes = std::move(builder.get_nodes());
+		depth = builder.get_depth();
+		return builder.get_stats();
+	}
+
+	rt::bvh_builder<rt::bvh_primitive_ref> builder{params};
+	builder.build(refs);
+	nodes = std::move(builder.get_nodes());
+	depth = builder.get_depth();
+	return builder.get_stats();
+}
+
+
+/**
+	Builds a tree over triangles with the method selected in the parameters
+
+	\returns indices of the triangles referenced by the leaves
+*/
+std::vector<std::uint32_t> build_over_triangles(const std::vector<rt::triangle> &triangles, const rt::bvh_build_params &params, std::vector<bvh_tree_node> &nodes, int &depth, rt::bvh_build_stats &stats)
+{
+	// Triangles can be referenced more than once, so they're not reordered
+	if (params.method == rt::bvh_build_method::SPATIAL_SAH)
+	{
+		rt::sbvh_builder builder{params};
+		builder.build(triangles);
+
+		nodes = std::move(builder.get_nodes());
+		depth = builder.get_depth();
+		stats = builder.get_stats();
+		return std::move(builder.get_references());
+	}
+
+	// Build over lightweight references instead of entire triangles
+	std::vector<rt::bvh_primitive_ref> refs(triangles.size());
+	for (std::uint32_t i = 0; i < triangles.size(); i++)
+	{
+		rt::aabb box{triangles[i].get_aabb()};
+		refs[i] = {box.get_min(), box.get_max(), i};
+	}
+
+	stats = build_over_refs(refs, params, nodes, depth);
+
+	std::vector<std::uint32_t> references;
+	references.reserve(refs.size());
+	for (const auto &ref : refs)
+		references.push_back(ref.index);
+	return references;
+}
+
+/**
+	Builds a SAH tree over bounding boxes of objects, with a single object in
+	each leaf. Leaves store the object index in `offset`. There are few
+	objects compared to primitives, so all splits are evaluated.
+*/
+std::vector<bvh_tree_node> build_object_level(std::vector<rt::bvh_primitive_ref> &objects)
+{
+	auto surface_area = [](const glm::vec3 &min, const glm::vec3 &max)
+	{
+		glm::vec3 d = max - min;
+		return d.x * d.y + d.x * d.z + d.y * d.z;
+	};
+
+	// Range of objects and index of its node
+	struct object_range
+	{
+		std::uint32_t begin;
+		std::uint32_t end;
+		std::uint32_t index;
+	};
+
+	std::vector<bvh_tree_node> nodes(1);
+	std::stack<object_range, std::vector<object_range>> to_process;
+	to_process.push({0, static_cast<std::uint32_t>(objects.size()), 0});
+
+	std::vector<float> right_area(objects.size());
+	while (!to_process.empty())
+	{
+		object_range r = to_process.top();
+		to_process.pop();
+
+		glm::vec3 min{HUGE_VALF}, max{-HUGE_VALF};
+		for (std::uint32_t i = r.begin; i < r.end; i++)
+		{
+			min = glm::min(min, objects[i].min);
+			max = glm::max(max, objects[i].max);
+		}
+
+		bvh_tree_node &node = nodes[r.index];
+		node.min = min;
+		node.max = max;
+		node.axis = 0;
+		node.padding = 0;
+
+		if (r.end - r.begin == 1)
+		{
+			node.offset = objects[r.begin].index;
+			node.count = 1;
+			continue;
+		}
+
+		auto sort_objects = [&](int axis)
+		{
+			std::sort(objects.begin() + r.begin, objects.begin() + r.end, [axis](const rt::bvh_primitive_ref &a, const rt::bvh_primitive_ref &b){
+				return a.min[axis] + a.max[axis] < b.min[axis] + b.max[axis];
+			});
+		};
+
+		// Sweep over objects sorted along each axis
+		int best_axis = 0;
+		std::uint32_t best_split = r.begin + 1;
+		float best_cost = HUGE_VALF;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			sort_objects(axis);
+
+			glm::vec3 rmin{HUGE_VALF}, rmax{-HUGE_VALF};
+			for (std::uint32_t i = r.end - 1; i > r.begin; i--)
+			{
+				rmin = glm::min(rmin, objects[i].min);
+				rmax = glm::max(rmax, objects[i].max);
+				right_area[i] = surface_area(rmin, rmax);
+			}
+
+			glm::vec3 lmin{HUGE_VALF}, lmax{-HUGE_VALF};
+			for (std::uint32_t i = r.begin + 1; i < r.end; i++)
+			{
+				lmin = glm::min(lmin, objects[i - 1].min);
+				lmax = glm::max(lmax, objects[i - 1].max);
+				float cost = surface_area(lmin, lmax) * (i - r.begin) + right_area[i] * (r.end - i);
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = i;
+				}
+			}
+		}
+
+		if (best_axis != 2)
+			sort_objects(best_axis);
+
+		std::uint32_t child = nodes.size();
+		node.offset = child;
+		node.count = 0;
+		node.axis = best_axis;
+		nodes.emplace_back();
+		nodes.emplace_back();
+
+		to_process.push({best_split, r.end, child + 1});
+		to_process.push({r.begin, best_split, child});
+	}
+
+	return nodes;
+}
+
+/**
+	FNV-1a hash of triangle vertices
+*/
+void hash_vertices(std::uint64_t &hash, const rt::triangle &t)
 {
-	aabb vol{b->get_aabb()};
-	for (auto p = b + 1; p < e; p++)
-		vol = aabb{vol, p->get_aabb()};
-	bounding_volume = vol;
+	auto bytes = reinterpret_cast<const unsigned char*>(t.vertices);
+	for (std::size_t i = 0; i < sizeof(t.vertices); i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
 }
 
-bvh_tree::bvh_tree(const rt::scene &scene) :
-	m_tree(4)
+/**
+	Reorders nodes into treelets - groups of nodes likely to be visited
+	together, which are stored next to each other. Treelets are grown
+	greedily from their roots by expanding the node with the largest
+	surface area, and the subtrees left below them form further treelets
+	in depth-first order, the most likely ones first. Children of each node
+	stay next to each other and after their parent.
+
+	Leaves are renumbered, so that their primitive ranges follow the new node order.
+
+	\returns original index of each primitive in the new order
+*/
+std::vector<std::uint32_t> cluster_nodes(std::vector<bvh_tree_node> &nodes)
 {
-	//! \todo Improve BVH build process by partitioning entire objects first
+	// Number of sibling pairs (64 bytes each) expanded in each treelet
+	constexpr int treelet_size = 4;
+
+	auto surface_area = [&nodes](std::uint32_t index)
+	{
+		glm::vec3 d = nodes[index].max - nodes[index].min;
+		return d.x * d.y + d.x * d.z + d.y * d.z;
+	};
+
+	// Interior node already placed in the new array, whose children aren't
+	struct placed_node
+	{
+		std::uint32_t source;
+		std::uint32_t index;
+	};
+
+	auto by_area = [&](const placed_node &a, const placed_node &b)
+	{
+		return surface_area(a.source) < surface_area(b.source);
+	};
+
+	std::vector<bvh_tree_node> result;
+	result.reserve(nodes.size());
+	result.push_back(nodes[0]);
+
+	std::stack<placed_node, std::vector<placed_node>> treelet_roots;
+	if (!nodes[0].is_leaf())
+		treelet_roots.push({0, 0});
+
+	std::vector<placed_node> open;
+	while (!treelet_roots.empty())
+	{
+		open.assign(1, treelet_roots.top());
+		treelet_roots.pop();
+
+		for (int i = 0; i < treelet_size && !open.empty(); i++)
+		{
+			auto it = std::max_element(open.begin(), open.end(), by_area);
+			placed_node parent = *it;
+			*it = open.back();
+			open.pop_back();
+
+			std::uint32_t child = result.size();
+			std::uint32_t source_child = nodes[parent.source].offset;
+			result[parent.index].offset = child;
+			for (int c = 0; c < 2; c++)
+			{
+				result.push_back(nodes[source_child + c]);
+				if (!nodes[source_child + c].is_leaf())
+					open.push_back({source_child + c, child + c});
+			}
+		}
+
+		// The largest remaining subtree ends up on top of the stack
+		std::sort(open.begin(), open.end(), by_area);
+		for (const auto &n : open)
+			treelet_roots.push(n);
+	}
 
-	// Unpack and decompose scene
-	for (const auto &obj_ptr : scene.get_objects())
+	std::vector<std::uint32_t> order;
+	for (auto &n : result)
 	{
-		primitive_collection col{obj_ptr->get_transformed_primitive_collection()};
-		std::copy(col.triangles.begin(), col.triangles.end(), std::back_inserter(m_triangles));
-		std::copy(col.spheres.begin(), col.spheres.end(), std::back_inserter(m_spheres));
-		std::copy(col.planes.begin(), col.planes.end(), std::back_inserter(m_planes));
+		if (!n.is_leaf()) continue;
+
+		std::uint32_t first = n.offset;
+		n.offset = order.size();
+		for (std::uint32_t i = 0; i < n.count; i++)
+			order.push_back(first + i);
 	}
 
-	// Verify primitives' materials
+	nodes = std::move(result);
+	return order;
+}
+
+float surface_area(const bvh_tree_node &n)
+{
+	glm::vec3 d = n.max - n.min;
+	return 2.f * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+
+/**
+	Computes SAH cost of a subtree using the same constants as the builder.
+	The cost isn't divided by the root's surface area.
+*/
+double sah_cost(const bvh_tree_node *nodes, std::uint32_t root)
+{
+	using builder = rt::bvh_builder<rt::bvh_primitive_ref>;
+	double cost = 0.0;
+
+	std::stack<std::uint32_t, std::vector<std::uint32_t>> to_process;
+	to_process.push(root);
+	while (!to_process.empty())
+	{
+		const bvh_tree_node &n = nodes[to_process.top()];
+		to_process.pop();
+
+		if (n.is_leaf())
+			cost += surface_area(n) * n.count * builder::sah_ci;
+		else
+		{
+			cost += surface_area(n) * builder::sah_ct;
+			to_process.push(n.offset);
+			to_process.push(n.offset + 1);
+		}
+	}
+
+	return cost;
+}
+
+}
+
+bvh_tree::bvh_tree(const rt::scene &scene, const bvh_build_params &params) :
+	m_build_params(params)
+{
+	init(scene.get_transformed_primitives(&m_object_offsets));
+}
+
+bvh_tree::bvh_tree(rt::primitive_collection primitives, const bvh_build_params &params) :
+	m_build_params(params)
+{
+	init(std::move(primitives));
+}
+
+bvh_tree::bvh_tree(rt::primitive_collection primitives, std::vector<std::uint32_t> object_offsets, const bvh_build_params &params) :
+	m_build_params(params),
+	m_object_offsets(std::move(object_offsets))
+{
+	init(std::move(primitives));
+}
+
+bvh_tree::bvh_tree(const bvh_build_params &params) :
+	m_build_params(params)
+{
+}
+
+bvh_tree::bvh_tree(const bvh_tree &other) :
+	ray_accelerator(other),
+	m_build_params(other.m_build_params),
+	m_build_stats(other.m_build_stats),
+	m_sphere_build_stats(other.m_sphere_build_stats),
+	m_nodes(other.m_nodes),
+	m_depth(other.m_depth),
+	m_blocks(other.m_blocks),
+	m_triangles(other.m_triangles),
+	m_triangle_materials(other.m_triangle_materials),
+	m_materials(other.m_materials),
+	m_spheres(other.m_spheres),
+	m_planes(other.m_planes),
+	m_sphere_nodes(other.m_sphere_nodes),
+	m_sphere_depth(other.m_sphere_depth),
+	m_source_index(other.m_source_index),
+	m_sphere_source_index(other.m_sphere_source_index),
+	m_object_offsets(other.m_object_offsets),
+	m_object_subtrees(other.m_object_subtrees),
+	m_sah_cost(other.m_sah_cost),
+	m_built_sah_cost(other.m_built_sah_cost),
+	m_built_sphere_sah_cost(other.m_built_sphere_sah_cost)
+{
+	// Counters are still being incremented if the other tree is in use - a snapshot will do
+	if (other.m_visit_counts)
+	{
+		m_visit_counts = std::make_unique<std::atomic<std::uint64_t>[]>(m_nodes.size());
+		for (std::size_t i = 0; i < m_nodes.size(); i++)
+			m_visit_counts[i] = other.m_visit_counts[i].load(std::memory_order_relaxed);
+	}
+}
+
+void bvh_tree::init(rt::primitive_collection primitives)
+{
+	m_triangles = std::move(primitives.triangles);
+	m_spheres = std::move(primitives.spheres);
+	m_planes = std::move(primitives.planes);
+	check_materials();
+
+	for (std::uint32_t i = 0; i < m_object_offsets.size(); i++)
+		if (m_object_offsets[i] > m_triangles.size() || (i > 0 && m_object_offsets[i] < m_object_offsets[i - 1]))
+			throw std::runtime_error("Invalid object offsets passed to bvh_tree");
+
+	std::vector<std::uint32_t> source_index(m_triangles.size());
+	for (std::uint32_t i = 0; i < source_index.size(); i++)
+		source_index[i] = i;
+	m_source_index = std::move(source_index);
+
+	if (m_triangles.size())
+		build_tree();
+
+	if (m_spheres.size())
+		build_sphere_tree();
+}
+
+void bvh_tree::check_materials() const
+{
 	bool bad_mat = false;
-	for (auto &p : m_triangles)
-		if (p.material == nullptr)
-			bad_mat = true;
+
+	// Mapped triangles aren't touched - only the materials they refer to are checked
+	if (m_triangle_materials.empty())
+	{
+		for (auto &p : m_triangles)
+			if (p.material == nullptr)
+				bad_mat = true;
+	}
+	else
+	{
+		for (auto *m : m_materials)
+			if (m == nullptr)
+				bad_mat = true;
+	}
 
 	for (auto &p : m_spheres)
 		if (p.material == nullptr)
@@ -50,234 +426,1097 @@ bvh_tree::bvh_tree(const rt::scene &scene) :
 
 	if (bad_mat)
 		throw std::runtime_error("Some primitives don't have any material assigned. Cannot proceed!");
+}
 
-	if (m_triangles.size())
+/**
+	Returns the triangles for modification. Mapped triangles are copied
+	and get their material pointers back.
+*/
+std::vector<rt::triangle> &bvh_tree::get_mutable_triangles()
+{
+	std::vector<triangle> &triangles = m_triangles.get_mutable();
+	for (std::uint32_t i = 0; i < m_triangle_materials.size(); i++)
+		triangles[i].material = m_materials[m_triangle_materials[i]];
+
+	m_triangle_materials = {};
+	m_materials.clear();
+	return triangles;
+}
+
+void bvh_tree::build_tree()
+{
+	auto t_start = std::chrono::high_resolution_clock::now();
+
+	// Node indices change, so the collected counts are useless
+	m_visit_counts.reset();
+
+	// Triangle indices referenced by the leaves
+	std::vector<std::uint32_t> references;
+
+	if (m_build_params.per_object && m_object_offsets.size() > 1)
+		build_objects(references);
+	else
 	{
-		m_tree.get_root_node().emplace(m_triangles.data(), m_triangles.data() + m_triangles.size());
-		build_tree();
+		std::vector<bvh_tree_node> nodes;
+		references = build_over_triangles(get_mutable_triangles(), m_build_params, nodes, m_depth, m_build_stats);
+		m_nodes = std::move(nodes);
 	}
+
+	finalize_tree(references);
+
+	// Time spent outside of the builder is single-threaded
+	auto t_extra = (std::chrono::high_resolution_clock::now() - t_start) - m_build_stats.build_time;
+	m_build_stats.build_time += t_extra;
+	m_build_stats.work_time += t_extra;
 }
 
-void bvh_tree::build_tree()
+/**
+	Reorders built nodes into treelets (if enabled), triangles to match the
+	leaves and packs the leaves into triangle blocks. References contain
+	indices of triangles in leaves' order and are overwritten.
+*/
+void bvh_tree::finalize_tree(std::vector<std::uint32_t> &references)
 {
-	std::stack<linear_tree<bvh_tree_node>::iterator> to_process;
-	to_process.push(m_tree.get_root_node());	
+	if (m_build_params.optimize_layout)
+	{
+		std::vector<std::uint32_t> order = cluster_nodes(m_nodes.get_mutable());
+		std::vector<std::uint32_t> clustered(order.size());
+		for (std::uint32_t i = 0; i < order.size(); i++)
+			clustered[i] = references[order[i]];
+		references = std::move(clustered);
+	}
 
-	while (!to_process.empty())
+	// Reorder triangles to match the leaves - duplicated references keep the first position
+	const std::vector<triangle> &old_triangles = get_mutable_triangles();
+	std::vector<std::uint32_t> new_index(old_triangles.size(), triangle_block::miss);
+	std::vector<triangle> triangles;
+	std::vector<std::uint32_t> source_index;
+	triangles.reserve(old_triangles.size());
+	source_index.reserve(old_triangles.size());
+	for (auto &ref : references)
 	{
-		auto it = to_process.top();
-		to_process.pop();
+		if (new_index[ref] == triangle_block::miss)
+		{
+			new_index[ref] = triangles.size();
+			triangles.push_back(old_triangles[ref]);
+			source_index.push_back(m_source_index[ref]);
+		}
 
-		// Cost of triangle intersection
-		constexpr float ci = 1.0f;
+		ref = new_index[ref];
+	}
+	m_triangles = std::move(triangles);
+	m_source_index = std::move(source_index);
 
-		// Cost of traversal
-		constexpr float ct = 4.0f;
+	pack_leaves(references);
+	m_sah_cost = m_built_sah_cost = compute_sah_cost(m_nodes);
+}
 
-		// Parent bounding box surface area and triangle count
-		float Sp = it->bounding_volume.get_surface_area();
-		long np = it->end - it->begin;
+/**
+	Builds a separate subtree for each object and joins them with a SAH tree
+	over the objects. Subtrees of objects whose triangles haven't changed since
+	the last build are reused. Large objects are built one after another, each
+	using all threads, and the remaining ones in parallel.
+*/
+void bvh_tree::build_objects(std::vector<std::uint32_t> &references)
+{
+	auto t_start = std::chrono::high_resolution_clock::now();
 
-		using split_info = std::tuple<
-			std::unique_ptr<std::vector<rt::triangle>>,
-			long,
-			float>;
+	std::uint32_t object_count = m_object_offsets.size();
+	auto object_end = [&](std::uint32_t o) -> std::uint32_t
+	{
+		return o + 1 < object_count ? m_object_offsets[o + 1] : m_triangles.size();
+	};
+
+	// Current position of each triangle - triangles are reordered by earlier builds
+	std::vector<std::uint32_t> position(m_triangles.size());
+	for (std::uint32_t i = 0; i < m_triangles.size(); i++)
+		position[m_source_index[i]] = i;
+
+	// Find objects which need to be built
+	m_object_subtrees.resize(object_count);
+	std::vector<std::uint32_t> large_objects, small_objects;
+	for (std::uint32_t o = 0; o < object_count; o++)
+	{
+		if (m_object_offsets[o] == object_end(o)) continue;
+
+		std::uint64_t hash = 0xcbf29ce484222325ull;
+		for (std::uint32_t i = m_object_offsets[o]; i < object_end(o); i++)
+			hash_vertices(hash, m_triangles[position[i]]);
+
+		object_subtree &subtree = m_object_subtrees[o];
+		if (!subtree.nodes.empty() && subtree.hash == hash) continue;
+
+		subtree.hash = hash;
+		if (object_end(o) - m_object_offsets[o] >= large_object_size)
+			large_objects.push_back(o);
+		else
+			small_objects.push_back(o);
+	}
+
+	std::vector<bvh_build_stats> stats(object_count);
+	auto build_object = [&](std::uint32_t o, const bvh_build_params &params)
+	{
+		std::vector<triangle> triangles;
+		triangles.reserve(object_end(o) - m_object_offsets[o]);
+		for (std::uint32_t i = m_object_offsets[o]; i < object_end(o); i++)
+			triangles.push_back(m_triangles[position[i]]);
+
+		object_subtree &subtree = m_object_subtrees[o];
+		subtree.references = build_over_triangles(triangles, params, subtree.nodes, subtree.depth, stats[o]);
+	};
+
+	for (auto o : large_objects)
+		build_object(o, m_build_params);
+
+	// Small objects are built by a single thread each
+	bvh_build_params object_params = m_build_params;
+	object_params.threads = 1;
+	thread_pool pool{m_build_params.threads};
+	{
+		thread_pool::task_group group{pool};
+		for (auto o : small_objects)
+			group.run([&build_object, &object_params, o]{ build_object(o, object_params); });
+		group.wait();
+	}
+
+	auto t_merge = std::chrono::high_resolution_clock::now();
+
+	std::vector<bvh_primitive_ref> objects;
+	for (std::uint32_t o = 0; o < object_count; o++)
+	{
+		if (m_object_offsets[o] == object_end(o)) continue;
 
-		// Calculates all possible split costs for given axis 
-		auto find_best_split = [&](float glm::vec3::* axis)->split_info
+		const bvh_tree_node &root = m_object_subtrees[o].nodes[0];
+		objects.push_back({root.min, root.max, o});
+	}
+
+	// Replace leaves of the top level with the object subtrees. Depth of top
+	// level nodes is known before they're visited, since children follow their parents.
+	std::vector<bvh_tree_node> nodes = build_object_level(objects);
+	std::uint32_t top_count = nodes.size();
+	std::vector<int> depth(top_count, 1);
+	references.clear();
+	m_depth = 0;
+	for (std::uint32_t i = 0; i < top_count; i++)
+	{
+		if (!nodes[i].is_leaf())
 		{
-			auto data = std::make_unique<std::vector<rt::triangle>>(it->begin, it->end);
+			depth[nodes[i].offset] = depth[nodes[i].offset + 1] = depth[i] + 1;
+			continue;
+		}
 
-			// Sort the data
-			std::sort(data->begin(), data->end(), [&](auto &t1, auto &t2){
-				glm::vec3 c1 = (t1.vertices[0] + t1.vertices[1] + t1.vertices[2]) / 3.f;
-				glm::vec3 c2 = (t2.vertices[0] + t2.vertices[1] + t2.vertices[2]) / 3.f;
-				return c1.*axis < c2.*axis;
-			});
+		std::uint32_t o = nodes[i].offset;
+		const object_subtree &subtree = m_object_subtrees[o];
 
-			// Default cost and split
-			float best_cost = HUGE_VALF;
-			long best_split = 0;
+		// Subtree nodes other than the root are appended at the end
+		std::uint32_t node_base = nodes.size() - 1;
+		std::uint32_t reference_base = references.size();
+		auto rebase = [&](bvh_tree_node n)
+		{
+			n.offset += n.is_leaf() ? reference_base : node_base;
+			return n;
+		};
 
-			// AAB collection
-			aabb_collection lcol, rcol(data->begin(), data->end());
+		for (auto r : subtree.references)
+			references.push_back(position[m_object_offsets[o] + r]);
 
-			// Cost calculation for each possible split
-			for (auto split = data->begin(); split != data->end() - 1; split++)
-			{
-				lcol.push(split->get_aabb());
-				rcol.pop(split->get_aabb());
-				long nl = split - data->begin() + 1;
-				long nr = data->end() - split - 1;
+		nodes[i] = rebase(subtree.nodes[0]);
+		for (std::uint32_t j = 1; j < subtree.nodes.size(); j++)
+			nodes.push_back(rebase(subtree.nodes[j]));
+
+		m_depth = std::max(m_depth, depth[i] + subtree.depth - 1);
+	}
+	m_nodes = std::move(nodes);
+
+	auto t_end = std::chrono::high_resolution_clock::now();
+	m_build_stats = bvh_build_stats{};
+	m_build_stats.threads = pool.get_thread_count();
+	m_build_stats.build_time = t_end - t_start;
+	m_build_stats.work_time = t_end - t_merge;
+	for (const auto &s : stats)
+		m_build_stats.work_time += s.work_time;
+}
+
+/**
+	Builds a separate tree over spheres. Its leaves reference ranges
+	of the reordered sphere array directly.
+*/
+void bvh_tree::build_sphere_tree()
+{
+	auto t_start = std::chrono::high_resolution_clock::now();
+
+	std::vector<bvh_primitive_ref> refs(m_spheres.size());
+	for (std::uint32_t i = 0; i < m_spheres.size(); i++)
+	{
+		aabb box{m_spheres[i].get_aabb()};
+		refs[i] = {box.get_min(), box.get_max(), i};
+	}
+
+	std::vector<bvh_tree_node> nodes;
+	bvh_build_stats stats = build_over_refs(refs, m_build_params, nodes, m_sphere_depth);
+
+	std::vector<std::uint32_t> order;
+	if (m_build_params.optimize_layout)
+		order = cluster_nodes(nodes);
+	else
+		for (std::uint32_t i = 0; i < refs.size(); i++)
+			order.push_back(i);
+	m_sphere_nodes = std::move(nodes);
+
+	std::vector<sphere> spheres;
+	spheres.reserve(refs.size());
+	m_sphere_source_index.clear();
+	m_sphere_source_index.reserve(refs.size());
+	for (auto i : order)
+	{
+		spheres.push_back(m_spheres[refs[i].index]);
+		m_sphere_source_index.push_back(refs[i].index);
+	}
+	m_spheres = std::move(spheres);
+
+	m_built_sphere_sah_cost = compute_sah_cost(m_sphere_nodes);
+
+	// Stats of the triangle tree are kept separately, so rebuilding only the spheres doesn't add up
+	auto t_total = std::chrono::high_resolution_clock::now() - t_start;
+	m_sphere_build_stats = stats;
+	m_sphere_build_stats.build_time = t_total;
+	m_sphere_build_stats.work_time += t_total - stats.build_time;
+}
+
+/**
+	Copies spheres into the tree order and recomputes bounds of the sphere
+	tree bottom-up. Children are stored after their parents, so nodes are
+	visited in reversed order.
+
+	\returns true if the sphere tree has been rebuilt instead
+*/
+bool bvh_tree::refit_spheres(const std::vector<sphere> &spheres, float rebuild_threshold)
+{
+	if (spheres.size() != m_spheres.size())
+	{
+		m_spheres = spheres;
+		build_sphere_tree();
+		return true;
+	}
 
-				aabb boxl{lcol.get_aabb()}, boxr{rcol.get_aabb()};
+	if (m_spheres.empty())
+		return false;
 
-				// Box surfaces
-				float Sl = boxl.get_surface_area();
-				float Sr = boxr.get_surface_area();
+	for (std::uint32_t i = 0; i < m_spheres.size(); i++)
+		m_spheres[i] = spheres[m_sphere_source_index[i]];
+
+	std::vector<bvh_tree_node> &nodes = m_sphere_nodes.get_mutable();
+	for (std::size_t i = nodes.size(); i-- > 0;)
+	{
+		bvh_tree_node &n = nodes[i];
+		if (!n.is_leaf())
+		{
+			n.min = glm::min(nodes[n.offset].min, nodes[n.offset + 1].min);
+			n.max = glm::max(nodes[n.offset].max, nodes[n.offset + 1].max);
+			continue;
+		}
 
-				// Calculate split cost
-				float c = ct + Sl / Sp * nl * ci + Sr / Sp * nr * ci;
-				if (c < best_cost)
+		n.min = glm::vec3{HUGE_VALF};
+		n.max = glm::vec3{-HUGE_VALF};
+		for (std::uint32_t j = n.offset; j < n.offset + n.count; j++)
+		{
+			aabb box{m_spheres[j].get_aabb()};
+			n.min = glm::min(n.min, box.get_min());
+			n.max = glm::max(n.max, box.get_max());
+		}
+	}
+
+	if (compute_sah_cost(m_sphere_nodes) <= m_built_sphere_sah_cost * rebuild_threshold)
+		return false;
+
+	// The builder takes spheres in their original order
+	m_spheres = spheres;
+	build_sphere_tree();
+	return true;
+}
+
+/**
+	Packs triangles of each leaf into blocks. Leaves reference
+	the blocks afterwards.
+*/
+void bvh_tree::pack_leaves(const std::vector<std::uint32_t> &references)
+{
+	std::vector<triangle_block> &blocks = m_blocks.get_mutable();
+	blocks.clear();
+
+	for (auto &n : m_nodes.get_mutable())
+	{
+		if (!n.is_leaf()) continue;
+
+		std::uint32_t first = n.offset;
+		n.offset = blocks.size();
+		for (std::uint32_t i = 0; i < n.count; i += triangle_block::width)
+		{
+			triangle_block &block = blocks.emplace_back();
+			for (int j = 0; j < triangle_block::width; j++)
+			{
+				if (i + j < n.count)
 				{
-					best_cost = c;
-					best_split = split - data->begin() + 1; // Mind this +1!
+					std::uint32_t index = references[first + i + j];
+					block.set(j, m_triangles[index], index);
 				}
+				else
+					block.clear(j);
 			}
+		}
+	}
+}
 
-			return {std::move(data), best_split, best_cost};
-		};
+bool bvh_tree::refit(const rt::scene &scene, float rebuild_threshold)
+{
+	return refit(scene.get_transformed_primitives(), rebuild_threshold);
+}
+
+bool bvh_tree::refit(rt::primitive_collection primitives, float rebuild_threshold)
+{
+	if (primitives.triangles.size() != m_triangles.size())
+		throw std::runtime_error("Cannot refit BVH - triangle count has changed");
+
+	m_planes = std::move(primitives.planes);
+	bool rebuilt = refit_spheres(primitives.spheres, rebuild_threshold);
 
-		// Async flags depending on triangle count
-		auto async_policy = (it->end - it->begin) > 10 ? std::launch::async : std::launch::deferred;
-
-		// Find best split point in all axes
-		auto fut_x = std::async(async_policy, find_best_split, &glm::vec3::x);
-		auto fut_y = std::async(async_policy, find_best_split, &glm::vec3::y);
-		auto fut_z = std::async(async_policy, find_best_split, &glm::vec3::z);
-		
-		// Split info for each axis
-		std::unique_ptr<std::vector<triangle>> data_x, data_y, data_z;
-		float cost_x, cost_y, cost_z;
-		long split_x, split_y, split_z;
-
-		// Get data from the futures
-		std::tie(data_x, split_x, cost_x) = fut_x.get();
-		std::tie(data_y, split_y, cost_y) = fut_y.get();
-		std::tie(data_z, split_z, cost_z) = fut_z.get();
-
-		// Best split index and cost
-		std::unique_ptr<std::vector<triangle>> best_data;
-		float best_cost;
-		long best_split = 0;
-
-		// Assume best split in X
-		best_data = std::move(data_x);
-		best_split = split_x;
-		best_cost = cost_x;
-
-		// Check Y
-		if (cost_y < best_cost)
+	if (m_triangles.empty())
+		return rebuilt;
+
+	// Copy vertices into the tree order and update the blocks
+	std::vector<triangle> triangles(m_triangles.size());
+	for (std::uint32_t i = 0; i < triangles.size(); i++)
+		triangles[i] = primitives.triangles[m_source_index[i]];
+	m_triangles = std::move(triangles);
+	m_triangle_materials = {};
+	m_materials.clear();
+
+	refit_nodes();
+	m_sah_cost = compute_sah_cost(m_nodes);
+	if (m_sah_cost <= m_built_sah_cost * rebuild_threshold)
+		return rebuilt;
+
+	build_tree();
+	return true;
+}
+
+/**
+	Recomputes bounds of all nodes bottom-up. Subtrees below the first few
+	levels are refitted in parallel and the nodes above them afterwards.
+*/
+void bvh_tree::refit_nodes()
+{
+	// Loaded nodes and blocks are copied before they're modified by multiple threads
+	m_nodes.get_mutable();
+	m_blocks.get_mutable();
+
+	thread_pool pool{m_build_params.threads};
+
+	// Split the tree into enough subtrees to keep all threads busy
+	std::vector<std::uint32_t> top, subtrees{0};
+	while (subtrees.size() < 4u * pool.get_thread_count())
+	{
+		std::vector<std::uint32_t> next;
+		for (auto i : subtrees)
 		{
-			best_data = std::move(data_y);
-			best_split = split_y;
-			best_cost = cost_y;
+			if (m_nodes[i].is_leaf())
+				next.push_back(i);
+			else
+			{
+				top.push_back(i);
+				next.push_back(m_nodes[i].offset);
+				next.push_back(m_nodes[i].offset + 1);
+			}
 		}
-		
-		// Check Z
-		if (cost_z < best_cost)
+
+		if (next.size() == subtrees.size()) break;
+		subtrees = std::move(next);
+	}
+
+	{
+		thread_pool::task_group group{pool};
+		for (auto i : subtrees)
+			group.run([this, i]{ refit_subtree(i); });
+		group.wait();
+	}
+
+	// Parents are always visited before their children
+	for (auto it = top.rbegin(); it != top.rend(); ++it)
+		refit_node(m_nodes.get_mutable()[*it]);
+}
+
+/**
+	Recomputes bounds of all nodes in a subtree. Children are always
+	stored after their parents, so processing nodes in reversed
+	pre-order goes bottom-up.
+*/
+void bvh_tree::refit_subtree(std::uint32_t root)
+{
+	std::vector<std::uint32_t> order;
+	std::stack<std::uint32_t, std::vector<std::uint32_t>> to_process;
+	to_process.push(root);
+
+	while (!to_process.empty())
+	{
+		std::uint32_t i = to_process.top();
+		to_process.pop();
+		order.push_back(i);
+
+		if (!m_nodes[i].is_leaf())
 		{
-			best_data = std::move(data_z);
-			best_split = split_z;
-			best_cost = cost_z;
+			to_process.push(m_nodes[i].offset);
+			to_process.push(m_nodes[i].offset + 1);
 		}
+	}
 
-		// Compare best split cost to 'leaving as is' cost
-		if (best_cost > np * ci)
+	std::vector<bvh_tree_node> &nodes = m_nodes.get_mutable();
+	for (auto it = order.rbegin(); it != order.rend(); ++it)
+		refit_node(nodes[*it]);
+}
+
+/**
+	Recomputes node bounds from its children or triangles. Leaves'
+	triangle blocks are updated as well.
+*/
+void bvh_tree::refit_node(bvh_tree_node &node)
+{
+	if (!node.is_leaf())
+	{
+		const bvh_tree_node &l = m_nodes[node.offset];
+		const bvh_tree_node &r = m_nodes[node.offset + 1];
+		node.min = glm::min(l.min, r.min);
+		node.max = glm::max(l.max, r.max);
+		return;
+	}
+
+	// Spatial splits are lost - leaves are refitted to entire triangles
+	node.min = glm::vec3{HUGE_VALF};
+	node.max = glm::vec3{-HUGE_VALF};
+	for (std::uint32_t i = 0; i < node.count; i++)
+	{
+		triangle_block &block = m_blocks.get_mutable()[node.offset + i / triangle_block::width];
+		std::uint32_t index = block.index[i % triangle_block::width];
+		const triangle &t = m_triangles[index];
+
+		aabb box{t.get_aabb()};
+		node.min = glm::min(node.min, box.get_min());
+		node.max = glm::max(node.max, box.get_max());
+		block.set(i % triangle_block::width, t, index);
+	}
+}
+
+/**
+	Computes SAH cost of the triangle or sphere tree using the same constants as the builder
+*/
+float bvh_tree::compute_sah_cost(const mappable_vector<bvh_tree_node> &nodes) const
+{
+	if (nodes.empty()) return 0.f;
+
+	float root_area = surface_area(nodes[0]);
+	return root_area > 0.f ? sah_cost(nodes.data(), 0) / root_area : 0.f;
+}
+
+void bvh_tree::begin_ray_profile()
+{
+	m_visit_counts = std::make_unique<std::atomic<std::uint64_t>[]>(m_nodes.size());
+}
+
+void bvh_tree::end_ray_profile()
+{
+	m_visit_counts.reset();
+}
+
+float bvh_tree::get_ray_profile_cost() const
+{
+	if (!m_visit_counts || m_nodes.empty() || m_visit_counts[0] == 0) return 0.f;
+
+	using builder = bvh_builder<bvh_primitive_ref>;
+	double cost = 0.0;
+	for (std::uint32_t i = 0; i < m_nodes.size(); i++)
+	{
+		const bvh_tree_node &n = m_nodes[i];
+		cost += static_cast<double>(m_visit_counts[i]) * (n.is_leaf() ? n.count * builder::sah_ci : builder::sah_ct);
+	}
+
+	return cost / m_visit_counts[0];
+}
+
+bool bvh_tree::optimize_for_rays(float hot_density)
+{
+	std::unique_ptr<std::atomic<std::uint64_t>[]> visits = std::move(m_visit_counts);
+	if (!visits || m_nodes.empty() || visits[0] == 0 || surface_area(m_nodes[0]) <= 0.f)
+		return false;
+
+	// Rays per unit of area at the root - SAH assumes it's the same in all nodes
+	double root_density = visits[0] / surface_area(m_nodes[0]);
+
+	// Find the topmost hot nodes. Nodes are never visited more often than their parents.
+	std::vector<std::uint32_t> hot;
+	std::stack<std::uint32_t, std::vector<std::uint32_t>> to_process;
+	to_process.push(0);
+	while (!to_process.empty())
+	{
+		std::uint32_t i = to_process.top();
+		to_process.pop();
+
+		const bvh_tree_node &n = m_nodes[i];
+		if (visits[i] < min_hot_visits) continue;
+
+		if (visits[i] > hot_density * root_density * surface_area(n) && n.count != 1)
+			hot.push_back(i);
+		else if (!n.is_leaf())
+		{
+			to_process.push(n.offset);
+			to_process.push(n.offset + 1);
+		}
+	}
+
+	auto leaf_triangles = [this](const bvh_tree_node &n, std::vector<std::uint32_t> &triangles)
+	{
+		for (std::uint32_t i = 0; i < n.count; i++)
+			triangles.push_back(m_blocks[n.offset + i / triangle_block::width].index[i % triangle_block::width]);
+	};
+
+	bvh_build_params params = m_build_params;
+	params.method = bvh_build_method::SPATIAL_SAH;
+
+	// Rebuild hot subtrees and keep the ones which got better
+	std::vector<object_subtree> subtrees;
+	std::vector<int> replacement(m_nodes.size(), -1);
+	for (auto root : hot)
+	{
+		// Old spatial splits could reference triangles more than once
+		std::vector<std::uint32_t> indices;
+		to_process.push(root);
+		while (!to_process.empty())
+		{
+			const bvh_tree_node &n = m_nodes[to_process.top()];
+			to_process.pop();
+
+			if (n.is_leaf())
+				leaf_triangles(n, indices);
+			else
+			{
+				to_process.push(n.offset);
+				to_process.push(n.offset + 1);
+			}
+		}
+
+		std::sort(indices.begin(), indices.end());
+		indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+		std::vector<triangle> triangles;
+		triangles.reserve(indices.size());
+		for (auto i : indices)
+			triangles.push_back(m_triangles[i]);
+
+		object_subtree subtree;
+		bvh_build_stats stats;
+		subtree.references = build_over_triangles(triangles, params, subtree.nodes, subtree.depth, stats);
+		if (sah_cost(subtree.nodes.data(), 0) >= sah_cost(m_nodes.data(), root))
 			continue;
 
-		// Copy the sorted data back and calculate splitting iterator
-		std::copy(best_data->begin(), best_data->end(), it->begin);
-		auto split = it->begin + best_split;
+		for (auto &r : subtree.references)
+			r = indices[r];
+
+		replacement[root] = subtrees.size();
+		subtrees.push_back(std::move(subtree));
+	}
+
+	if (subtrees.empty())
+		return false;
+
+	// Copy the tree with the hot subtrees replaced. Children are placed right
+	// after they're allocated, so they still follow their parents.
+	struct placed_node
+	{
+		std::uint32_t source;
+		std::uint32_t index;
+		int depth;
+	};
+
+	std::vector<bvh_tree_node> nodes(1);
+	std::vector<std::uint32_t> references;
+	std::stack<placed_node, std::vector<placed_node>> to_place;
+	to_place.push({0, 0, 1});
+	m_depth = 0;
+	while (!to_place.empty())
+	{
+		auto [source, index, depth] = to_place.top();
+		to_place.pop();
+
+		bvh_tree_node n = m_nodes[source];
+		if (replacement[source] >= 0)
+		{
+			const object_subtree &subtree = subtrees[replacement[source]];
 
-		/*
-			Create children and remove triangles from this node
+			// Subtree nodes other than the root are appended at the end
+			std::uint32_t node_base = nodes.size() - 1;
+			std::uint32_t reference_base = references.size();
+			auto rebase = [&](bvh_tree_node sn)
+			{
+				sn.offset += sn.is_leaf() ? reference_base : node_base;
+				return sn;
+			};
 
-			Passing pointers by value here is very important. Otherwise they will
-			be passed by reference to the part of tree that might get invalidated
-			if it grows.
+			references.insert(references.end(), subtree.references.begin(), subtree.references.end());
 
-			I fucking wasted like 3 hours here...
-		*/
-		rt::triangle *b = it->begin;
-		rt::triangle *e = it->end;
-		it.left().emplace(b, split);
-		it.right().emplace(split, e);
-		it->begin = nullptr;
-		it->end = nullptr;
+			// Old bounds are tighter if triangles were clipped to them by spatial splits
+			bvh_tree_node root = rebase(subtree.nodes[0]);
+			root.min = glm::max(root.min, n.min);
+			root.max = glm::min(root.max, n.max);
+			nodes[index] = root;
+			for (std::uint32_t j = 1; j < subtree.nodes.size(); j++)
+				nodes.push_back(rebase(subtree.nodes[j]));
 
-		// Add children to the processing stack
-		to_process.push(it.left());
-		to_process.push(it.right());
+			m_depth = std::max(m_depth, depth + subtree.depth - 1);
+		}
+		else if (n.is_leaf())
+		{
+			std::uint32_t first = references.size();
+			leaf_triangles(n, references);
+			n.offset = first;
+			nodes[index] = n;
+			m_depth = std::max(m_depth, depth);
+		}
+		else
+		{
+			std::uint32_t child = nodes.size();
+			to_place.push({n.offset + 1, child + 1, depth + 1});
+			to_place.push({n.offset, child, depth + 1});
+			n.offset = child;
+			nodes[index] = n;
+			nodes.resize(child + 2);
+		}
 	}
+
+	m_nodes = std::move(nodes);
+	finalize_tree(references);
+	return true;
+}
+
+rt::aabb bvh_tree::get_aabb() const
+{
+	glm::vec3 min{HUGE_VALF}, max{-HUGE_VALF};
+	for (const auto *nodes : {&m_nodes, &m_sphere_nodes})
+	{
+		if (nodes->empty()) continue;
+		min = glm::min(min, (*nodes)[0].min);
+		max = glm::max(max, (*nodes)[0].max);
+	}
+
+	return aabb{min, max};
 }
 
 bool bvh_tree::cast_ray(const rt::ray &r, ray_hit &best_hit) const
+{
+	return cast_ray(r, best_hit, rt::ray_miss);
+}
+
+bool bvh_tree::cast_ray(const rt::ray &r, ray_hit &best_hit, float tmax) const
+{
+	// The stack never holds more entries than the tree has levels - deeper trees use a heap-allocated one
+	if (std::max(m_depth, m_sphere_depth) <= traversal_stack_size)
+	{
+		rt::short_stack<node_intersection, traversal_stack_size> intersections;
+		return cast_ray_impl(r, best_hit, tmax, intersections);
+	}
+	else
+	{
+		std::stack<node_intersection, std::vector<node_intersection>> intersections;
+		return cast_ray_impl(r, best_hit, tmax, intersections);
+	}
+}
+
+template <typename Stack>
+bool bvh_tree::cast_ray_impl(const rt::ray &r, ray_hit &best_hit, float tmax, Stack &intersections) const
 {
 	// Assume miss
 	best_hit.distance = rt::ray_miss;
 
-	// Nearset intersection
+	// Nearset intersection - nothing beyond tmax is of interest
 	rt::ray_intersection isec;
-	isec.distance = rt::ray_miss;
-
-	// Check spheres
-	const rt::sphere *best_sphere = rt::sphere::ray_intersect(m_spheres.data(), m_spheres.data() + m_spheres.size(), r, isec);
-	if (best_sphere) best_hit = best_sphere->get_ray_hit(isec, r);
+	isec.distance = tmax;
 
 	// Check planes
 	const rt::plane *best_plane = rt::plane::ray_intersect(m_planes.data(), m_planes.data() + m_planes.size(), r, isec);
 	if (best_plane) best_hit = best_plane->get_ray_hit(isec, r);
 
-	// Intersections with tree nodes
-	rt::linear_stack<node_intersection, 256> intersections;
+	// Ray used for traversal - its range ends at the closest hit found so far
+	rt::traversal_ray tr{r, 0.f, isec.distance};
+
+	// Check spheres
+	traverse_closest(m_sphere_nodes, tr, intersections, [&](const bvh_tree_node &node)
+	{
+		const rt::sphere *begin = m_spheres.data() + node.offset;
+		const rt::sphere *best_sphere = rt::sphere::ray_intersect(begin, begin + node.count, r, isec);
+		if (best_sphere)
+		{
+			best_hit = best_sphere->get_ray_hit(isec, r);
+			tr.tmax = isec.distance;
+		}
+	});
+
+	// Check triangles
+	traverse_closest(m_nodes, tr, intersections, [&](const bvh_tree_node &node)
+	{
+		const rt::triangle_block *begin = m_blocks.data() + node.offset;
+		std::uint32_t index = rt::triangle_block::ray_intersect(begin, begin + triangle_block::get_block_count(node.count), r, isec);
+		if (index != rt::triangle_block::miss)
+		{
+			best_hit = get_triangle_hit(index, isec, r);
+			tr.tmax = isec.distance;
+		}
+	});
+
+	return best_hit.distance != rt::ray_miss;
+}
+
+/**
+	Visits leaves of a tree hit by the ray in front-to-back order. The leaf
+	callback is expected to shorten the ray range when it finds a hit.
+
+	The visited node is kept out of the stack - traversal descends into the
+	near child right away and only the far one is pushed. The stack holds
+	at most one entry per tree level then.
+*/
+template <typename Stack, typename F>
+void bvh_tree::traverse_closest(const mappable_vector<bvh_tree_node> &tree, const rt::traversal_ray &tr, Stack &intersections, F &&intersect_leaf) const
+{
+	if (tree.empty()) return;
+	const bvh_tree_node *nodes = tree.data();
 
 	// Check intersection with the root node
-	auto root = m_tree.get_root_node();
-	if (root.has_value())
+	std::uint32_t index = 0;
+	float t = nodes[0].ray_intersection_distance(tr);
+	if (t == rt::ray_miss) return;
+
+	// Visits are only counted in the triangle tree while profiling
+	std::atomic<std::uint64_t> *visits = &tree == &m_nodes ? m_visit_counts.get() : nullptr;
+
+	while (true)
 	{
-		float t = root->bounding_volume.ray_intersection_distance(r);
-		if (t != HUGE_VALF)
-			intersections.emplace(root, t);
+		// If an intersection was found earlier, closer than this volume itself - skip
+		if (t <= tr.tmax)
+		{
+			const bvh_tree_node &node = nodes[index];
+			RT_COUNT_NODES(1);
+			if (visits) visits[index].fetch_add(1, std::memory_order_relaxed);
+
+			// If this is a leaf node, intersect all primitives
+			// and do not traverse further
+			if (node.is_leaf())
+			{
+				RT_COUNT_PRIMITIVES(node.count);
+				intersect_leaf(node);
+			}
+			else
+			{
+				// Near and far child - left child contains primitives with
+				// lower coordinates along the split axis
+				std::uint32_t near = node.offset + tr.sign[node.axis];
+				std::uint32_t far = node.offset + !tr.sign[node.axis];
+
+				// Only children hit within the current ray range are considered
+				float tn = nodes[near].ray_intersection_distance(tr);
+				float tf = nodes[far].ray_intersection_distance(tr);
+
+				// Check the far child later
+				if (tn != rt::ray_miss)
+				{
+					if (tf != rt::ray_miss)
+						intersections.emplace(far, tf);
+
+					index = near;
+					t = tn;
+					continue;
+				}
+
+				if (tf != rt::ray_miss)
+				{
+					index = far;
+					t = tf;
+					continue;
+				}
+			}
+		}
+
+		if (intersections.empty()) break;
+		index = intersections.top().node;
+		t = intersections.top().t;
+		intersections.pop();
 	}
+}
 
-	// Process all intersections
-	while (!intersections.empty())
+void bvh_tree::cast_packet(const rt::ray_packet &packet, ray_hit *hits) const
+{
+	// The stack never holds more entries than the tree has levels - deeper trees use a heap-allocated one
+	if (std::max(m_depth, m_sphere_depth) <= traversal_stack_size)
 	{
-		auto node_isec = intersections.top();
-		intersections.pop();
-		auto node = node_isec.node;
-		float t = node_isec.t;
+		rt::short_stack<packet_node, traversal_stack_size> stack;
+		cast_packet_impl(packet, hits, stack);
+	}
+	else
+	{
+		std::stack<packet_node, std::vector<packet_node>> stack;
+		cast_packet_impl(packet, hits, stack);
+	}
+}
 
-		// If an intersection was found earlier, closer than this volume itself - skip
-		if (best_hit.distance < t) continue;
+template <typename Stack>
+void bvh_tree::cast_packet_impl(const rt::ray_packet &packet, ray_hit *hits, Stack &stack) const
+{
+	rt::ray_intersection isec[rt::ray_packet::max_size];
+	rt::traversal_ray rays[rt::ray_packet::max_size];
+
+	// Planes are checked for each ray separately
+	for (int i = 0; i < packet.size; i++)
+	{
+		const rt::ray &r = packet.rays[i];
+		hits[i].distance = rt::ray_miss;
+		isec[i].distance = rt::ray_miss;
+
+		const rt::plane *best_plane = rt::plane::ray_intersect(m_planes.data(), m_planes.data() + m_planes.size(), r, isec[i]);
+		if (best_plane) hits[i] = best_plane->get_ray_hit(isec[i], r);
+		rays[i] = rt::traversal_ray{r, 0.f, isec[i].distance};
+	}
 
-		// If this is a leaf node, intersect all triangles
-		// and do not traverse further
-		if (node->begin != node->end)
+	packet_bounds bounds{rays, packet.size};
+
+	// Check spheres
+	traverse_packet(m_sphere_nodes, rays, packet.size, bounds, stack, [&](const bvh_tree_node &node, int i)
+	{
+		const rt::ray &r = packet.rays[i];
+		const rt::sphere *begin = m_spheres.data() + node.offset;
+		const rt::sphere *best_sphere = rt::sphere::ray_intersect(begin, begin + node.count, r, isec[i]);
+		if (best_sphere)
+		{
+			hits[i] = best_sphere->get_ray_hit(isec[i], r);
+			rays[i].tmax = isec[i].distance;
+		}
+	});
+
+	// Check triangles
+	traverse_packet(m_nodes, rays, packet.size, bounds, stack, [&](const bvh_tree_node &node, int i)
+	{
+		const rt::ray &r = packet.rays[i];
+		const rt::triangle_block *begin = m_blocks.data() + node.offset;
+		std::uint32_t index = rt::triangle_block::ray_intersect(begin, begin + triangle_block::get_block_count(node.count), r, isec[i]);
+		if (index != rt::triangle_block::miss)
 		{
-			const rt::triangle *tri = rt::triangle::ray_intersect(node->begin, node->end, r, isec);
-			if (tri != nullptr)
-				best_hit = tri->get_ray_hit(isec, r);
+			hits[i] = get_triangle_hit(index, isec[i], r);
+			rays[i].tmax = isec[i].distance;
+		}
+	});
+}
+
+bvh_tree::packet_bounds::packet_bounds(const rt::traversal_ray *rays, int count) :
+	origin_min(HUGE_VALF),
+	origin_max(-HUGE_VALF),
+	inv_direction_min(HUGE_VALF),
+	inv_direction_max(-HUGE_VALF),
+	coherent(true),
+	tmax(0.f)
+{
+	for (int i = 0; i < count; i++)
+	{
+		const rt::traversal_ray &r = rays[i];
+		origin_min = glm::min(origin_min, r.origin);
+		origin_max = glm::max(origin_max, r.origin);
+		inv_direction_min = glm::min(inv_direction_min, r.inv_direction);
+		inv_direction_max = glm::max(inv_direction_max, r.inv_direction);
+		tmax = std::max(tmax, r.tmax);
+
+		// Axis-parallel rays would make the intervals unbounded. Infinity is compared
+		// against a finite bound - std::isfinite() is always true with -ffast-math.
+		for (int axis = 0; axis < 3; axis++)
+			if (r.sign[axis] != rays[0].sign[axis] || !(std::abs(r.inv_direction[axis]) < 1e30f))
+				coherent = false;
+	}
+}
+
+/**
+	Slab test evaluated with interval arithmetic for all rays at once.
+
+	\returns true if no ray in the packet can hit the node
+*/
+bool bvh_tree::packet_bounds::misses(const bvh_tree_node &node) const
+{
+	auto product = [](float a0, float a1, float b0, float b1, float &lo, float &hi)
+	{
+		float p0 = a0 * b0, p1 = a0 * b1, p2 = a1 * b0, p3 = a1 * b1;
+		lo = std::min(std::min(p0, p1), std::min(p2, p3));
+		hi = std::max(std::max(p0, p1), std::max(p2, p3));
+	};
+
+	float tnear = 0.f, tfar = tmax;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float near_lo, near_hi, far_lo, far_hi;
+		product(node.min[axis] - origin_max[axis], node.min[axis] - origin_min[axis], inv_direction_min[axis], inv_direction_max[axis], near_lo, near_hi);
+		product(node.max[axis] - origin_max[axis], node.max[axis] - origin_min[axis], inv_direction_min[axis], inv_direction_max[axis], far_lo, far_hi);
+
+		// Rays going in negative direction enter through the max plane
+		if (inv_direction_min[axis] < 0.f)
+		{
+			std::swap(near_lo, far_lo);
+			std::swap(near_hi, far_hi);
+		}
+
+		tnear = std::max(tnear, near_lo);
+		tfar = std::min(tfar, far_hi);
+	}
+
+	return tnear > tfar;
+}
+
+/**
+	Packet traversal - each node is visited once for all rays. The first ray
+	hitting a node is tracked, so rays which have already left the packet's
+	path are not tested again in the subtree. The leaf callback is called for
+	each ray hitting the leaf and is expected to shorten its range on hit.
+*/
+template <typename Stack, typename F>
+void bvh_tree::traverse_packet(const mappable_vector<bvh_tree_node> &tree, rt::traversal_ray *rays, int count, packet_bounds &bounds, Stack &stack, F &&intersect_leaf) const
+{
+	const bvh_tree_node *nodes = tree.data();
+	if (!tree.empty() && count > 0)
+		stack.emplace(0, 0);
+
+	std::atomic<std::uint64_t> *visits = &tree == &m_nodes ? m_visit_counts.get() : nullptr;
+
+	while (!stack.empty())
+	{
+		auto [index, first] = stack.top();
+		stack.pop();
+		const bvh_tree_node &node = nodes[index];
+
+		// Find the first ray hitting the node, unless the whole packet misses it
+		if (node.ray_intersection_distance(rays[first]) == rt::ray_miss)
+		{
+			if (bounds.coherent && bounds.misses(node)) continue;
+			while (++first < count && node.ray_intersection_distance(rays[first]) == rt::ray_miss);
+			if (first == count) continue;
+		}
+
+		// Rays after the first one are not tested here, so some of them may actually miss the node
+		if (visits) visits[index].fetch_add(count - first, std::memory_order_relaxed);
+
+		if (node.is_leaf())
+		{
+			intersect_leaf(node, first);
+			for (int i = first + 1; i < count; i++)
+				if (node.ray_intersection_distance(rays[i]) != rt::ray_miss)
+					intersect_leaf(node, i);
+
+			// Hits shorten the rays, which tightens the bounds
+			bounds.tmax = 0.f;
+			for (int i = 0; i < count; i++)
+				bounds.tmax = std::max(bounds.tmax, rays[i].tmax);
 			continue;
 		}
 
-		// Compute child nodes intersections
-		float tl = node.left()->bounding_volume.ray_intersection_distance(r);
-		float tr = node.right()->bounding_volume.ray_intersection_distance(r);
+		// Children are ordered by the direction of the first active ray
+		std::uint32_t near = node.offset + rays[first].sign[node.axis];
+		std::uint32_t far = node.offset + !rays[first].sign[node.axis];
+		stack.emplace(far, first);
+		stack.emplace(near, first);
+	}
+}
+
+bool bvh_tree::occluded(const rt::ray &r, float tmax) const
+{
+	// The stack never holds more entries than the tree has levels - deeper trees use a heap-allocated one
+	if (std::max(m_depth, m_sphere_depth) <= traversal_stack_size)
+	{
+		rt::short_stack<std::uint32_t, traversal_stack_size> nodes;
+		return occluded_impl(r, tmax, nodes);
+	}
+	else
+	{
+		std::stack<std::uint32_t, std::vector<std::uint32_t>> nodes;
+		return occluded_impl(r, tmax, nodes);
+	}
+}
+
+template <typename Stack>
+bool bvh_tree::occluded_impl(const rt::ray &r, float tmax, Stack &nodes) const
+{
+	rt::ray_intersection isec;
+	isec.distance = tmax;
+	if (rt::plane::ray_intersect(m_planes.data(), m_planes.data() + m_planes.size(), r, isec))
+		return true;
+
+	rt::traversal_ray tr{r, 0.f, tmax};
+
+	bool hit = traverse_any(m_nodes, tr, nodes, [&](const bvh_tree_node &node)
+	{
+		const rt::triangle_block *begin = m_blocks.data() + node.offset;
+		return rt::triangle_block::ray_occluded(begin, begin + triangle_block::get_block_count(node.count), r, tmax);
+	});
+
+	return hit || traverse_any(m_sphere_nodes, tr, nodes, [&](const bvh_tree_node &node)
+	{
+		const rt::sphere *begin = m_spheres.data() + node.offset;
+		return rt::sphere::ray_intersect(begin, begin + node.count, r, isec) != nullptr;
+	});
+}
 
-		// If at least one child is hit
-		// Check the farther child later, so put it on the stack first
-		// Also, only put nodes on stack if the closest intersection with them
-		// is closer than current best hit
-		if (tl != rt::ray_miss || tr != rt::ray_miss)
+/**
+	Any-hit traversal - returns as soon as the leaf callback reports a hit.
+	Like traverse_closest(), it keeps the visited node out of the stack.
+*/
+template <typename Stack, typename F>
+bool bvh_tree::traverse_any(const mappable_vector<bvh_tree_node> &tree, const rt::traversal_ray &tr, Stack &stack, F &&leaf_occluded) const
+{
+	const bvh_tree_node *nodes = tree.data();
+	if (tree.empty() || nodes[0].ray_intersection_distance(tr) == rt::ray_miss)
+		return false;
+
+	std::atomic<std::uint64_t> *visits = &tree == &m_nodes ? m_visit_counts.get() : nullptr;
+
+	std::uint32_t index = 0;
+	while (true)
+	{
+		const bvh_tree_node &node = nodes[index];
+		RT_COUNT_NODES(1);
+		if (visits) visits[index].fetch_add(1, std::memory_order_relaxed);
+
+		if (node.is_leaf())
 		{
-			if (tl > tr)
+			RT_COUNT_PRIMITIVES(node.count);
+			if (leaf_occluded(node))
 			{
-				if (tl < best_hit.distance)
-					intersections.emplace(node.left(), tl);
-				
-				intersections.emplace(node.right(), tr);
+				while (!stack.empty()) stack.pop();
+				return true;
 			}
-			else
+		}
+		else
+		{
+			// Visit the near child first - it's more likely to contain an occluder
+			std::uint32_t near = node.offset + tr.sign[node.axis];
+			std::uint32_t far = node.offset + !tr.sign[node.axis];
+			bool hit_near = nodes[near].ray_intersection_distance(tr) != rt::ray_miss;
+			bool hit_far = nodes[far].ray_intersection_distance(tr) != rt::ray_miss;
+
+			if (hit_near)
 			{
-				if (tr < best_hit.distance)
-					intersections.emplace(node.right(), tr);
+				if (hit_far)
+					stack.push(far);
 
-				intersections.emplace(node.left(), tl);
+				index = near;
+				continue;
+			}
+
+			if (hit_far)
+			{
+				index = far;
+				continue;
 			}
 		}
-	}
 
-	return best_hit.distance != HUGE_VALF;
+		if (stack.empty()) return false;
+		index = stack.top();
+		stack.pop();
+	}
 }
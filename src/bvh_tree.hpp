@@ -1,56 +1,388 @@
 #pragma once
 
-#include "containers/linear_tree.hpp"
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
 #include "ray_accelerator.hpp"
 #include "primitive.hpp"
+#include "primitive_collection.hpp"
 #include "scene.hpp"
+#include "bvh_builder.hpp"
+#include "triangle_block.hpp"
+#include "containers/mappable_vector.hpp"
 
 namespace rt {
 
 /**
-	A node of a BVH tree
+	A more efficient implementation of a BVH tree
 */
-struct bvh_tree_node
+class bvh_tree : public ray_accelerator
 {
+public:
+	bvh_tree(const scene &scene, const bvh_build_params &params = {});
+
 	/**
-		Adds triangles range to the node and calculates its bounding volume
+		Builds tree over given primitives in their own coordinate space
 	*/
-	bvh_tree_node(triangle *begin, triangle *end);
+	explicit bvh_tree(primitive_collection primitives, const bvh_build_params &params = {});
 
-	rt::aabb bounding_volume;
-	rt::triangle *begin;
-	rt::triangle *end;
-};
+	/**
+		Builds tree over primitives of multiple objects. `object_offsets` contains index
+		of the first triangle of each object - used with bvh_build_params::per_object.
+	*/
+	bvh_tree(primitive_collection primitives, std::vector<std::uint32_t> object_offsets, const bvh_build_params &params = {});
+
+	/**
+		Copies the tree along with node visits counted so far. The other tree may
+		be in use while it's copied, so a tree can be profiled while rendering and
+		its copy optimized with optimize_for_rays() in the meantime.
+	*/
+	bvh_tree(const bvh_tree &other);
+	bvh_tree(bvh_tree &&) = default;
+	bvh_tree &operator=(bvh_tree &&) = default;
 
-/**
-	A more efficient implementation of a BVH tree
-*/
-class bvh_tree : public ray_accelerator
-{
-public:
-	bvh_tree(const scene &scene);
 	bool cast_ray(const rt::ray &r, ray_hit &hit) const override;
 
+	/**
+		Finds the closest hit nearer than tmax. The ray direction doesn't need
+		to be normalized - the distance is then expressed in its lengths.
+	*/
+	bool cast_ray(const rt::ray &r, ray_hit &hit, float tmax) const;
+
+	bool occluded(const rt::ray &r, float tmax) const override;
+
+	/**
+		Traverses the tree once for the whole packet. Nodes are skipped as soon as
+		the packet's bounding interval shows that no ray can hit them.
+	*/
+	void cast_packet(const ray_packet &packet, ray_hit *hits) const override;
+
+	/**
+		Returns bounding box of all triangles and spheres (planes are unbounded)
+	*/
+	aabb get_aabb() const;
+
+	/**
+		Replaces primitives with new ones of the same topology (triangles and spheres
+		given in the same order as during construction) and refits node bounds to them.
+		The triangle or sphere tree is rebuilt instead, if its SAH cost after refitting
+		grows more than `rebuild_threshold` times over the cost of its last build. The
+		sphere tree is also rebuilt if spheres are added or removed.
+
+		\returns true if any tree has been rebuilt
+	*/
+	bool refit(primitive_collection primitives, float rebuild_threshold = default_rebuild_threshold);
+	bool refit(const scene &scene, float rebuild_threshold = default_rebuild_threshold);
+
+	/**
+		Starts counting how many rays visit each node of the triangle tree. Rays
+		cast in all ways are counted. Counting slows traversal down, so it's meant
+		for a short warm-up pass before optimize_for_rays(). Must not be called
+		while rays are being cast, just like the functions below (apart from
+		get_ray_profile_cost()).
+	*/
+	void begin_ray_profile();
+
+	/**
+		Stops counting node visits
+	*/
+	void end_ray_profile();
+
+	/**
+		Returns the average cost of tracing a ray that hits the root node, measured
+		since begin_ray_profile() - directly comparable with get_sah_cost()
+	*/
+	float get_ray_profile_cost() const;
+
+	/**
+		Rebuilds subtrees visited by more rays than SAH assumes, using counts gathered
+		since begin_ray_profile(). SAH expects the number of rays hitting a node to be
+		proportional to its surface area - subtrees whose rays per unit of area exceed
+		the root's over `hot_density` times get spatial splits and tighter bounds.
+		Rebuilt subtrees are kept only if their SAH cost is lower. Ends the profile.
+
+		\returns true if any subtree has been replaced
+	*/
+	bool optimize_for_rays(float hot_density = default_hot_density);
+
+	/**
+		Returns SAH cost of the tree - expected cost of tracing a ray that hits the root node
+	*/
+	float get_sah_cost() const
+	{
+		return m_sah_cost;
+	}
+
+	/**
+		Returns timing of the last builds of the triangle and sphere trees
+	*/
+	bvh_build_stats get_build_stats() const
+	{
+		bvh_build_stats stats = m_build_stats;
+		stats.build_time += m_sphere_build_stats.build_time;
+		stats.work_time += m_sphere_build_stats.work_time;
+		stats.threads = std::max(stats.threads, m_sphere_build_stats.threads);
+		return stats;
+	}
+
+	/**
+		Returns number of nodes in the tree
+	*/
+	std::size_t get_node_count() const
+	{
+		return m_nodes.size();
+	}
+
+	/**
+		Returns memory taken by nodes of both trees and triangle blocks in bytes
+	*/
+	std::size_t get_memory_usage() const
+	{
+		return (m_nodes.size() + m_sphere_nodes.size()) * sizeof(bvh_tree_node) + m_blocks.size() * sizeof(triangle_block);
+	}
+
+	/**
+		Provides read-only access to the nodes. The root node is the first one.
+	*/
+	const mappable_vector<bvh_tree_node> &get_nodes() const
+	{
+		return m_nodes;
+	}
+
+	/**
+		Provides read-only access to triangle blocks referenced by leaves
+	*/
+	const mappable_vector<triangle_block> &get_blocks() const
+	{
+		return m_blocks;
+	}
+
+	/**
+		Provides read-only access to triangles referenced by triangle blocks. Triangles
+		of a tree loaded from a cache refer to their materials by index and have no
+		material pointers - use get_triangle_material() instead.
+	*/
+	const mappable_vector<triangle> &get_triangles() const
+	{
+		return m_triangles;
+	}
+
+	/**
+		Returns material of a triangle referenced by triangle blocks
+	*/
+	const abstract_material *get_triangle_material(std::uint32_t index) const
+	{
+		return m_triangle_materials.empty() ? m_triangles[index].material : m_materials[m_triangle_materials[index]];
+	}
+
+	/**
+		Provides read-only access to spheres, in the order referenced by the sphere tree leaves
+	*/
+	const std::vector<sphere> &get_spheres() const
+	{
+		return m_spheres;
+	}
+
+	/**
+		Provides read-only access to nodes of the sphere tree
+	*/
+	const mappable_vector<bvh_tree_node> &get_sphere_nodes() const
+	{
+		return m_sphere_nodes;
+	}
+
+	const std::vector<plane> &get_planes() const
+	{
+		return m_planes;
+	}
+
+	/**
+		Returns depth of the tree (1 for a single leaf)
+	*/
+	int get_depth() const
+	{
+		return m_depth;
+	}
+
+	/**
+		Returns depth of the sphere tree
+	*/
+	int get_sphere_depth() const
+	{
+		return m_sphere_depth;
+	}
+
+	/**
+		Returns true if the tree is used straight from a cache file - it hasn't been built
+	*/
+	bool is_mapped() const
+	{
+		return m_nodes.is_mapped();
+	}
+
 private:
+	friend class bvh_cache;
+
+	/**
+		Creates an empty tree - used when the tree is loaded from a cache
+	*/
+	explicit bvh_tree(const bvh_build_params &params);
+
 	struct node_intersection
 	{
 		node_intersection() = default;
 
-		node_intersection(linear_tree<bvh_tree_node>::iterator it, float u) :
-			node(it),
+		node_intersection(std::uint32_t n, float u) :
+			node(n),
 			t(u)
 		{}
 
-		linear_tree<bvh_tree_node>::iterator node;
+		std::uint32_t node;
 		float t;
 	};
 
+	/**
+		Conservative bounds of ray origins and reciprocal directions in a packet
+	*/
+	struct packet_bounds
+	{
+		glm::vec3 origin_min, origin_max;
+		glm::vec3 inv_direction_min, inv_direction_max;
+
+		//! False if direction signs differ within the packet - interval culling can't be used then
+		bool coherent;
+
+		//! The longest ray range in the packet
+		float tmax;
+
+		packet_bounds(const traversal_ray *rays, int count);
+		bool misses(const bvh_tree_node &node) const;
+	};
+
+	struct packet_node
+	{
+		packet_node() = default;
+
+		packet_node(std::uint32_t n, int f) :
+			node(n),
+			first(f)
+		{}
+
+		std::uint32_t node;
+
+		//! First ray in the packet hitting the node - rays before it are inactive in the subtree
+		int first;
+	};
+
+	//! Size of the unchecked traversal stack - trees deeper than that use a heap-allocated one
+	static constexpr int traversal_stack_size = 64;
+
+	/**
+		Subtree built over triangles of a single object. It's kept after the
+		build, so it can be reused if the object is unchanged when the tree is rebuilt.
+	*/
+	struct object_subtree
+	{
+		std::vector<bvh_tree_node> nodes;
+
+		//! Triangles referenced by the leaves - indices relative to the first triangle of the object
+		std::vector<std::uint32_t> references;
+
+		int depth = 0;
+
+		//! Hash of the object's triangle vertices
+		std::uint64_t hash = 0;
+	};
+
+	//! Allowed SAH cost growth of a refitted tree
+	static constexpr float default_rebuild_threshold = 1.5f;
+
+	//! Ray density (relative to the root) above which subtrees are rebuilt by optimize_for_rays()
+	static constexpr float default_hot_density = 2.f;
+
+	//! Nodes visited by fewer rays during profiling are never considered hot - their density is just noise
+	static constexpr std::uint64_t min_hot_visits = 256;
+
+	//! Objects with at least that many triangles are built using all threads, smaller ones in parallel with each other
+	static constexpr std::uint32_t large_object_size = 65536;
+
+	void init(primitive_collection primitives);
+	void check_materials() const;
+	std::vector<triangle> &get_mutable_triangles();
 	void build_tree();
+	void finalize_tree(std::vector<std::uint32_t> &references);
+	void build_objects(std::vector<std::uint32_t> &references);
+	void build_sphere_tree();
+	bool refit_spheres(const std::vector<sphere> &spheres, float rebuild_threshold);
+	void pack_leaves(const std::vector<std::uint32_t> &references);
+	void refit_nodes();
+	void refit_subtree(std::uint32_t root);
+	void refit_node(bvh_tree_node &node);
+	float compute_sah_cost(const mappable_vector<bvh_tree_node> &nodes) const;
+
+	ray_hit get_triangle_hit(std::uint32_t index, const ray_intersection &isec, const ray &r) const
+	{
+		ray_hit hit = m_triangles[index].get_ray_hit(isec, r);
+		hit.material = get_triangle_material(index);
+		return hit;
+	}
+
+	template <typename Stack>
+	bool cast_ray_impl(const rt::ray &r, ray_hit &hit, float tmax, Stack &intersections) const;
+
+	template <typename Stack>
+	bool occluded_impl(const rt::ray &r, float tmax, Stack &nodes) const;
+
+	template <typename Stack, typename F>
+	void traverse_closest(const mappable_vector<bvh_tree_node> &tree, const rt::traversal_ray &tr, Stack &intersections, F &&intersect_leaf) const;
+
+	template <typename Stack>
+	void cast_packet_impl(const ray_packet &packet, ray_hit *hits, Stack &stack) const;
+
+	template <typename Stack, typename F>
+	void traverse_packet(const mappable_vector<bvh_tree_node> &tree, traversal_ray *rays, int count, packet_bounds &bounds, Stack &stack, F &&intersect_leaf) const;
+
+	template <typename Stack, typename F>
+	bool traverse_any(const mappable_vector<bvh_tree_node> &tree, const rt::traversal_ray &tr, Stack &stack, F &&leaf_occluded) const;
+
+	bvh_build_params m_build_params;
+	bvh_build_stats m_build_stats;
+	bvh_build_stats m_sphere_build_stats;
+	mappable_vector<bvh_tree_node> m_nodes;
+	int m_depth = 0;
+	mappable_vector<triangle_block> m_blocks;
+	mappable_vector<triangle> m_triangles;
+
+	//! Material index of each triangle, if the triangles are mapped from a cache and have no material pointers
+	mappable_vector<std::uint32_t> m_triangle_materials;
+	std::vector<const abstract_material*> m_materials;
 
-	linear_tree<bvh_tree_node> m_tree;
-	std::vector<triangle> m_triangles;
 	std::vector<sphere> m_spheres;
 	std::vector<plane> m_planes;
+
+	//! Separate tree over spheres - its leaves reference ranges of m_spheres
+	mappable_vector<bvh_tree_node> m_sphere_nodes;
+	int m_sphere_depth = 0;
+
+	//! Original index of each triangle and sphere (before reordering)
+	mappable_vector<std::uint32_t> m_source_index;
+	std::vector<std::uint32_t> m_sphere_source_index;
+
+	//! Index of the first triangle of each object (in the original order) and subtrees of the objects
+	std::vector<std::uint32_t> m_object_offsets;
+	std::vector<object_subtree> m_object_subtrees;
+
+	//! Number of rays which visited each node of the triangle tree - only allocated while profiling
+	std::unique_ptr<std::atomic<std::uint64_t>[]> m_visit_counts;
+
+	//! SAH cost of the tree - current one and right after the last build
+	float m_sah_cost = 0.f;
+	float m_built_sah_cost = 0.f;
+
+	//! SAH cost of the sphere tree right after its last build
+	float m_built_sphere_sah_cost = 0.f;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include "compressed_bvh.hpp"
+
+#include <stack>
+#include <cmath>
+#include <algorithm>
+
+#include "containers/short_stack.hpp"
+#include "traversal_stats.hpp"
+
+using rt::compressed_bvh;
+using rt::compressed_bvh_node;
+
+compressed_bvh::compressed_bvh(const rt::scene &scene, const bvh_build_params &params)
+{
+	// Build binary tree and re-encode its nodes
+	bvh_tree tree{scene, params};
+	compress_tree(tree.get_nodes(), tree.get_depth(), m_tree);
+	compress_tree(tree.get_sphere_nodes(), tree.get_sphere_depth(), m_sphere_tree);
+
+	m_blocks.assign(tree.get_blocks().begin(), tree.get_blocks().end());
+	m_triangles.assign(tree.get_triangles().begin(), tree.get_triangles().end());
+	m_spheres = tree.get_spheres();
+	m_planes = tree.get_planes();
+}
+
+/**
+	Decodes bounds of both children of an interior node with given bounds
+*/
+inline void compressed_bvh::decode_children(const compressed_bvh_node &node, const glm::vec3 &min, const glm::vec3 &max, glm::vec3 *child_min, glm::vec3 *child_max)
+{
+	glm::vec3 step = (max - min) * (1.f / compressed_bvh_node::quantization_steps);
+	const auto &b = node.bounds;
+	for (int c = 0; c < 2; c++)
+	{
+		child_min[c] = min + glm::vec3{b.min[c][0], b.min[c][1], b.min[c][2]} * step;
+		child_max[c] = max - glm::vec3{b.max[c][0], b.max[c][1], b.max[c][2]} * step;
+	}
+}
+
+/**
+	Encodes nodes of a binary BVH. Children are quantized relative to the decoded
+	(not the original) bounds of their parent, exactly as they are decoded during
+	traversal. Quantized boxes are rounded outwards, so they always contain the
+	original ones.
+*/
+void compressed_bvh::compress_tree(const rt::mappable_vector<bvh_tree_node> &nodes, int depth, compressed_tree &tree)
+{
+	constexpr int steps = compressed_bvh_node::quantization_steps;
+
+	tree.nodes.assign(nodes.size(), compressed_bvh_node{});
+	tree.depth = depth;
+	if (nodes.empty()) return;
+
+	tree.min = nodes[0].min;
+	tree.max = nodes[0].max;
+
+	// Decoded bounds of each node - parents are always stored before their children
+	std::vector<glm::vec3> box_min(nodes.size()), box_max(nodes.size());
+	box_min[0] = tree.min;
+	box_max[0] = tree.max;
+
+	for (std::size_t i = 0; i < nodes.size(); i++)
+	{
+		const bvh_tree_node &src = nodes[i];
+		compressed_bvh_node &dst = tree.nodes[i];
+
+		if (src.is_leaf())
+		{
+			dst.count = src.count;
+			dst.offset = src.offset | compressed_bvh_node::leaf_flag;
+			continue;
+		}
+
+		dst.offset = src.offset;
+		const glm::vec3 &min = box_min[i];
+		const glm::vec3 &max = box_max[i];
+		glm::vec3 step = (max - min) * (1.f / steps);
+
+		for (int c = 0; c < 2; c++)
+		{
+			const bvh_tree_node &child = nodes[src.offset + c];
+			for (int axis = 0; axis < 3; axis++)
+			{
+				int qmin = 0, qmax = 0;
+				if (step[axis] > 0.f)
+				{
+					// Safety margin for rounding differences in decoding
+					float margin = std::max(std::abs(min[axis]), std::abs(max[axis])) * 1e-6f;
+
+					qmin = std::clamp(static_cast<int>(std::floor((child.min[axis] - min[axis]) / step[axis])), 0, steps);
+					while (qmin > 0 && min[axis] + qmin * step[axis] > child.min[axis] - margin)
+						qmin--;
+
+					qmax = std::clamp(static_cast<int>(std::floor((max[axis] - child.max[axis]) / step[axis])), 0, steps);
+					while (qmax > 0 && max[axis] - qmax * step[axis] < child.max[axis] + margin)
+						qmax--;
+				}
+
+				dst.bounds.min[c][axis] = qmin;
+				dst.bounds.max[c][axis] = qmax;
+			}
+		}
+
+		decode_children(dst, min, max, &box_min[src.offset], &box_max[src.offset]);
+	}
+}
+
+bool compressed_bvh::cast_ray(const rt::ray &r, ray_hit &best_hit) const
+{
+	// The stack never outgrows the tree depth - deeper trees use a heap-allocated one
+	if (std::max(m_tree.depth, m_sphere_tree.depth) < traversal_stack_size)
+	{
+		rt::short_stack<node_intersection, traversal_stack_size> intersections;
+		return cast_ray_impl(r, best_hit, intersections);
+	}
+	else
+	{
+		std::stack<node_intersection, std::vector<node_intersection>> intersections;
+		return cast_ray_impl(r, best_hit, intersections);
+	}
+}
+
+template <typename Stack>
+bool compressed_bvh::cast_ray_impl(const rt::ray &r, ray_hit &best_hit, Stack &intersections) const
+{
+	// Assume miss
+	best_hit.distance = rt::ray_miss;
+
+	// Nearset intersection
+	rt::ray_intersection isec;
+	isec.distance = rt::ray_miss;
+
+	// Check planes
+	const rt::plane *best_plane = rt::plane::ray_intersect(m_planes.data(), m_planes.data() + m_planes.size(), r, isec);
+	if (best_plane) best_hit = best_plane->get_ray_hit(isec, r);
+
+	// Ray used for traversal - its range ends at the closest hit found so far
+	rt::traversal_ray tr{r, 0.f, isec.distance};
+
+	// Check spheres
+	traverse_closest(m_sphere_tree, tr, intersections, [&](std::uint32_t first, std::uint32_t count)
+	{
+		const rt::sphere *begin = m_spheres.data() + first;
+		const rt::sphere *best_sphere = rt::sphere::ray_intersect(begin, begin + count, r, isec);
+		if (best_sphere)
+		{
+			best_hit = best_sphere->get_ray_hit(isec, r);
+			tr.tmax = isec.distance;
+		}
+	});
+
+	// Check triangles
+	traverse_closest(m_tree, tr, intersections, [&](std::uint32_t first, std::uint32_t count)
+	{
+		const rt::triangle_block *begin = m_blocks.data() + first;
+		std::uint32_t index = rt::triangle_block::ray_intersect(begin, begin + triangle_block::get_block_count(count), r, isec);
+		if (index != rt::triangle_block::miss)
+		{
+			best_hit = m_triangles[index].get_ray_hit(isec, r);
+			tr.tmax = isec.distance;
+		}
+	});
+
+	return best_hit.distance != rt::ray_miss;
+}
+
+/**
+	Visits leaves of a tree hit by the ray in front-to-back order. Bounds of
+	each node are decoded from its parent's ones and carried on the stack.
+*/
+template <typename Stack, typename F>
+void compressed_bvh::traverse_closest(const compressed_tree &tree, const rt::traversal_ray &tr, Stack &intersections, F &&intersect_leaf) const
+{
+	// Check intersection with the root node
+	if (!tree.nodes.empty())
+	{
+		float t = rt::ray_box_intersection_distance(tr, tree.min, tree.max);
+		if (t != rt::ray_miss)
+			intersections.emplace(0, t, tree.min, tree.max);
+	}
+
+	while (!intersections.empty())
+	{
+		auto node_isec = intersections.top();
+		intersections.pop();
+		const compressed_bvh_node &node = tree.nodes[node_isec.node];
+
+		// If an intersection was found earlier, closer than this volume itself - skip
+		if (tr.tmax < node_isec.t) continue;
+		RT_COUNT_NODES(1);
+
+		if (node.is_leaf())
+		{
+			RT_COUNT_PRIMITIVES(node.count);
+			intersect_leaf(node.offset & ~compressed_bvh_node::leaf_flag, node.count);
+			continue;
+		}
+
+		glm::vec3 min[2], max[2];
+		decode_children(node, node_isec.min, node_isec.max, min, max);
+
+		float t[2];
+		for (int c = 0; c < 2; c++)
+			t[c] = rt::ray_box_intersection_distance(tr, min[c], max[c]);
+
+		// Check the farther child later, so put it on the stack first
+		int near = t[1] < t[0];
+		int far = !near;
+
+		if (t[far] != rt::ray_miss)
+			intersections.emplace(node.offset + far, t[far], min[far], max[far]);
+
+		if (t[near] != rt::ray_miss)
+			intersections.emplace(node.offset + near, t[near], min[near], max[near]);
+	}
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "ray_accelerator.hpp"
+#include "primitive.hpp"
+#include "scene.hpp"
+#include "bvh_tree.hpp"
+
+namespace rt {
+
+/**
+	A node of a compressed BVH. Interior nodes store bounds of both children
+	quantized to 8 bits relative to their own box, which is decoded from the
+	parent during traversal. Minimum coordinates are offsets from the box's
+	minimum and maximum ones are offsets from its maximum (both towards the
+	box center), so the children never grow beyond the parent.
+
+	Children of a node are stored next to each other, like in `bvh_tree`.
+*/
+struct compressed_bvh_node
+{
+	//! Set in offset of leaves
+	static constexpr std::uint32_t leaf_flag = 0x80000000u;
+
+	//! Number of quantization steps along each axis
+	static constexpr int quantization_steps = 255;
+
+	bool is_leaf() const
+	{
+		return offset & leaf_flag;
+	}
+
+	union
+	{
+		//! Quantized bounds of children (interior nodes) - [child][axis]
+		struct
+		{
+			std::uint8_t min[2][3];
+			std::uint8_t max[2][3];
+		} bounds;
+
+		//! Number of primitives (leaves)
+		std::uint32_t count;
+	};
+
+	//! Index of the first child or, in leaves, index of the first primitive (triangle block) with leaf_flag set
+	std::uint32_t offset;
+};
+
+static_assert(sizeof(compressed_bvh_node) == 16, "compressed_bvh_node should be 16 bytes");
+
+/**
+	Binary BVH with compressed nodes, taking half of the memory of
+	`bvh_tree` nodes. Trees are built by `bvh_tree` and re-encoded.
+	Child bounds are decoded during traversal, so it's a bit slower.
+*/
+class compressed_bvh : public ray_accelerator
+{
+public:
+	compressed_bvh(const scene &scene, const bvh_build_params &params = {});
+	bool cast_ray(const rt::ray &r, ray_hit &hit) const override;
+
+	/**
+		Returns number of nodes in the tree
+	*/
+	std::size_t get_node_count() const
+	{
+		return m_tree.nodes.size();
+	}
+
+	/**
+		Returns memory taken by nodes of both trees in bytes
+	*/
+	std::size_t get_node_memory() const
+	{
+		return (m_tree.nodes.size() + m_sphere_tree.nodes.size()) * sizeof(compressed_bvh_node);
+	}
+
+	/**
+		Returns memory taken by nodes of both trees and triangle blocks in bytes
+	*/
+	std::size_t get_memory_usage() const
+	{
+		return get_node_memory() + m_blocks.size() * sizeof(triangle_block);
+	}
+
+private:
+	/**
+		Tree of compressed nodes with full-precision bounds of the root
+	*/
+	struct compressed_tree
+	{
+		std::vector<compressed_bvh_node> nodes;
+		glm::vec3 min;
+		glm::vec3 max;
+		int depth = 0;
+	};
+
+	struct node_intersection
+	{
+		node_intersection() = default;
+
+		node_intersection(std::uint32_t n, float u, const glm::vec3 &bmin, const glm::vec3 &bmax) :
+			node(n),
+			t(u),
+			min(bmin),
+			max(bmax)
+		{}
+
+		std::uint32_t node;
+		float t;
+
+		//! Decoded bounds of the node
+		glm::vec3 min;
+		glm::vec3 max;
+	};
+
+	//! Traversal stack size used for trees that are not too deep
+	static constexpr int traversal_stack_size = 256;
+
+	static void compress_tree(const mappable_vector<bvh_tree_node> &nodes, int depth, compressed_tree &tree);
+	static inline void decode_children(const compressed_bvh_node &node, const glm::vec3 &min, const glm::vec3 &max, glm::vec3 *child_min, glm::vec3 *child_max);
+
+	template <typename Stack>
+	bool cast_ray_impl(const rt::ray &r, ray_hit &hit, Stack &intersections) const;
+
+	template <typename Stack, typename F>
+	void traverse_closest(const compressed_tree &tree, const rt::traversal_ray &tr, Stack &intersections, F &&intersect_leaf) const;
+
+	compressed_tree m_tree;
+	compressed_tree m_sphere_tree;
+	std::vector<triangle_block> m_blocks;
+	std::vector<triangle> m_triangles;
+	std::vector<sphere> m_spheres;
+	std::vector<plane> m_planes;
+};
+
+}
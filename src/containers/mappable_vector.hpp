@@ -0,0 +1,95 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+namespace rt {
+
+/**
+	An array which either owns its elements or refers to read-only memory
+	owned by someone else (e.g. a memory-mapped file). Mapped data is copied
+	into owned memory before the first modification.
+*/
+template <typename T>
+class mappable_vector
+{
+public:
+	mappable_vector() = default;
+
+	mappable_vector(std::vector<T> &&v) :
+		m_vector(std::move(v))
+	{}
+
+	/**
+		Makes the array refer to external memory. The owner is kept alive as long as it's needed.
+	*/
+	void map(const T *data, std::size_t size, std::shared_ptr<const void> owner)
+	{
+		m_vector.clear();
+		m_vector.shrink_to_fit();
+		m_data = data;
+		m_size = size;
+		m_owner = std::move(owner);
+	}
+
+	/**
+		Returns the owned vector for modification. Mapped data is copied into it first.
+	*/
+	std::vector<T> &get_mutable()
+	{
+		if (m_owner)
+		{
+			m_vector.assign(m_data, m_data + m_size);
+			m_owner.reset();
+			m_data = nullptr;
+			m_size = 0;
+		}
+
+		return m_vector;
+	}
+
+	bool is_mapped() const
+	{
+		return static_cast<bool>(m_owner);
+	}
+
+	const T *data() const
+	{
+		return m_owner ? m_data : m_vector.data();
+	}
+
+	std::size_t size() const
+	{
+		return m_owner ? m_size : m_vector.size();
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	const T &operator[](std::size_t i) const
+	{
+		return data()[i];
+	}
+
+	const T *begin() const
+	{
+		return data();
+	}
+
+	const T *end() const
+	{
+		return data() + size();
+	}
+
+private:
+	std::vector<T> m_vector;
+
+	const T *m_data = nullptr;
+	std::size_t m_size = 0;
+	std::shared_ptr<const void> m_owner;
+};
+
+}
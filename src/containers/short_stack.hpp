@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cassert>
+#include <type_traits>
+#include <utility>
+
+namespace rt {
+
+/**
+	A fixed-size stack of trivially copyable values, meant for hot loops.
+	Unlike linear_stack, it does no bounds checking (apart from assertions
+	in debug builds) - the caller has to guarantee that it never holds more
+	than N elements, e.g. based on the depth of the traversed tree.
+*/
+template <typename T, unsigned int N>
+class short_stack
+{
+	static_assert(std::is_trivially_copyable_v<T>, "short_stack elements should be trivially copyable");
+
+public:
+	void push(const T &value)
+	{
+		assert(m_size < N && "short_stack overflow");
+		m_data[m_size++] = value;
+	}
+
+	template <typename... Args>
+	void emplace(Args&&... args)
+	{
+		push(T(std::forward<Args>(args)...));
+	}
+
+	T pop()
+	{
+		assert(m_size > 0 && "short_stack - pop() called on empty stack");
+		return m_data[--m_size];
+	}
+
+	const T &top() const
+	{
+		assert(m_size > 0 && "short_stack - top() called on empty stack");
+		return m_data[m_size - 1];
+	}
+
+	bool empty() const
+	{
+		return m_size == 0;
+	}
+
+	unsigned int size() const
+	{
+		return m_size;
+	}
+
+	void clear()
+	{
+		m_size = 0;
+	}
+
+	static constexpr unsigned int capacity()
+	{
+		return N;
+	}
+
+private:
+	unsigned int m_size = 0;
+	T m_data[N];
+};
+
+}
@@ -0,0 +1,260 @@
+#include "instanced_bvh.hpp"
+
+#include <stack>
+#include <chrono>
+#include <stdexcept>
+
+#include "containers/short_stack.hpp"
+
+using rt::instanced_bvh;
+using rt::bvh_instance;
+
+instanced_bvh::instanced_bvh(const rt::scene &scene, const bvh_build_params &params) :
+	m_build_params(params)
+{
+	auto t_start = std::chrono::high_resolution_clock::now();
+	const auto &objects = scene.get_objects();
+
+	for (std::uint32_t i = 0; i < objects.size(); i++)
+	{
+		const primitive_collection &col = objects[i]->get_primitives();
+
+		// Planes stay in world space
+		for (const auto &p : col.planes)
+			m_planes.push_back(p.transform(objects[i]->get_transform()));
+
+		// Bottom-level tree is built only for the first object using the collection
+		auto &blas = m_blas[&col];
+		if (!blas)
+		{
+			primitive_collection bounded;
+			bounded.triangles = col.triangles;
+			bounded.spheres = col.spheres;
+			blas = std::make_unique<bvh_tree>(std::move(bounded), params);
+			m_build_stats.work_time += blas->get_build_stats().work_time;
+			m_build_stats.threads = blas->get_build_stats().threads;
+		}
+
+		if (blas->get_triangles().empty() && blas->get_spheres().empty())
+			continue;
+
+		bvh_instance &inst = m_instances.emplace_back();
+		inst.blas = blas.get();
+		inst.object_index = i;
+		update_instance(inst, objects[i]->get_transform());
+	}
+
+	for (const auto &p : m_planes)
+		if (p.material == nullptr)
+			throw std::runtime_error("Some primitives don't have any material assigned. Cannot proceed!");
+
+	auto t_tlas = std::chrono::high_resolution_clock::now();
+	build_tlas();
+
+	auto t_end = std::chrono::high_resolution_clock::now();
+	m_build_stats.build_time = t_end - t_start;
+	m_build_stats.work_time += t_end - t_tlas;
+}
+
+void instanced_bvh::update_transforms(const rt::scene &scene)
+{
+	const auto &objects = scene.get_objects();
+	for (auto &inst : m_instances)
+	{
+		if (inst.object_index >= objects.size())
+			throw std::runtime_error("instanced_bvh::update_transforms() called for a different scene");
+
+		auto it = m_blas.find(&objects[inst.object_index]->get_primitives());
+		if (it == m_blas.end() || it->second.get() != inst.blas)
+			throw std::runtime_error("instanced_bvh::update_transforms() called for a different scene");
+
+		update_instance(inst, objects[inst.object_index]->get_transform());
+	}
+
+	build_tlas();
+}
+
+/**
+	Computes instance matrices and its world space bounding box
+*/
+void instanced_bvh::update_instance(bvh_instance &inst, const glm::mat4 &transform) const
+{
+	inst.inverse_transform = glm::inverse(transform);
+	inst.normal_matrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+
+	// Transform all corners of the object space box
+	aabb box{inst.blas->get_aabb()};
+	glm::vec3 min{HUGE_VALF}, max{-HUGE_VALF};
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner{
+			(i & 1) ? box.get_max().x : box.get_min().x,
+			(i & 2) ? box.get_max().y : box.get_min().y,
+			(i & 4) ? box.get_max().z : box.get_min().z};
+
+		glm::vec3 p{transform * glm::vec4{corner, 1.f}};
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+
+	inst.bounds = aabb{min, max};
+}
+
+void instanced_bvh::build_tlas()
+{
+	bvh_builder<bvh_instance> builder{m_build_params};
+	builder.build(m_instances);
+
+	m_nodes = std::move(builder.get_nodes());
+	m_depth = builder.get_depth();
+}
+
+bool instanced_bvh::cast_ray(const rt::ray &r, ray_hit &best_hit) const
+{
+	// The stack never outgrows the tree depth - deeper trees use a heap-allocated one
+	if (m_depth < traversal_stack_size)
+	{
+		rt::short_stack<node_intersection, traversal_stack_size> intersections;
+		return cast_ray_impl(r, best_hit, intersections);
+	}
+	else
+	{
+		std::stack<node_intersection, std::vector<node_intersection>> intersections;
+		return cast_ray_impl(r, best_hit, intersections);
+	}
+}
+
+template <typename Stack>
+bool instanced_bvh::cast_ray_impl(const rt::ray &r, ray_hit &best_hit, Stack &intersections) const
+{
+	// Assume miss
+	best_hit.distance = rt::ray_miss;
+
+	// Check planes
+	rt::ray_intersection isec;
+	isec.distance = rt::ray_miss;
+	const rt::plane *best_plane = rt::plane::ray_intersect(m_planes.data(), m_planes.data() + m_planes.size(), r, isec);
+	if (best_plane) best_hit = best_plane->get_ray_hit(isec, r);
+
+	// Ray used for traversal - its range ends at the closest hit found so far
+	rt::traversal_ray tr{r, 0.f, isec.distance};
+
+	// Check intersection with the root node
+	if (!m_nodes.empty())
+	{
+		float t = m_nodes[0].ray_intersection_distance(tr);
+		if (t != rt::ray_miss)
+			intersections.emplace(0, t);
+	}
+
+	while (!intersections.empty())
+	{
+		auto node_isec = intersections.top();
+		intersections.pop();
+		const bvh_tree_node &node = m_nodes[node_isec.node];
+
+		// If an intersection was found earlier, closer than this volume itself - skip
+		if (tr.tmax < node_isec.t) continue;
+
+		// Leaves - cast the ray in object space of each instance. The direction
+		// is not normalized, so distances remain the same as in world space.
+		if (node.is_leaf())
+		{
+			for (std::uint32_t i = node.offset; i < node.offset + node.count; i++)
+			{
+				const bvh_instance &inst = m_instances[i];
+				rt::ray local;
+				local.origin = inst.inverse_transform * glm::vec4{r.origin, 1.f};
+				local.direction = inst.inverse_transform * glm::vec4{r.direction, 0.f};
+
+				ray_hit hit;
+				if (inst.blas->cast_ray(local, hit, tr.tmax))
+				{
+					best_hit = hit;
+					best_hit.direction = r.direction;
+					best_hit.position = r.origin + hit.distance * r.direction;
+					best_hit.normal = glm::normalize(inst.normal_matrix * hit.normal);
+					tr.tmax = hit.distance;
+				}
+			}
+			continue;
+		}
+
+		// Near and far child - left child contains instances with
+		// lower coordinates along the split axis
+		std::uint32_t near = node.offset + tr.sign[node.axis];
+		std::uint32_t far = node.offset + !tr.sign[node.axis];
+
+		float tn = m_nodes[near].ray_intersection_distance(tr);
+		float tf = m_nodes[far].ray_intersection_distance(tr);
+
+		// Check the far child later, so put it on the stack first
+		if (tf != rt::ray_miss)
+			intersections.emplace(far, tf);
+
+		if (tn != rt::ray_miss)
+			intersections.emplace(near, tn);
+	}
+
+	return best_hit.distance != rt::ray_miss;
+}
+
+bool instanced_bvh::occluded(const rt::ray &r, float tmax) const
+{
+	// The stack never outgrows the tree depth - deeper trees use a heap-allocated one
+	if (m_depth < traversal_stack_size)
+	{
+		rt::short_stack<std::uint32_t, traversal_stack_size> nodes;
+		return occluded_impl(r, tmax, nodes);
+	}
+	else
+	{
+		std::stack<std::uint32_t, std::vector<std::uint32_t>> nodes;
+		return occluded_impl(r, tmax, nodes);
+	}
+}
+
+template <typename Stack>
+bool instanced_bvh::occluded_impl(const rt::ray &r, float tmax, Stack &nodes) const
+{
+	rt::ray_intersection isec;
+	isec.distance = tmax;
+	if (rt::plane::ray_intersect(m_planes.data(), m_planes.data() + m_planes.size(), r, isec))
+		return true;
+
+	rt::traversal_ray tr{r, 0.f, tmax};
+	if (!m_nodes.empty() && m_nodes[0].ray_intersection_distance(tr) != rt::ray_miss)
+		nodes.push(0);
+
+	while (!nodes.empty())
+	{
+		const bvh_tree_node &node = m_nodes[nodes.top()];
+		nodes.pop();
+
+		if (node.is_leaf())
+		{
+			for (std::uint32_t i = node.offset; i < node.offset + node.count; i++)
+			{
+				const bvh_instance &inst = m_instances[i];
+				rt::ray local;
+				local.origin = inst.inverse_transform * glm::vec4{r.origin, 1.f};
+				local.direction = inst.inverse_transform * glm::vec4{r.direction, 0.f};
+
+				if (inst.blas->occluded(local, tmax))
+					return true;
+			}
+			continue;
+		}
+
+		std::uint32_t near = node.offset + tr.sign[node.axis];
+		std::uint32_t far = node.offset + !tr.sign[node.axis];
+
+		if (m_nodes[far].ray_intersection_distance(tr) != rt::ray_miss)
+			nodes.push(far);
+
+		if (m_nodes[near].ray_intersection_distance(tr) != rt::ray_miss)
+			nodes.push(near);
+	}
+
+	return false;
+}
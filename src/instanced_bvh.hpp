@@ -0,0 +1,122 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#include "ray_accelerator.hpp"
+#include "primitive.hpp"
+#include "scene.hpp"
+#include "bvh_tree.hpp"
+
+namespace rt {
+
+/**
+	Scene object placed in the world - references the object-space
+	BVH of its primitive collection
+*/
+struct bvh_instance
+{
+	aabb get_aabb() const
+	{
+		return bounds;
+	}
+
+	const bvh_tree *blas;
+
+	//! Index of the object in the scene
+	std::uint32_t object_index;
+
+	//! World to object space transform
+	glm::mat4 inverse_transform;
+
+	//! Transforms object space normals into world space
+	glm::mat3 normal_matrix;
+
+	//! World space bounding box
+	aabb bounds;
+};
+
+/**
+	Two-level BVH. Bottom-level trees are built once per primitive collection
+	in object space and shared by all objects using that collection. The top-level
+	tree is built over object instances and rays are transformed into object space
+	when they enter an instance.
+
+	Planes are unbounded, so they are kept in world space outside of the trees.
+*/
+class instanced_bvh : public ray_accelerator
+{
+public:
+	instanced_bvh(const scene &scene, const bvh_build_params &params = {});
+	bool cast_ray(const rt::ray &r, ray_hit &hit) const override;
+	bool occluded(const rt::ray &r, float tmax) const override;
+
+	/**
+		Reads objects' transforms again and rebuilds the top-level tree only.
+		The scene must contain the same objects the accelerator was built for.
+	*/
+	void update_transforms(const scene &scene);
+
+	const bvh_build_stats &get_build_stats() const
+	{
+		return m_build_stats;
+	}
+
+	/**
+		Returns number of bottom-level trees (unique primitive collections)
+	*/
+	std::size_t get_blas_count() const
+	{
+		return m_blas.size();
+	}
+
+	/**
+		Returns number of instances in the top-level tree
+	*/
+	std::size_t get_instance_count() const
+	{
+		return m_instances.size();
+	}
+
+private:
+	struct node_intersection
+	{
+		node_intersection() = default;
+
+		node_intersection(std::uint32_t n, float u) :
+			node(n),
+			t(u)
+		{}
+
+		std::uint32_t node;
+		float t;
+	};
+
+	//! Traversal stack size used for trees that are not too deep
+	static constexpr int traversal_stack_size = 64;
+
+	void build_tlas();
+	void update_instance(bvh_instance &inst, const glm::mat4 &transform) const;
+
+	template <typename Stack>
+	bool cast_ray_impl(const rt::ray &r, ray_hit &hit, Stack &intersections) const;
+
+	template <typename Stack>
+	bool occluded_impl(const rt::ray &r, float tmax, Stack &nodes) const;
+
+	bvh_build_params m_build_params;
+	bvh_build_stats m_build_stats;
+
+	//! Bottom-level trees indexed by the primitive collection they were built for
+	std::unordered_map<const primitive_collection*, std::unique_ptr<bvh_tree>> m_blas;
+
+	std::vector<bvh_tree_node> m_nodes;
+	int m_depth = 0;
+	std::vector<bvh_instance> m_instances;
+	std::vector<plane> m_planes;
+};
+
+}
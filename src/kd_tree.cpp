@@ -0,0 +1,309 @@
+#include "kd_tree.hpp"
+
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+
+#include "containers/short_stack.hpp"
+#include "traversal_stats.hpp"
+
+using rt::kd_tree;
+using rt::kd_tree_node;
+
+kd_tree::kd_tree(const rt::scene &scene)
+{
+	rt::primitive_collection primitives{scene.get_transformed_primitives()};
+	m_triangles = std::move(primitives.triangles);
+	m_spheres = std::move(primitives.spheres);
+	m_planes = std::move(primitives.planes);
+
+	bool bad_mat = false;
+	for (auto &p : m_triangles)
+		bad_mat |= p.material == nullptr;
+	for (auto &p : m_spheres)
+		bad_mat |= p.material == nullptr;
+	for (auto &p : m_planes)
+		bad_mat |= p.material == nullptr;
+
+	if (bad_mat)
+		throw std::runtime_error("Some primitives don't have any material assigned. Cannot proceed!");
+
+	build();
+}
+
+void kd_tree::build()
+{
+	std::uint32_t count = m_triangles.size() + m_spheres.size();
+	if (count == 0) return;
+
+	m_bounds.reserve(count);
+	for (const auto &t : m_triangles)
+		m_bounds.push_back(t.get_aabb());
+	for (const auto &s : m_spheres)
+		m_bounds.push_back(s.get_aabb());
+
+	m_min = glm::vec3{HUGE_VALF};
+	m_max = glm::vec3{-HUGE_VALF};
+	for (const auto &b : m_bounds)
+	{
+		m_min = glm::min(m_min, b.get_min());
+		m_max = glm::max(m_max, b.get_max());
+	}
+
+	// Depth limit suggested in PBRT, which also bounds the traversal stack
+	m_max_depth = std::min(traversal_stack_size, static_cast<int>(std::round(8.f + 1.3f * std::log2(static_cast<float>(count)))));
+
+	std::vector<std::uint32_t> references(count);
+	std::iota(references.begin(), references.end(), 0);
+	build_node(references, m_min, m_max, 1, 0);
+
+	m_bounds.clear();
+	m_bounds.shrink_to_fit();
+}
+
+/**
+	Builds subtree over given primitives. The node is appended to the node
+	array, followed by its subtree below and then the one above the split.
+*/
+void kd_tree::build_node(std::vector<std::uint32_t> &references, const glm::vec3 &min, const glm::vec3 &max, int depth, int bad_refines)
+{
+	std::uint32_t index = m_nodes.size();
+	m_nodes.emplace_back();
+	m_depth = std::max(m_depth, depth);
+
+	glm::vec3 size = max - min;
+	float area = 2.f * (size.x * size.y + size.x * size.z + size.y * size.z);
+	float leaf_cost = sah_ci * references.size();
+
+	// Split candidate - a face of a primitive's bounding box
+	struct edge
+	{
+		float t;
+		bool end;
+
+		bool operator<(const edge &rhs) const
+		{
+			return t == rhs.t ? end < rhs.end : t < rhs.t;
+		}
+	};
+
+	// Sweep over box faces along each axis
+	int best_axis = -1;
+	float best_split = 0.f;
+	float best_cost = HUGE_VALF;
+	if (references.size() > 1 && depth < m_max_depth && area > 0.f)
+	{
+		std::vector<edge> edges;
+		edges.reserve(2 * references.size());
+		for (int axis = 0; axis < 3; axis++)
+		{
+			edges.clear();
+			for (auto i : references)
+			{
+				const aabb &b = m_bounds[i];
+				edges.push_back({std::clamp(b.get_min()[axis], min[axis], max[axis]), false});
+				edges.push_back({std::clamp(b.get_max()[axis], min[axis], max[axis]), true});
+			}
+			std::sort(edges.begin(), edges.end());
+
+			// Children boxes differ only in the length along the split axis
+			int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+			float cap_area = size[a1] * size[a2];
+			float perimeter = size[a1] + size[a2];
+
+			long below = 0, above = references.size();
+			for (const auto &e : edges)
+			{
+				if (e.end) above--;
+
+				if (e.t > min[axis] && e.t < max[axis])
+				{
+					float below_area = 2.f * (cap_area + (e.t - min[axis]) * perimeter);
+					float above_area = 2.f * (cap_area + (max[axis] - e.t) * perimeter);
+					float bonus = (below == 0 || above == 0) ? empty_bonus : 0.f;
+					float cost = sah_ct + sah_ci * (1.f - bonus) * (below_area * below + above_area * above) / area;
+					if (cost < best_cost)
+					{
+						best_cost = cost;
+						best_axis = axis;
+						best_split = e.t;
+					}
+				}
+
+				if (!e.end) below++;
+			}
+		}
+	}
+
+	// Splits more expensive than a leaf are allowed a few times, as they may pay off deeper
+	if (best_cost > leaf_cost) bad_refines++;
+	bool make_leaf = best_axis < 0
+		|| (best_cost > 4.f * leaf_cost && references.size() < 16)
+		|| bad_refines > max_bad_refines;
+
+	if (make_leaf)
+	{
+		m_nodes[index].offset = m_references.size();
+		m_nodes[index].flags = (static_cast<std::uint32_t>(references.size()) << 2) | kd_tree_node::leaf_axis;
+		m_references.insert(m_references.end(), references.begin(), references.end());
+		return;
+	}
+
+	// Primitives lying in the split plane go below it
+	std::vector<std::uint32_t> below, above;
+	for (auto i : references)
+	{
+		const aabb &b = m_bounds[i];
+		float lo = b.get_min()[best_axis], hi = b.get_max()[best_axis];
+		if (lo < best_split || (lo == best_split && hi == best_split))
+			below.push_back(i);
+		if (hi > best_split)
+			above.push_back(i);
+	}
+
+	references.clear();
+	references.shrink_to_fit();
+
+	glm::vec3 below_max = max, above_min = min;
+	below_max[best_axis] = best_split;
+	above_min[best_axis] = best_split;
+
+	build_node(below, min, below_max, depth + 1, bad_refines);
+	std::uint32_t above_index = m_nodes.size();
+	build_node(above, above_min, max, depth + 1, bad_refines);
+
+	m_nodes[index].split = best_split;
+	m_nodes[index].flags = (above_index << 2) | best_axis;
+}
+
+bool kd_tree::intersect_primitive(std::uint32_t index, const rt::ray &r, ray_intersection &isec) const
+{
+	if (index < m_triangles.size())
+	{
+		const rt::triangle *t = &m_triangles[index];
+		return rt::triangle::ray_intersect(t, t + 1, r, isec) != nullptr;
+	}
+
+	const rt::sphere *s = &m_spheres[index - m_triangles.size()];
+	return rt::sphere::ray_intersect(s, s + 1, r, isec) != nullptr;
+}
+
+/**
+	Visits leaves pierced by the ray in front-to-back order, keeping track of
+	the ray range inside of each node. The leaf callback returns distance to
+	the closest hit found so far - the traversal ends once it's in the leaf.
+*/
+template <typename F>
+void kd_tree::traverse(const rt::ray &r, float tmax, F &&intersect_leaf) const
+{
+	if (m_nodes.empty()) return;
+
+	// Ray range within the root box
+	rt::traversal_ray tr{r, 0.f, tmax};
+	glm::vec3 a{(m_min - tr.origin) * tr.inv_direction};
+	glm::vec3 b{(m_max - tr.origin) * tr.inv_direction};
+	float t0 = std::max(std::max(std::min(a.x, b.x), std::min(a.y, b.y)), std::max(std::min(a.z, b.z), 0.f));
+	float t1 = std::min(std::min(std::max(a.x, b.x), std::max(a.y, b.y)), std::min(std::max(a.z, b.z), tmax));
+	if (t0 > t1) return;
+
+	// Depth of the tree is limited, so the stack can't overflow
+	rt::short_stack<node_range, traversal_stack_size> stack;
+	std::uint32_t index = 0;
+	float closest = tmax;
+
+	while (true)
+	{
+		const kd_tree_node &node = m_nodes[index];
+		RT_COUNT_NODES(1);
+
+		if (!node.is_leaf())
+		{
+			int axis = node.get_axis();
+			float t_split = (node.split - r.origin[axis]) * tr.inv_direction[axis];
+
+			// Child containing the ray origin is visited first
+			bool below_first = r.origin[axis] < node.split || (r.origin[axis] == node.split && r.direction[axis] <= 0.f);
+			std::uint32_t first = below_first ? index + 1 : node.get_data();
+			std::uint32_t second = below_first ? node.get_data() : index + 1;
+
+			// The split plane may be behind the ray, beyond its range or parallel to it
+			if (!(t_split > 0.f) || t_split > t1)
+				index = first;
+			else if (t_split < t0)
+				index = second;
+			else
+			{
+				stack.emplace(second, t_split, t1);
+				index = first;
+				t1 = t_split;
+			}
+
+			continue;
+		}
+
+		RT_COUNT_PRIMITIVES(node.get_data());
+		closest = intersect_leaf(node.offset, node.get_data());
+		if (closest <= t1 || stack.empty()) return;
+
+		// Nodes on the stack are ordered front-to-back
+		node_range next = stack.top();
+		stack.pop();
+		if (next.tmin > closest) return;
+
+		index = next.node;
+		t0 = next.tmin;
+		t1 = next.tmax;
+	}
+}
+
+bool kd_tree::cast_ray(const rt::ray &r, ray_hit &best_hit) const
+{
+	// Assume miss
+	best_hit.distance = rt::ray_miss;
+
+	// Nearset intersection
+	rt::ray_intersection isec;
+	isec.distance = rt::ray_miss;
+
+	// Check planes
+	const rt::plane *best_plane = rt::plane::ray_intersect(m_planes.data(), m_planes.data() + m_planes.size(), r, isec);
+	if (best_plane) best_hit = best_plane->get_ray_hit(isec, r);
+
+	std::uint32_t best = UINT32_MAX;
+	traverse(r, isec.distance, [&](std::uint32_t first, std::uint32_t count)
+	{
+		for (std::uint32_t i = first; i < first + count; i++)
+			if (intersect_primitive(m_references[i], r, isec))
+				best = m_references[i];
+
+		return isec.distance;
+	});
+
+	if (best < m_triangles.size())
+		best_hit = m_triangles[best].get_ray_hit(isec, r);
+	else if (best != UINT32_MAX)
+		best_hit = m_spheres[best - m_triangles.size()].get_ray_hit(isec, r);
+
+	return best_hit.distance != rt::ray_miss;
+}
+
+bool kd_tree::occluded(const rt::ray &r, float tmax) const
+{
+	rt::ray_intersection isec;
+	isec.distance = tmax;
+	if (rt::plane::ray_intersect(m_planes.data(), m_planes.data() + m_planes.size(), r, isec))
+		return true;
+
+	// Any hit ends the traversal
+	bool hit = false;
+	traverse(r, tmax, [&](std::uint32_t first, std::uint32_t count)
+	{
+		for (std::uint32_t i = first; i < first + count && !hit; i++)
+			hit = intersect_primitive(m_references[i], r, isec);
+
+		return hit ? 0.f : tmax;
+	});
+
+	return hit;
+}
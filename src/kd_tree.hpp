@@ -0,0 +1,139 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#include "ray_accelerator.hpp"
+#include "primitive.hpp"
+#include "scene.hpp"
+
+namespace rt {
+
+/**
+	Node of a kd-tree. Interior nodes store the split position, their first
+	child is stored right after them and `data` holds index of the other one.
+	Leaves store index of their first primitive reference and `data` holds
+	their primitive count.
+*/
+struct kd_tree_node
+{
+	static constexpr std::uint32_t leaf_axis = 3;
+
+	bool is_leaf() const
+	{
+		return (flags & 3u) == leaf_axis;
+	}
+
+	int get_axis() const
+	{
+		return flags & 3u;
+	}
+
+	std::uint32_t get_data() const
+	{
+		return flags >> 2;
+	}
+
+	union
+	{
+		float split;
+		std::uint32_t offset;
+	};
+
+	//! Split axis (or leaf_axis) in the lowest two bits, `data` in the rest
+	std::uint32_t flags;
+};
+
+static_assert(sizeof(kd_tree_node) == 8, "kd_tree_node should be 8 bytes");
+
+/**
+	Kd-tree over triangles and spheres built with SAH. Candidate split planes
+	are the primitives' bounding box faces clipped to the node, and splits
+	cutting off empty space are preferred. Primitives overlapping both sides
+	of a split are referenced by both children.
+
+	Primitive references below the triangle count refer to triangles,
+	the remaining ones to spheres.
+*/
+class kd_tree : public ray_accelerator
+{
+public:
+	explicit kd_tree(const scene &scene);
+	bool cast_ray(const rt::ray &r, ray_hit &hit) const override;
+	bool occluded(const rt::ray &r, float tmax) const override;
+
+	std::size_t get_node_count() const
+	{
+		return m_nodes.size();
+	}
+
+	int get_depth() const
+	{
+		return m_depth;
+	}
+
+	/**
+		Returns memory taken by nodes and primitive references in bytes
+	*/
+	std::size_t get_memory_usage() const
+	{
+		return m_nodes.size() * sizeof(kd_tree_node) + m_references.size() * sizeof(std::uint32_t);
+	}
+
+private:
+	/**
+		Node waiting to be visited with the ray range inside of it
+	*/
+	struct node_range
+	{
+		node_range() = default;
+
+		node_range(std::uint32_t n, float t0, float t1) :
+			node(n),
+			tmin(t0),
+			tmax(t1)
+		{}
+
+		std::uint32_t node;
+		float tmin;
+		float tmax;
+	};
+
+	//! Cost of primitive intersection and cost of traversal used in SAH
+	static constexpr float sah_ci = 1.0f;
+	static constexpr float sah_ct = 1.5f;
+
+	//! Cost reduction of splits with an empty child
+	static constexpr float empty_bonus = 0.2f;
+
+	//! Number of consecutive splits that may increase the cost
+	static constexpr int max_bad_refines = 3;
+
+	//! Traversal stack size - also limits the tree depth
+	static constexpr int traversal_stack_size = 64;
+
+	void build();
+	void build_node(std::vector<std::uint32_t> &references, const glm::vec3 &min, const glm::vec3 &max, int depth, int bad_refines);
+
+	template <typename F>
+	void traverse(const rt::ray &r, float tmax, F &&intersect_leaf) const;
+
+	bool intersect_primitive(std::uint32_t index, const rt::ray &r, ray_intersection &isec) const;
+
+	std::vector<kd_tree_node> m_nodes;
+	std::vector<std::uint32_t> m_references;
+	glm::vec3 m_min;
+	glm::vec3 m_max;
+	int m_depth = 0;
+	int m_max_depth = 0;
+
+	//! Primitive bounding boxes - only used while building
+	std::vector<aabb> m_bounds;
+
+	std::vector<triangle> m_triangles;
+	std::vector<sphere> m_spheres;
+	std::vector<plane> m_planes;
+};
+
+}
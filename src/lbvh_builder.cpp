@@ -0,0 +1,316 @@
+#include "lbvh_builder.hpp"
+
+#include <array>
+#include <stack>
+#include <chrono>
+#include <algorithm>
+
+using rt::lbvh_builder;
+
+namespace {
+
+/**
+	Spreads lower 21 bits of the value, so there are two zero bits between each of them
+*/
+std::uint64_t expand_bits(std::uint32_t v)
+{
+	std::uint64_t x = v & 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffull;
+	x = (x | x << 16) & 0x1f0000ff0000ffull;
+	x = (x | x << 8) & 0x100f00f00f00f00full;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+	x = (x | x << 2) & 0x1249249249249249ull;
+	return x;
+}
+
+/**
+	Runs f(chunk, begin, end) for consecutive ranges of [0, count) - one per pool thread.
+	The ranges are always the same for given count and pool.
+*/
+template <typename F>
+void parallel_chunks(rt::thread_pool &pool, std::atomic<long long> &work_ns, std::size_t count, F &&f)
+{
+	std::size_t chunks = pool.get_thread_count();
+	rt::thread_pool::task_group group{pool};
+	for (std::size_t c = 0; c < chunks; c++)
+	{
+		std::size_t begin = count * c / chunks;
+		std::size_t end = count * (c + 1) / chunks;
+		group.run([&f, &work_ns, c, begin, end]
+		{
+			rt::bvh_work_timer timer{work_ns};
+			f(c, begin, end);
+		});
+	}
+	group.wait();
+}
+
+}
+
+void lbvh_builder::build(std::vector<bvh_primitive_ref> &refs)
+{
+	m_nodes.clear();
+	m_depth = 0;
+	m_stats = bvh_build_stats{};
+	if (refs.empty()) return;
+
+	auto t_start = std::chrono::high_resolution_clock::now();
+	m_work_ns = 0;
+	m_max_depth = 0;
+
+	thread_pool pool{m_params.threads};
+	compute_codes(refs, pool);
+	sort_codes(pool);
+
+	// Reorder references along the curve
+	{
+		std::vector<bvh_primitive_ref> sorted(refs.size());
+		parallel_chunks(pool, m_work_ns, refs.size(), [&](std::size_t, std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; i++)
+				sorted[i] = refs[m_indices[i]];
+		});
+		refs = std::move(sorted);
+	}
+
+	// A binary tree with at least one primitive per leaf can't have more nodes
+	m_nodes.resize(2 * refs.size() - 1);
+	m_node_count = 1;
+	{
+		thread_pool::task_group group{pool};
+		group.run([&]{ emit_subtree(0, 0, refs.size(), 1, group); });
+		group.wait();
+	}
+	m_nodes.resize(m_node_count);
+	m_depth = m_max_depth;
+
+	compute_bounds(refs, pool);
+
+	std::vector<std::uint64_t>{}.swap(m_codes);
+	std::vector<std::uint32_t>{}.swap(m_indices);
+
+	auto t_end = std::chrono::high_resolution_clock::now();
+	m_stats.threads = pool.get_thread_count();
+	m_stats.build_time = t_end - t_start;
+	m_stats.work_time = std::chrono::nanoseconds{m_work_ns};
+}
+
+/**
+	Computes Morton codes of primitive centroids quantized within the centroid bounds
+*/
+void lbvh_builder::compute_codes(const std::vector<bvh_primitive_ref> &refs, thread_pool &pool)
+{
+	std::size_t chunks = pool.get_thread_count();
+	std::vector<glm::vec3> chunk_min(chunks, glm::vec3{HUGE_VALF}), chunk_max(chunks, glm::vec3{-HUGE_VALF});
+	parallel_chunks(pool, m_work_ns, refs.size(), [&](std::size_t c, std::size_t begin, std::size_t end)
+	{
+		for (std::size_t i = begin; i < end; i++)
+		{
+			glm::vec3 centroid = (refs[i].min + refs[i].max) * 0.5f;
+			chunk_min[c] = glm::min(chunk_min[c], centroid);
+			chunk_max[c] = glm::max(chunk_max[c], centroid);
+		}
+	});
+
+	glm::vec3 cmin{HUGE_VALF}, cmax{-HUGE_VALF};
+	for (std::size_t c = 0; c < chunks; c++)
+	{
+		cmin = glm::min(cmin, chunk_min[c]);
+		cmax = glm::max(cmax, chunk_max[c]);
+	}
+
+	// Flat axes get zero scale
+	constexpr float grid_size = (1u << morton_bits) - 1;
+	glm::vec3 extent = cmax - cmin;
+	glm::vec3 scale{
+		extent.x > 0.f ? grid_size / extent.x : 0.f,
+		extent.y > 0.f ? grid_size / extent.y : 0.f,
+		extent.z > 0.f ? grid_size / extent.z : 0.f
+	};
+
+	m_codes.resize(refs.size());
+	m_indices.resize(refs.size());
+	parallel_chunks(pool, m_work_ns, refs.size(), [&](std::size_t, std::size_t begin, std::size_t end)
+	{
+		for (std::size_t i = begin; i < end; i++)
+		{
+			glm::vec3 p = glm::clamp(((refs[i].min + refs[i].max) * 0.5f - cmin) * scale, glm::vec3{0.f}, glm::vec3{grid_size});
+			m_codes[i] = expand_bits(p.x) << 2 | expand_bits(p.y) << 1 | expand_bits(p.z);
+			m_indices[i] = i;
+		}
+	});
+}
+
+/**
+	Parallel LSD radix sort of the codes (with their indices). Each pass
+	sorts by one digit - threads count digits in their part of the array,
+	and then scatter elements to the positions given by prefix sums.
+*/
+void lbvh_builder::sort_codes(thread_pool &pool)
+{
+	constexpr int radix_bits = 8;
+	constexpr int bucket_count = 1 << radix_bits;
+
+	std::size_t n = m_codes.size();
+	std::size_t chunks = pool.get_thread_count();
+	std::vector<std::array<std::uint32_t, bucket_count>> histograms(chunks);
+	std::vector<std::uint64_t> codes(n);
+	std::vector<std::uint32_t> indices(n);
+
+	for (int shift = 0; shift < 3 * morton_bits; shift += radix_bits)
+	{
+		parallel_chunks(pool, m_work_ns, n, [&](std::size_t c, std::size_t begin, std::size_t end)
+		{
+			auto &histogram = histograms[c];
+			histogram.fill(0);
+			for (std::size_t i = begin; i < end; i++)
+				histogram[(m_codes[i] >> shift) & (bucket_count - 1)]++;
+		});
+
+		// Digit-major, chunk-minor prefix sums keep the sort stable
+		bool trivial = false;
+		std::uint32_t sum = 0;
+		for (int d = 0; d < bucket_count; d++)
+		{
+			std::uint32_t digit_sum = sum;
+			for (auto &histogram : histograms)
+			{
+				std::uint32_t count = histogram[d];
+				histogram[d] = sum;
+				sum += count;
+			}
+
+			// All codes have the same digit - nothing to do
+			if (sum - digit_sum == n)
+				trivial = true;
+		}
+
+		if (trivial) continue;
+
+		parallel_chunks(pool, m_work_ns, n, [&](std::size_t c, std::size_t begin, std::size_t end)
+		{
+			auto &offsets = histograms[c];
+			for (std::size_t i = begin; i < end; i++)
+			{
+				std::uint32_t pos = offsets[(m_codes[i] >> shift) & (bucket_count - 1)]++;
+				codes[pos] = m_codes[i];
+				indices[pos] = m_indices[i];
+			}
+		});
+
+		m_codes.swap(codes);
+		m_indices.swap(indices);
+	}
+}
+
+/**
+	Creates nodes for a range of sorted primitives. Ranges are split where the highest
+	differing bit of their codes changes - codes of all primitives in the range share
+	the bits above it, so the split is found with binary search.
+*/
+void lbvh_builder::emit_subtree(std::uint32_t root, std::uint32_t begin, std::uint32_t end, int depth, thread_pool::task_group &group)
+{
+	bvh_work_timer timer{m_work_ns};
+
+	struct range
+	{
+		std::uint32_t node;
+		std::uint32_t begin;
+		std::uint32_t end;
+		int depth;
+	};
+
+	std::stack<range, std::vector<range>> to_process;
+	to_process.push({root, begin, end, depth});
+	int max_depth = depth;
+
+	while (!to_process.empty())
+	{
+		range r = to_process.top();
+		to_process.pop();
+		max_depth = std::max(max_depth, r.depth);
+
+		bvh_tree_node &node = m_nodes[r.node];
+		node.padding = 0;
+		node.axis = 0;
+
+		if (r.end - r.begin <= max_leaf_size)
+		{
+			node.offset = r.begin;
+			node.count = r.end - r.begin;
+			continue;
+		}
+
+		std::uint64_t first = m_codes[r.begin];
+		std::uint64_t last = m_codes[r.end - 1];
+		std::uint32_t split;
+
+		// Primitives with equal codes are split in half
+		if (first == last)
+			split = r.begin + (r.end - r.begin) / 2;
+		else
+		{
+			int bit = 63 - __builtin_clzll(first ^ last);
+			auto it = std::partition_point(m_codes.begin() + r.begin, m_codes.begin() + r.end, [bit](std::uint64_t code){
+				return !((code >> bit) & 1);
+			});
+
+			split = it - m_codes.begin();
+
+			// Bits go in x, y, z order from the most significant one
+			node.axis = 2 - bit % 3;
+		}
+
+		std::uint32_t child = m_node_count.fetch_add(2);
+		node.offset = child;
+		node.count = 0;
+
+		for (range c : {range{child, r.begin, split, r.depth + 1}, range{child + 1, split, r.end, r.depth + 1}})
+		{
+			if (c.end - c.begin >= parallel_build_threshold)
+				group.run([this, c, &group]{ emit_subtree(c.node, c.begin, c.end, c.depth, group); });
+			else
+				to_process.push(c);
+		}
+	}
+
+	int current = m_max_depth;
+	while (current < max_depth && !m_max_depth.compare_exchange_weak(current, max_depth));
+}
+
+/**
+	Computes bounds of leaves in parallel and then bounds of interior nodes.
+	Children are always stored after their parents, so going backwards
+	processes them first.
+*/
+void lbvh_builder::compute_bounds(const std::vector<bvh_primitive_ref> &refs, thread_pool &pool)
+{
+	parallel_chunks(pool, m_work_ns, m_nodes.size(), [&](std::size_t, std::size_t begin, std::size_t end)
+	{
+		for (std::size_t i = begin; i < end; i++)
+		{
+			bvh_tree_node &node = m_nodes[i];
+			if (!node.is_leaf()) continue;
+
+			node.min = glm::vec3{HUGE_VALF};
+			node.max = glm::vec3{-HUGE_VALF};
+			for (std::uint32_t j = node.offset; j < node.offset + node.count; j++)
+			{
+				node.min = glm::min(node.min, refs[j].min);
+				node.max = glm::max(node.max, refs[j].max);
+			}
+		}
+	});
+
+	bvh_work_timer timer{m_work_ns};
+	for (std::size_t i = m_nodes.size(); i-- > 0;)
+	{
+		bvh_tree_node &node = m_nodes[i];
+		if (node.is_leaf()) continue;
+
+		const bvh_tree_node &l = m_nodes[node.offset];
+		const bvh_tree_node &r = m_nodes[node.offset + 1];
+		node.min = glm::min(l.min, r.min);
+		node.max = glm::max(l.max, r.max);
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+#include "bvh_builder.hpp"
+
+namespace rt {
+
+/**
+	Builds a binary BVH over primitive references using the LBVH algorithm
+	(Lauterbach et al., "Fast BVH Construction on GPUs").
+
+	Primitives are sorted along a Morton curve through their centroids and
+	nodes are split where the highest bit of the Morton codes changes. No
+	cost function is evaluated, so building is an order of magnitude faster
+	than with SAH, at the cost of worse tree quality.
+
+	The references are reordered, so that each leaf references a contiguous
+	range of them, just like with `bvh_builder`. Children are always stored
+	after their parents, but not necessarily in depth-first order.
+*/
+class lbvh_builder
+{
+public:
+	//! Ranges of at most this many primitives become leaves (one triangle block)
+	static constexpr std::uint32_t max_leaf_size = 8;
+
+	explicit lbvh_builder(const bvh_build_params &params = {}) :
+		m_params(params)
+	{}
+
+	void build(std::vector<bvh_primitive_ref> &refs);
+
+	/**
+		Provides access to the built nodes, so they can be moved out
+	*/
+	std::vector<bvh_tree_node> &get_nodes()
+	{
+		return m_nodes;
+	}
+
+	int get_depth() const
+	{
+		return m_depth;
+	}
+
+	const bvh_build_stats &get_stats() const
+	{
+		return m_stats;
+	}
+
+private:
+	//! Number of bits per axis in Morton codes
+	static constexpr int morton_bits = 21;
+
+	//! Number of primitives above which a subtree is built as a separate task
+	static constexpr std::uint32_t parallel_build_threshold = 4096;
+
+	void compute_codes(const std::vector<bvh_primitive_ref> &refs, thread_pool &pool);
+	void sort_codes(thread_pool &pool);
+	void emit_subtree(std::uint32_t root, std::uint32_t begin, std::uint32_t end, int depth, thread_pool::task_group &group);
+	void compute_bounds(const std::vector<bvh_primitive_ref> &refs, thread_pool &pool);
+
+	bvh_build_params m_params;
+	bvh_build_stats m_stats;
+	std::atomic<long long> m_work_ns{0};
+
+	//! Morton codes of the primitives and their indices
+	std::vector<std::uint64_t> m_codes;
+	std::vector<std::uint32_t> m_indices;
+
+	std::vector<bvh_tree_node> m_nodes;
+	std::atomic<std::uint32_t> m_node_count{0};
+	std::atomic<int> m_max_depth{0};
+	int m_depth = 0;
+};
+
+}
@@ -22,8 +22,8 @@ public:
 	virtual ~abstract_material() = default;
 
 	/**
-		Returns scattering and emission information and generates new rays based on two
-		uniformly random numbers and IOR of the medium the ray was travelling in
+		Returns scattering and emission information and generates new rays based on
+		samples taken with ctx.get_sample() and IOR of the medium the ray was travelling in
 	*/
 	virtual rt::ray_bounce get_bounce(const rt::path_tracer &ctx, const ray_hit &hit, float ior) const = 0;
 };
@@ -126,8 +126,8 @@ rt::ray_bounce general_bsdf::get_bounce(const rt::path_tracer &ctx, const ray_hi
 	glm::mat3 inv_tbn_mat{glm::transpose(tbn_mat)};
 
 	// Two random variables for sampling
-	float r1 = ctx.get_rand();
-	float r2 = ctx.get_rand();
+	float r1 = ctx.get_sample(rt::bounce_dimension::DIRECTION_U);
+	float r2 = ctx.get_sample(rt::bounce_dimension::DIRECTION_V);
 
 	// Sample the distribution of visible normals
 	// and get microfacet normal
@@ -143,7 +143,7 @@ rt::ray_bounce general_bsdf::get_bounce(const rt::path_tracer &ctx, const ray_hi
 	F0 = F0 * F0;
 	F0 = glm::mix(F0, 1.f, metallic);
 
-	if (ctx.get_rand() < F(glm::dot(wo, wm), F0))
+	if (ctx.get_sample(rt::bounce_dimension::LOBE) < F(glm::dot(wo, wm), F0))
 	// if(0)
 	{
 		wi = glm::reflect(-wo, wm);
@@ -169,7 +169,7 @@ rt::ray_bounce general_bsdf::get_bounce(const rt::path_tracer &ctx, const ray_hi
 	else
 	{
 		// Transmission / diffuse
-		if (this->transmission != 0.f && ctx.get_rand() < this->transmission)
+		if (this->transmission != 0.f && ctx.get_sample(rt::bounce_dimension::TRANSMISSION) < this->transmission)
 		{
 			wi = {glm::refract(-wo, wm, eta)};
 			
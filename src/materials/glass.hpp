@@ -54,7 +54,7 @@ inline rt::ray_bounce simple_glass_material::get_bounce(const rt::path_tracer &c
 	rt::ray_bounce bounce;
 
 	// Fresnel term determines amount of REFLECTED light
-	if (ctx.get_rand() < fresnel)
+	if (ctx.get_sample(rt::bounce_dimension::LOBE) < fresnel)
 	{
 		// Reflect
 		bounce.new_ray.origin = hit.position + N * 0.001f;
@@ -71,9 +71,9 @@ static inline float trowbridge_reitz_ggx(const glm::vec3 &H, const glm::vec3 &N,
 
 rt::ray_bounce pbr_material::get_bounce(const rt::path_tracer &ctx, const rt::ray_hit &hit, float ior) const
 {
-	float r1 = ctx.get_rand();
-	float r2 = ctx.get_rand();
-	float r3 = ctx.get_rand();
+	float r1 = ctx.get_sample(rt::bounce_dimension::DIRECTION_U);
+	float r2 = ctx.get_sample(rt::bounce_dimension::DIRECTION_V);
+	float r3 = ctx.get_sample(rt::bounce_dimension::LOBE);
 
 	// Use r1 and r2 as polar coordinates to 
 	float phi = r1 * 2.f * rt::pi<>;
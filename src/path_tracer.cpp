@@ -1,20 +1,68 @@
 #include "path_tracer.hpp"
 #include <algorithm>
+#include <functional>
 #include <iostream>
 
 using rt::path_tracer;
 
-path_tracer::path_tracer(const rt::scene &sc, rt::sampled_hdr_image &img, unsigned long seed) :
+namespace {
+
+/**
+	Returns position of the i-th pixel along the Morton curve
+*/
+glm::ivec2 morton_position(int i)
+{
+	glm::ivec2 pos{0};
+	for (int bit = 0; (i >> (2 * bit)) != 0; bit++)
+	{
+		pos.x |= ((i >> (2 * bit)) & 1) << bit;
+		pos.y |= ((i >> (2 * bit + 1)) & 1) << bit;
+	}
+	return pos;
+}
+
+}
+
+path_tracer::path_tracer(const rt::scene &sc, rt::sampled_hdr_image &img, std::shared_ptr<const rt::sampler> sampler, rt::integrator integrator) :
 	m_camera(&sc.get_camera()),
 	m_scene(&sc),
-	m_accelerator(&sc.get_accelerator()),
-	m_rng(seed),
-	m_dist(0.f, 1.f),
-	m_image(&img)
+	m_accelerator(sc.get_accelerator()),
+	m_sampler(std::move(sampler)),
+	m_image(&img),
+	m_integrator(integrator)
+{
+}
+
+glm::vec3 path_tracer::sample_pixel(const glm::ivec2 &pixel, int sample_index, int max_depth, float survival_bias)
+{
+	m_accelerator = m_scene->get_accelerator();
+	m_sample_index = sample_index;
+	return trace_path(get_camera_ray(pixel), nullptr, max_depth, survival_bias);
+}
+
+/**
+	Returns camera ray through the pixel with anti-aliasing offset taken
+	from the sampler. The pixel becomes the sampler's current pixel.
+*/
+rt::ray path_tracer::get_camera_ray(const glm::ivec2 &pixel) const
 {
+	auto res = m_image->get_dimensions();
+	m_pixel_key = pixel.y * res.x + pixel.x;
+
+	// Normalized pixel coordinates + anti-aliasing offset
+	glm::vec2 pixel_pos{
+		(pixel.x + get_camera_sample(rt::camera_dimension::PIXEL_X)) / res.x * 2.f - 1.f,
+		1.f - (pixel.y + get_camera_sample(rt::camera_dimension::PIXEL_Y)) / res.y * 2.f
+	};
+
+	return m_camera->get_ray(pixel_pos);
 }
 
-glm::vec3 path_tracer::sample_pixel(const glm::vec2 &pixel_pos, int max_depth, float survival_bias) const
+/**
+	Follows a path starting with the given ray. If the hit of the first
+	ray is already known (from packet tracing), it's not traced again.
+*/
+glm::vec3 path_tracer::trace_path(rt::ray r, const rt::ray_hit *primary_hit, int max_depth, float survival_bias) const
 {
 	// Hit record and bounce/scatter
 	rt::ray_hit hit;
@@ -24,20 +72,21 @@ glm::vec3 path_tracer::sample_pixel(const glm::vec2 &pixel_pos, int max_depth, f
 	glm::vec3 pixel{0.f};
 
 	// Current ray
-	rt::ray r = m_camera->get_ray(pixel_pos);
 	glm::vec3 weight{1.f};
 	float ior = 1.f;
 	int depth = 0;
 
 	while (depth < max_depth && weight != glm::vec3{0.f})
 	{
+		m_depth = depth;
+
 		// Russian roulette for path termination
 		float p_survive = survival_bias * std::max(weight.x, std::max(weight.y, weight.z));
-		if (p_survive < 1.f && get_rand() >= p_survive)
+		if (p_survive < 1.f && get_sample(rt::bounce_dimension::ROULETTE) >= p_survive)
 			break;
 
 		weight /= glm::min(p_survive, 1.f);
-		hit = m_scene->cast_ray(r, *m_accelerator);
+		hit = (depth == 0 && primary_hit) ? *primary_hit : m_scene->cast_ray(r, *m_accelerator);
 		bounce = hit.material->get_bounce(*this, hit, ior);
 
 		// Emissive materials terminate rays
@@ -60,34 +109,218 @@ glm::vec3 path_tracer::sample_pixel(const glm::vec2 &pixel_pos, int max_depth, f
 	return pixel;
 }
 
+void path_tracer::sample_tile(const glm::ivec2 &min, const glm::ivec2 &max, int sample_index, std::vector<glm::vec3> &samples, int max_depth, float p_extinct)
+{
+	auto t_start = std::chrono::high_resolution_clock::now();
+
+	// The accelerator may have been replaced - the whole tile uses the same one
+	m_accelerator = m_scene->get_accelerator();
+	m_sample_index = sample_index;
+
+	glm::ivec2 size = max - min;
+	samples.assign(size.x * size.y, glm::vec3{0.f});
+
+	if (m_integrator == rt::integrator::WAVEFRONT)
+		sample_tile_wavefront(min, max, samples, max_depth, p_extinct);
+	else
+		sample_tile_path(min, max, samples, max_depth, p_extinct);
+
+	m_t_last = std::chrono::high_resolution_clock::now() - t_start;
+}
+
 /**
-	Performs one pass of sampling.
+	Samples pixels one at a time. Camera rays are coherent, so they're
+	traced in packets - each run of 64 pixels along the Morton curve
+	forms an 8x8 block. Following bounces are traced one ray at a time.
 */
-void path_tracer::sample_image(int max_depth, float p_extinct, const std::atomic<bool> *active_flag)
+void path_tracer::sample_tile_path(const glm::ivec2 &min, const glm::ivec2 &max, std::vector<glm::vec3> &samples, int max_depth, float p_extinct)
 {
+	constexpr int block_size = packet_tile_size * packet_tile_size;
 	auto res = m_image->get_dimensions();
-	auto t_start = std::chrono::high_resolution_clock::now();
 
-	for (int y = 0; y < res.y && (!active_flag || *active_flag); y++)
+	rt::ray_packet packet;
+	rt::ray_hit hits[rt::ray_packet::max_size];
+	glm::ivec2 positions[rt::ray_packet::max_size];
+
+	for (int first = 0; first < tile_size * tile_size; first += block_size)
 	{
-		for (int x = 0; x < res.x && (!active_flag || *active_flag); x++)
+		// Blocks at the image edges are clipped
+		packet.size = 0;
+		for (int i = first; i < first + block_size; i++)
+		{
+			glm::ivec2 pos = min + morton_position(i);
+			if (pos.x >= max.x || pos.y >= max.y) continue;
+
+			positions[packet.size] = pos;
+			packet.add(get_camera_ray(pos));
+		}
+
+		if (packet.size == 0) continue;
+		m_scene->cast_packet(packet, *m_accelerator, hits);
+
+		// Store samples
+		int width = max.x - min.x;
+		for (int i = 0; i < packet.size; i++)
 		{
-			// Normalized pixel coordinates + random anti-aliasing offset
-			glm::vec2 pixel_pos{
-				(x + this->get_rand()) / res.x * 2.f - 1.f,
-				1.f - (y + this->get_rand()) / res.y * 2.f
-			};
-
-			// Write pixel
-			m_image->pixel(x, y) += sample_pixel(pixel_pos, max_depth, p_extinct);
+			m_pixel_key = positions[i].y * res.x + positions[i].x;
+			samples[(positions[i].y - min.y) * width + positions[i].x - min.x] = trace_path(packet.rays[i], &hits[i], max_depth, p_extinct);
 		}
 	}
+}
+
+/**
+	Wavefront integrator - keeps a batch of paths in flight and advances all
+	of them by one bounce at a time. Rays of all paths are traced first, then
+	the paths are sorted by material and shaded, so each material's code and
+	data stay in cache. Finished paths are replaced with new camera paths
+	until all pixels of the tile are sampled.
+
+	Each path makes the same decisions as in trace_path() and takes its
+	samples from the same dimensions, so both integrators produce the
+	same image.
+*/
+void path_tracer::sample_tile_wavefront(const glm::ivec2 &min, const glm::ivec2 &max, std::vector<glm::vec3> &samples, int max_depth, float p_extinct)
+{
+	// Pixels are visited in Morton order, so new camera rays are coherent
+	m_pixel_order.clear();
+	for (int i = 0; i < tile_size * tile_size; i++)
+	{
+		glm::ivec2 pos = min + morton_position(i);
+		if (pos.x < max.x && pos.y < max.y)
+			m_pixel_order.push_back(pos);
+	}
+
+	m_paths.resize(wavefront_size);
+	m_active.clear();
+	m_free.clear();
+	for (int i = wavefront_size - 1; i >= 0; i--)
+		m_free.push_back(i);
 
-	m_image->add_sample();
+	std::size_t next_pixel = 0;
+	while (true)
+	{
+		// Start new paths in free slots
+		while (!m_free.empty() && next_pixel < m_pixel_order.size())
+		{
+			const glm::ivec2 &pos = m_pixel_order[next_pixel];
+			path_state &path = m_paths[m_free.back()];
+			path.ray = get_camera_ray(pos);
+			path.weight = glm::vec3{1.f};
+			path.ior = 1.f;
+			path.depth = 0;
+			path.pixel = (pos.y - min.y) * (max.x - min.x) + pos.x - min.x;
+			path.pixel_key = m_pixel_key;
+			next_pixel++;
+
+			if (continue_path(path, max_depth, p_extinct))
+			{
+				m_active.push_back(m_free.back());
+				m_free.pop_back();
+			}
+		}
+
+		if (m_active.empty())
+			break;
+
+		extend_paths();
+		shade_paths(samples, max_depth, p_extinct);
+	}
+}
+
+/**
+	Decides whether the path continues (with Russian roulette) before
+	the next ray is traced - the same way trace_path() does.
+*/
+bool path_tracer::continue_path(path_state &path, int max_depth, float survival_bias) const
+{
+	if (path.depth >= max_depth || path.weight == glm::vec3{0.f})
+		return false;
+
+	m_pixel_key = path.pixel_key;
+	m_depth = path.depth;
+
+	float p_survive = survival_bias * std::max(path.weight.x, std::max(path.weight.y, path.weight.z));
+	if (p_survive < 1.f && get_sample(rt::bounce_dimension::ROULETTE) >= p_survive)
+		return false;
+
+	path.weight /= glm::min(p_survive, 1.f);
+	return true;
+}
+
+/**
+	Traces rays of all active paths. Camera rays were generated in tile
+	order and are traced in packets.
+*/
+void path_tracer::extend_paths()
+{
+	rt::ray_packet packet;
+	rt::ray_hit hits[rt::ray_packet::max_size];
+	int packet_paths[rt::ray_packet::max_size];
+
+	auto cast_packet = [&]()
+	{
+		m_scene->cast_packet(packet, *m_accelerator, hits);
+		for (int i = 0; i < packet.size; i++)
+			m_paths[packet_paths[i]].hit = hits[i];
+		packet.size = 0;
+	};
+
+	for (int index : m_active)
+	{
+		path_state &path = m_paths[index];
+		if (path.depth == 0)
+		{
+			packet_paths[packet.size] = index;
+			packet.add(path.ray);
+			if (packet.full()) cast_packet();
+		}
+		else
+			path.hit = m_scene->cast_ray(path.ray, *m_accelerator);
+	}
+
+	if (packet.size) cast_packet();
+}
+
+/**
+	Shades all active paths in material order. Paths which are terminated
+	are removed from the active list and their slots are freed.
+*/
+void path_tracer::shade_paths(std::vector<glm::vec3> &samples, int max_depth, float survival_bias)
+{
+	std::sort(m_active.begin(), m_active.end(), [this](int a, int b){
+		return std::less<const rt::abstract_material*>{}(m_paths[a].hit.material, m_paths[b].hit.material);
+	});
+
+	std::size_t active_count = 0;
+	for (int index : m_active)
+	{
+		path_state &path = m_paths[index];
+		m_pixel_key = path.pixel_key;
+		m_depth = path.depth;
+		rt::ray_bounce bounce = path.hit.material->get_bounce(*this, path.hit, path.ior);
+
+		// Emissive materials terminate rays and contribute to the pixel through ray's weight
+		bool active = false;
+		if (bounce.emission != glm::vec3{0.f})
+		{
+			samples[path.pixel] += path.weight * bounce.emission;
+		}
+		else
+		{
+			path.ray = bounce.new_ray;
+			path.weight *= bounce.bsdf;
+			path.ior = bounce.ior;
+			path.depth++;
+			active = continue_path(path, max_depth, survival_bias);
+		}
+
+		if (active)
+			m_active[active_count++] = index;
+		else
+			m_free.push_back(index);
+	}
 
-	// Measure time
-	auto t_end = std::chrono::high_resolution_clock::now();
-	m_t_last = t_end - t_start;
+	m_active.resize(active_count);
 }
 
 void path_tracer::clear_image()
@@ -97,7 +330,6 @@ void path_tracer::clear_image()
 
 std::ostream &operator<<(std::ostream &s, const path_tracer &pt)
 {
-	s << "rt::path_tracer - " << pt.get_image().get_sample_count() << " samples - " 
-		<< pt.get_last_sample_time().count() << "s per sample";
+	s << "rt::path_tracer - " << pt.get_last_tile_time().count() << "s per tile";
 	return s;
 }
\ No newline at end of file
@@ -1,19 +1,28 @@
 #pragma once 
 
 #include <vector>
-#include <random>
 #include <chrono>
 #include <iosfwd>
-#include <atomic>
+#include <memory>
 
 #include "scene.hpp"
 #include "camera.hpp"
 #include "ray_accelerator.hpp"
 #include "containers/image.hpp"
+#include "sampler.hpp"
 #include "utility.hpp"
 
 namespace rt {
 
+/**
+	Order in which paths are traced
+*/
+enum class integrator
+{
+	PATH,		//!< Each path is traced depth-first, one pixel at a time
+	WAVEFRONT	//!< A batch of paths is advanced one bounce at a time, shading is done in material order
+};
+
 /**
 	Path tracing context - use one per thread. Context contains
 	data and objects reused between subsequent pixel sampling
@@ -24,13 +33,31 @@ class path_tracer
 	friend std::ostream &operator<<(std::ostream &, const path_tracer &);
 
 public:
-	path_tracer(const rt::scene &sc, rt::sampled_hdr_image &img, unsigned long seed);
-
-	//! Samples one pixel
-	glm::vec3 sample_pixel(const glm::vec2 &pixel_pos, int max_depth = 40, float survival_bias = 4.f) const;
-	
-	//! Samples each pixel in the image
-	void sample_image(int max_depth = 40, float survival_bias = 4.0f, const std::atomic<bool> *stop_flag = nullptr);
+	path_tracer(const rt::scene &sc, rt::sampled_hdr_image &img, std::shared_ptr<const rt::sampler> sampler, rt::integrator integrator = rt::integrator::PATH);
+
+	//! Size of image tiles - pixels of a tile are sampled in Morton order
+	static constexpr int tile_size = 32;
+
+	/**
+		Takes sample `sample_index` of one pixel. The sample is the same
+		as the one taken when the pixel is sampled as part of a tile.
+	*/
+	glm::vec3 sample_pixel(const glm::ivec2 &pixel, int sample_index, int max_depth = 40, float survival_bias = 4.f);
+
+	/**
+		Takes one sample of each pixel of a tile spanning from `min` to `max` (exclusive),
+		at most tile_size pixels wide. Samples are stored in `samples` row by row and
+		the image is left untouched, so tracers sharing an image may sample its tiles
+		at the same time. `sample_index` is the number of samples the pixels already
+		have - it selects the sample from the sampler's sequences.
+	*/
+	void sample_tile(const glm::ivec2 &min, const glm::ivec2 &max, int sample_index, std::vector<glm::vec3> &samples, int max_depth = 40, float survival_bias = 4.f);
+
+	//! Selects integrator used by sample_tile()
+	void set_integrator(rt::integrator integrator)
+	{
+		m_integrator = integrator;
+	}
 
 	//! Clears the image and resets sample number
 	void clear_image();
@@ -41,35 +68,91 @@ public:
 		return *m_image;
 	}
 
-	//! Provides access to private random float generator
-	float get_rand() const
+	/**
+		Returns sample value of a dimension of the path vertex being shaded.
+		Materials take their random numbers from here.
+	*/
+	float get_sample(rt::bounce_dimension dimension) const
 	{
-		return m_dist(m_rng);
+		return m_sampler->get(m_pixel_key, m_sample_index, rt::get_sample_dimension(m_depth, dimension));
 	}
 
-	//! Returns time elapsed for the last sample
-	std::chrono::duration<double> get_last_sample_time() const
+	//! Returns time taken by the last tile
+	std::chrono::duration<double> get_last_tile_time() const
 	{
 		return m_t_last;
 	}
 
 private:
+	//! Size of pixel blocks whose camera rays are traced as packets
+	static constexpr int packet_tile_size = 8;
+	static_assert(packet_tile_size * packet_tile_size <= ray_packet::max_size);
+	static_assert((tile_size & (tile_size - 1)) == 0 && tile_size % packet_tile_size == 0, "Tiles must consist of whole packet blocks along the Morton curve");
+
+	//! Number of paths in flight in the wavefront integrator - a quarter of a tile, so slots
+	//! freed by terminated paths are refilled with the tile's remaining pixels and stay busy
+	static constexpr int wavefront_size = tile_size * tile_size / 4;
+	static_assert(wavefront_size > 0 && wavefront_size < tile_size * tile_size);
+
+	/**
+		State of a path in the wavefront integrator
+	*/
+	struct path_state
+	{
+		rt::ray ray;
+		rt::ray_hit hit;
+		glm::vec3 weight;
+		float ior;
+		int depth;
+
+		//! Index of the pixel's sample in the tile
+		int pixel;
+
+		//! Index of the pixel in the image - selects the sampler's sequence
+		std::uint32_t pixel_key;
+	};
+
+	float get_camera_sample(rt::camera_dimension dimension) const
+	{
+		return m_sampler->get(m_pixel_key, m_sample_index, rt::get_sample_dimension(dimension));
+	}
+
+	rt::ray get_camera_ray(const glm::ivec2 &pixel) const;
+	glm::vec3 trace_path(rt::ray r, const rt::ray_hit *primary_hit, int max_depth, float survival_bias) const;
+	void sample_tile_path(const glm::ivec2 &min, const glm::ivec2 &max, std::vector<glm::vec3> &samples, int max_depth, float survival_bias);
+	void sample_tile_wavefront(const glm::ivec2 &min, const glm::ivec2 &max, std::vector<glm::vec3> &samples, int max_depth, float survival_bias);
+	bool continue_path(path_state &path, int max_depth, float survival_bias) const;
+	void extend_paths();
+	void shade_paths(std::vector<glm::vec3> &samples, int max_depth, float survival_bias);
+
 	// Camera, scene and ray accelerator
 	const rt::camera *m_camera;
 	const rt::scene *m_scene;
-	const rt::ray_accelerator *m_accelerator;
 
-	//! Random number generator
-	mutable std::mt19937 m_rng;
-	
-	//! Uniform 0-1 float distrubition
-	mutable std::uniform_real_distribution<float> m_dist;
+	//! Accelerator used in the current pass - it's taken from the scene at the start of each pass
+	std::shared_ptr<const rt::ray_accelerator> m_accelerator;
 
-	//! Time taken for the last sample
+	//! Sample generator shared with other tracers
+	std::shared_ptr<const rt::sampler> m_sampler;
+
+	//! Pixel, its sample and depth of the path vertex whose samples are taken by get_sample()
+	mutable std::uint32_t m_pixel_key = 0;
+	std::uint32_t m_sample_index = 0;
+	mutable int m_depth = 0;
+
+	//! Time taken by the last tile
 	std::chrono::duration<double> m_t_last;
 
 	//! Image data
 	sampled_hdr_image *m_image;
+
+	rt::integrator m_integrator;
+
+	//! Wavefront integrator - path slots, pixel order in the tile and indices of active and free slots
+	std::vector<path_state> m_paths;
+	std::vector<glm::ivec2> m_pixel_order;
+	std::vector<int> m_active;
+	std::vector<int> m_free;
 } __attribute__((aligned(RT_CACHE_LINE_SIZE)));
 
 
@@ -25,6 +25,36 @@ struct ray
 */
 inline constexpr float ray_miss = HUGE_VALF;
 
+/**
+	Ray with precomputed data used for traversing acceleration structures.
+	Only intersections within [tmin, tmax] are of interest.
+*/
+struct traversal_ray
+{
+	traversal_ray() = default;
+
+	traversal_ray(const ray &r, float t0 = 0.f, float t1 = rt::ray_miss) :
+		origin(r.origin),
+		direction(r.direction),
+		inv_direction(1.f / r.direction),
+		sign{inv_direction.x < 0.f, inv_direction.y < 0.f, inv_direction.z < 0.f},
+		tmin(t0),
+		tmax(t1)
+	{}
+
+	glm::vec3 origin;
+	glm::vec3 direction;
+
+	//! Reciprocal of the direction
+	glm::vec3 inv_direction;
+
+	//! True for negative direction components
+	bool sign[3];
+
+	float tmin;
+	float tmax;
+};
+
 /**
 	Contains minimal information about ray-object intersection. This infomation
 	can later be used to generate ray_hit structure containing all infotmation
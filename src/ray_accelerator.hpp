@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ray.hpp"
+#include "ray_packet.hpp"
 
 namespace rt {
 
@@ -10,7 +11,31 @@ namespace rt {
 class ray_accelerator
 {
 public:
+	virtual ~ray_accelerator() = default;
+
 	virtual bool cast_ray(const rt::ray &r, ray_hit &hit) const = 0;
+
+	/**
+		Checks whether anything is hit closer than tmax. Any hit will do,
+		so accelerators may stop at the first one they find.
+	*/
+	virtual bool occluded(const rt::ray &r, float tmax) const
+	{
+		ray_hit hit;
+		return cast_ray(r, hit) && hit.distance < tmax;
+	}
+
+	/**
+		Finds the closest hits of all rays in the packet. Missed rays get
+		ray_miss distance. Accelerators which can't exploit the coherence
+		simply trace the rays one by one.
+	*/
+	virtual void cast_packet(const ray_packet &packet, ray_hit *hits) const
+	{
+		for (int i = 0; i < packet.size; i++)
+			if (!cast_ray(packet.rays[i], hits[i]))
+				hits[i].distance = rt::ray_miss;
+	}
 };
 
 }
\ No newline at end of file
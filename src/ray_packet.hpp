@@ -0,0 +1,30 @@
+#pragma once
+
+#include "ray.hpp"
+
+namespace rt {
+
+/**
+	A group of coherent rays (e.g. camera rays of a small image tile)
+	traced together through acceleration structures
+*/
+struct ray_packet
+{
+	//! Maximum number of rays in a packet - enough for 8x8 tiles
+	static constexpr int max_size = 64;
+
+	void add(const ray &r)
+	{
+		rays[size++] = r;
+	}
+
+	bool full() const
+	{
+		return size == max_size;
+	}
+
+	ray rays[max_size];
+	int size = 0;
+};
+
+}
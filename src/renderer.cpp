@@ -1,64 +1,88 @@
 #include "renderer.hpp"
-#include <random>
+#include <chrono>
+#include <cmath>
+#include <climits>
 #include <iostream>
 
 using rt::renderer;
 
+namespace {
+
+float luminance(const glm::vec3 &c)
+{
+	return glm::dot(c, glm::vec3{0.2126f, 0.7152f, 0.0722f});
+}
+
+}
+
 renderer::renderer(
 		const scene &sc,
 		int width,
 		int	height,
 		unsigned long seed,
-		int num_threads) :
+		int num_threads,
+		rt::integrator integrator,
+		rt::sampler_type sampler) :
 	m_scene(&sc),
 	m_active_flag(std::make_unique<std::atomic<bool>>(false)),
 	m_thread_count(num_threads),
+	m_framebuffer(width, height),
+	m_variance(width, height),
 	m_image(width, height)
 {
-	// Random generator used only for initialization
-	// of path tracers' generators
-	std::mt19937 init_rnd(seed);
+	// All tracers share the sampler, so a pixel's samples come from one sequence
+	// no matter which thread takes them
+	auto pixel_sampler = rt::make_sampler(sampler, seed);
 
-	// Initialize output images
-	m_images.reserve(m_thread_count);
-	for (int i = 0; i < m_thread_count; i++)
-	{
-		m_images.emplace_back(width, height);
-	}
+	// The scheduler thread samples tiles too, so the pool has one thread less
+	m_pool = std::make_unique<thread_pool>(std::max(m_thread_count - 1, 1));
 
 	// Initialize all path tracers
-	m_tracers.reserve(m_thread_count);
-	for (int i = 0; i < m_thread_count; i++)
+	int tracer_count = m_pool->get_thread_count() + 1;
+	m_tracers.reserve(tracer_count);
+	for (int i = 0; i < tracer_count; i++)
 	{
 		m_tracers.emplace_back(
 			*m_scene,
-			m_images[i],
-			init_rnd());
+			m_framebuffer,
+			pixel_sampler,
+			integrator);
+	}
+
+	// Split the image into tiles
+	for (int y = 0; y < height; y += path_tracer::tile_size)
+		for (int x = 0; x < width; x += path_tracer::tile_size)
+			m_tiles.push_back({{x, y}, glm::min(glm::ivec2{x + path_tracer::tile_size, y + path_tracer::tile_size}, glm::ivec2{width, height})});
+
+	m_tile_samples = std::make_unique<std::atomic<int>[]>(m_tiles.size());
+	m_tile_error = std::make_unique<std::atomic<float>[]>(m_tiles.size());
+	m_tile_locks = std::make_unique<std::mutex[]>(m_tiles.size());
+	m_tile_clears = std::make_unique<std::uint32_t[]>(m_tiles.size());
+	m_tile_busy = std::make_unique<std::atomic<bool>[]>(m_tiles.size());
+	for (std::size_t i = 0; i < m_tiles.size(); i++)
+	{
+		m_tile_clears[i] = 0;
+		m_tile_busy[i] = false;
 	}
+	clear();
 }
 
 void renderer::start()
 {
-	if (!m_threads.empty())
+	if (m_scheduler.joinable())
 		throw std::runtime_error("rt::renderer already running...");
 
 	*m_active_flag = true;
-
-	// Spawn threads
-	for (int i = 0; i < m_thread_count; i++)
-		m_threads.emplace_back(renderer::render_thread, std::ref(m_tracers[i]), std::ref(*m_active_flag));
+	m_scheduler = std::thread(&renderer::render_tiles, this);
 }
 
 void renderer::stop()
 {
 	*m_active_flag = false;
 
-	// Wait for every thread to join
-	for (auto &t : m_threads)
-		t.join();
-
-	// Remove all threads
-	m_threads.clear();
+	// Wait for the tiles being sampled
+	if (m_scheduler.joinable())
+		m_scheduler.join();
 }
 
 /**
@@ -71,31 +95,229 @@ void renderer::terminate()
 }
 
 /**
-	Clears buffers in all path tracers and HDR and raw data buffers
+	Clears the framebuffer, tiles' statistics and the resulting image. Tiles
+	being sampled at the time are not committed.
 */
 void renderer::clear()
 {
-	for (auto &t : m_tracers)
-		t.clear_image();
+	for (std::size_t i = 0; i < m_tiles.size(); i++)
+	{
+		const render_tile &tile = m_tiles[i];
+		std::lock_guard<std::mutex> lock{m_tile_locks[i]};
+		for (int y = tile.min.y; y < tile.max.y; y++)
+		{
+			for (int x = tile.min.x; x < tile.max.x; x++)
+			{
+				m_framebuffer.pixel(x, y) = glm::vec3{0.f};
+				m_variance.pixel(x, y) = 0.f;
+			}
+		}
+
+		m_tile_samples[i] = 0;
+		m_tile_error[i] = HUGE_VALF;
+		m_tile_clears[i]++;
+	}
 	m_image.clear();
 }
 
-void renderer::render_thread(path_tracer &ctx, const std::atomic<bool> &active)
+void renderer::set_noise_threshold(float threshold, int min_samples)
+{
+	m_noise_threshold = threshold;
+	m_min_samples = std::max(min_samples, 2);
+}
+
+/**
+	Keeps tile tasks in the pool until the renderer is stopped. When all
+	tiles converge, the tasks end and the thread waits for the tiles to
+	be cleared.
+*/
+void renderer::render_tiles()
+{
+	m_round_start = std::chrono::high_resolution_clock::now();
+	while (*m_active_flag)
+	{
+		bool converged = true;
+		for (std::size_t i = 0; i < m_tiles.size() && converged; i++)
+			converged = is_tile_converged(i);
+
+		m_converged = converged;
+		if (m_converged)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds{10});
+			continue;
+		}
+
+		// Each task submits the next one when it's done, so the pool never runs dry
+		thread_pool::task_group group{*m_pool};
+		for (std::size_t i = 0; i < m_tracers.size() * tasks_per_thread; i++)
+			group.run([this, &group]{ run_tile_task(group); });
+		group.wait();
+	}
+}
+
+/**
+	Samples the next tile and submits the following task. The task chain
+	ends when the renderer is stopped or no tile needs sampling.
+*/
+void renderer::run_tile_task(thread_pool::task_group &group)
+{
+	std::size_t index;
+	if (!*m_active_flag || !claim_tile(index))
+		return;
+
+	sample_tile(index);
+	m_tile_busy[index] = false;
+	group.run([this, &group]{ run_tile_task(group); });
+}
+
+/**
+	Picks the next tile in round-robin order which is neither converged nor
+	sampled by another thread. Start of each round updates the pass time.
+
+	\returns false if there's no such tile
+*/
+bool renderer::claim_tile(std::size_t &index)
+{
+	for (std::size_t attempt = 0; attempt < m_tiles.size(); attempt++)
+	{
+		std::size_t n = m_next_tile++;
+		index = n % m_tiles.size();
+
+		// Exactly one thread gets the first tile of each round
+		if (index == 0 && n != 0)
+		{
+			auto now = std::chrono::high_resolution_clock::now();
+			std::chrono::duration<double> t_round = now - m_round_start.load();
+			m_last_pass_time = t_round.count();
+			m_round_start = now;
+			m_pass_count++;
+		}
+
+		if (is_tile_converged(index) || m_tile_busy[index].exchange(true))
+			continue;
+
+		return true;
+	}
+
+	return false;
+}
+
+/**
+	Samples a tile and adds the samples to the framebuffer. Variance of
+	pixel luminance is updated with Welford's algorithm - the running mean
+	is known from the sum of samples.
+
+	The tile's pixels are copied and updated outside of the lock, so the
+	result is published with its sample count at once. If the tile has been
+	cleared in the meantime, the samples are dropped.
+*/
+void renderer::sample_tile(std::size_t index)
 {
-	while (active)
-		ctx.sample_image(40, 4.f, &active);
+	// Threads outside of the pool can only be the scheduler
+	int thread = m_pool->get_thread_index();
+	path_tracer &tracer = m_tracers[thread >= 0 ? thread : m_tracers.size() - 1];
+
+	const render_tile &tile = m_tiles[index];
+	glm::ivec2 size = tile.max - tile.min;
+	std::vector<glm::vec3> sums(size.x * size.y);
+	std::vector<float> m2(size.x * size.y);
+	int n;
+	std::uint32_t clears;
+	{
+		std::lock_guard<std::mutex> lock{m_tile_locks[index]};
+		n = m_tile_samples[index];
+		clears = m_tile_clears[index];
+
+		int i = 0;
+		for (int y = tile.min.y; y < tile.max.y; y++)
+		{
+			for (int x = tile.min.x; x < tile.max.x; x++, i++)
+			{
+				sums[i] = m_framebuffer.pixel(x, y);
+				m2[i] = m_variance.pixel(x, y);
+			}
+		}
+	}
+
+	std::vector<glm::vec3> samples;
+	tracer.sample_tile(tile.min, tile.max, n, samples, 40, 4.f);
+
+	float error = 0.f;
+	for (std::size_t i = 0; i < samples.size(); i++)
+	{
+		float value = luminance(samples[i]);
+		float mean = n ? luminance(sums[i]) / n : 0.f;
+		float new_mean = (luminance(sums[i]) + value) / (n + 1);
+		m2[i] += (value - mean) * (value - new_mean);
+		sums[i] += samples[i];
+
+		error = std::max(error, get_pixel_error(sums[i], m2[i], n + 1));
+	}
+
+	std::lock_guard<std::mutex> lock{m_tile_locks[index]};
+	if (m_tile_clears[index] != clears)
+		return;
+
+	int i = 0;
+	for (int y = tile.min.y; y < tile.max.y; y++)
+	{
+		for (int x = tile.min.x; x < tile.max.x; x++, i++)
+		{
+			m_framebuffer.pixel(x, y) = sums[i];
+			m_variance.pixel(x, y) = m2[i];
+		}
+	}
+
+	m_tile_error[index] = error;
+	m_tile_samples[index] = n + 1;
+}
+
+bool renderer::is_tile_converged(std::size_t index) const
+{
+	return m_noise_threshold > 0.f
+		&& m_tile_samples[index] >= m_min_samples
+		&& m_tile_error[index] <= m_noise_threshold;
 }
 
 /**
+	Returns relative standard error of the pixel's mean luminance, given its
+	sum of samples and M2
+*/
+float renderer::get_pixel_error(const glm::vec3 &sum, float m2, int samples) const
+{
+	if (samples < 2) return HUGE_VALF;
+
+	float variance = std::max(m2, 0.f) / (samples - 1);
+	float mean = luminance(sum) / samples;
+	return std::sqrt(variance / samples) / (mean + error_luminance_bias);
+}
+
+/**
+	Tiles can be sampled different number of times when this is called.
+	Their pixels are averaged and scaled to the lowest number of samples,
+	which is reported as the image's sample count.
+
 	\todo Move tonemapping into image class
 */
 void renderer::compute_result()
 {
-	m_image.clear();
+	int samples = m_tiles.empty() ? 0 : INT_MAX;
+	for (std::size_t i = 0; i < m_tiles.size(); i++)
+		samples = std::min<int>(samples, m_tile_samples[i]);
+
+	for (std::size_t i = 0; i < m_tiles.size(); i++)
+	{
+		const render_tile &tile = m_tiles[i];
+		std::lock_guard<std::mutex> lock{m_tile_locks[i]};
+		int tile_samples = m_tile_samples[i];
+		float scale = tile_samples ? static_cast<float>(samples) / tile_samples : 0.f;
+
+		for (int y = tile.min.y; y < tile.max.y; y++)
+			for (int x = tile.min.x; x < tile.max.x; x++)
+				m_image.pixel(x, y) = m_framebuffer.pixel(x, y) * scale;
+	}
 
-	// Compute resulting image
-	for (int i = 0; i < m_thread_count; i++)
-		m_image += m_images[i];
+	m_image.set_sample_count(samples);
 }
 
 const rt::sampled_hdr_image &renderer::get_image() const
@@ -103,14 +325,50 @@ const rt::sampled_hdr_image &renderer::get_image() const
 	return m_image;
 }
 
-std::ostream &rt::operator<<(std::ostream &s, const renderer &r)
+rt::hdr_image renderer::compute_heatmap() const
 {
-	// Print last times per sample
-	s << "s/S :\t";
-	for (auto &t : r.m_tracers)
+	rt::hdr_image heatmap{m_image.get_width(), m_image.get_height()};
+
+	int max_samples = 1;
+	for (std::size_t i = 0; i < m_tiles.size(); i++)
+		max_samples = std::max<int>(max_samples, m_tile_samples[i]);
+
+	// Noise is shown relative to the noisiest pixel when there's no threshold. Errors of tiles
+	// with fewer than 2 samples are infinite - they're told apart by the sample count, because
+	// std::isfinite() is always true with -ffast-math.
+	float error_scale = m_noise_threshold;
+	if (error_scale <= 0.f)
 	{
-		s << t.get_last_sample_time().count() << "\t";
+		for (std::size_t i = 0; i < m_tiles.size(); i++)
+		{
+			std::lock_guard<std::mutex> lock{m_tile_locks[i]};
+			if (m_tile_samples[i] >= 2)
+				error_scale = std::max<float>(error_scale, m_tile_error[i]);
+		}
 	}
 
+	for (std::size_t i = 0; i < m_tiles.size(); i++)
+	{
+		const render_tile &tile = m_tiles[i];
+		std::lock_guard<std::mutex> lock{m_tile_locks[i]};
+		int samples = m_tile_samples[i];
+
+		for (int y = tile.min.y; y < tile.max.y; y++)
+		{
+			for (int x = tile.min.x; x < tile.max.x; x++)
+			{
+				float error = get_pixel_error(m_framebuffer.pixel(x, y), m_variance.pixel(x, y), samples);
+				float red = samples >= 2 && error_scale > 0.f ? std::min(error / error_scale, 1.f) : 1.f;
+				heatmap.pixel(x, y) = glm::vec3{red, 0.f, static_cast<float>(samples) / max_samples};
+			}
+		}
+	}
+
+	return heatmap;
+}
+
+std::ostream &rt::operator<<(std::ostream &s, const renderer &r)
+{
+	s << "s/S :\t" << r.m_last_pass_time.load();
 	return s;
 }
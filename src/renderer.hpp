@@ -1,19 +1,38 @@
 #pragma once
 #include <vector>
 #include <thread>
+#include <mutex>
 #include <memory>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <iosfwd>
 
 #include "path_tracer.hpp"
 #include "camera.hpp"
 #include "scene.hpp"
 #include "ray_accelerator.hpp"
+#include "thread_pool.hpp"
+#include "sampler.hpp"
 
 namespace rt {
 
 /**
-	Renders tonemapped
+	Renders the scene using multiple threads. The image is split into tiles
+	which are handed out to threads of a work-stealing pool, so uneven pixel
+	costs don't leave threads idle. Each finished tile task submits a task for
+	the next tile in round-robin order, so the pool is kept busy without any
+	barrier between passes and all tiles get similar numbers of samples.
+
+	All threads accumulate samples in a single shared framebuffer. A tile is
+	sampled by one thread at a time, into a copy of its pixels, which is then
+	committed together with the tile's sample count under the tile's lock.
+	Sample values come from a sampler shared by all threads, keyed by pixel
+	and the tile's sample count.
+
+	With adaptive sampling enabled, variance of each pixel's luminance is tracked
+	with Welford's algorithm and tiles whose noise is below the threshold are
+	no longer sampled, so samples are spent on the noisy regions only.
 */
 class renderer
 {
@@ -25,7 +44,9 @@ public:
 		int width,
 		int height,
 		unsigned long seed,
-		int num_threads);
+		int num_threads,
+		rt::integrator integrator = rt::integrator::PATH,
+		rt::sampler_type sampler = rt::sampler_type::SOBOL);
 
 	~renderer()
 	{
@@ -38,9 +59,8 @@ public:
 	void start();
 
 	/**
-		Stops path tracing peacefully - waits for
-		all tracers to finish, so the resulting image
-		is evenly sampled.
+		Stops path tracing peacefully - waits for tiles which
+		are being sampled, so no tile is left partially sampled.
 	*/
 	void stop();
 
@@ -50,39 +70,122 @@ public:
 	void terminate();
 
 	/**
-		Clears data accumulated in path tracers
+		Clears the framebuffer and the resulting image
 	*/
 	void clear();
 
 	/**
-		Computes resulting image from data currently stored
-		in the path tracers
+		Computes resulting image from the framebuffer
 	*/
 	void compute_result();
 
 	const rt::sampled_hdr_image &get_image() const;
 
+	/**
+		Enables adaptive sampling. Tiles with at least `min_samples` samples are skipped
+		while the relative standard error of all their pixels is below `threshold`.
+		Zero threshold disables adaptive sampling. Must be called while the renderer
+		is stopped.
+	*/
+	void set_noise_threshold(float threshold, int min_samples = default_min_samples);
+
+	/**
+		Returns true if all tiles are below the noise threshold. The renderer
+		stays idle then, until it's cleared.
+	*/
+	bool is_converged() const
+	{
+		return m_converged;
+	}
+
+	/**
+		Returns number of rounds over all tiles started so far. Each tile which
+		is not converged is sampled in every round, unless it's still being
+		sampled in the previous one. Unlike the image's sample count (which is
+		the lowest one of all tiles), this keeps growing while converged tiles
+		are skipped.
+	*/
+	int get_pass_count() const
+	{
+		return m_pass_count;
+	}
+
+	/**
+		Computes convergence heatmap - red shows pixel noise relative to the threshold
+		(or to the noisiest pixel if there's none) and blue shows the number of samples
+		relative to the most sampled tile
+	*/
+	rt::hdr_image compute_heatmap() const;
+
 private:
+	//! Number of samples after which noise estimates are trusted
+	static constexpr int default_min_samples = 16;
+
+	//! Luminance added to pixel means before computing relative error - noise in dark pixels is hardly visible
+	static constexpr float error_luminance_bias = 0.01f;
+
+	struct render_tile
+	{
+		glm::ivec2 min;
+		glm::ivec2 max;
+	};
+
+	//! Number of tile tasks kept in the pool per thread
+	static constexpr int tasks_per_thread = 2;
+
+	void render_tiles();
+	void run_tile_task(thread_pool::task_group &group);
+	bool claim_tile(std::size_t &index);
+	void sample_tile(std::size_t index);
+	bool is_tile_converged(std::size_t index) const;
+	float get_pixel_error(const glm::vec3 &sum, float m2, int samples) const;
+
 	const scene *m_scene;
 
 	//! Active flag
 	std::unique_ptr<std::atomic<bool>> m_active_flag;
 
-	//! Path tracers
+	int m_thread_count;
+	std::unique_ptr<thread_pool> m_pool;
+
+	//! Thread submitting tile tasks to the pool - it samples tiles as well while it waits
+	std::thread m_scheduler;
+
+	//! Path tracers - one for each thread of the pool and one for the scheduler thread
 	std::vector<rt::path_tracer> m_tracers;
 
-	//! Images from path tracers
-	std::vector<rt::sampled_hdr_image> m_images;
+	//! Sums of samples of all pixels
+	rt::sampled_hdr_image m_framebuffer;
 
-	//! Threads running path tracing
-	std::vector<std::thread> m_threads;
-	int m_thread_count;
+	//! Welford's M2 (sum of squared differences from the mean) of pixel luminance
+	rt::image<float> m_variance;
+
+	//! Tiles of the image, number of samples of each of them and their highest pixel error
+	std::vector<render_tile> m_tiles;
+	std::unique_ptr<std::atomic<int>[]> m_tile_samples;
+	std::unique_ptr<std::atomic<float>[]> m_tile_error;
+
+	//! Locks guarding tiles' pixels in the framebuffer, their sample counts and the number of times they were cleared
+	std::unique_ptr<std::mutex[]> m_tile_locks;
+	std::unique_ptr<std::uint32_t[]> m_tile_clears;
+
+	//! Set while a tile is being sampled
+	std::unique_ptr<std::atomic<bool>[]> m_tile_busy;
+
+	//! Next tile to sample in round-robin order
+	std::atomic<std::size_t> m_next_tile{0};
+
+	float m_noise_threshold = 0.f;
+	int m_min_samples = default_min_samples;
+	std::atomic<bool> m_converged{false};
+
+	//! Time taken by the last round over all tiles in seconds and start of the current round
+	std::atomic<double> m_last_pass_time{0.0};
+	std::atomic<std::chrono::high_resolution_clock::time_point> m_round_start;
+	std::atomic<int> m_pass_count{0};
 
 	//! Resulting image
 	rt::sampled_hdr_image m_image;
-
-	//! Ran by each rendering thread
-	static void render_thread(path_tracer &ctx, const std::atomic<bool> &active);
 };
 
 extern std::ostream &operator<<(std::ostream &, const renderer &);
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <iomanip>
 #include <thread>
+#include <atomic>
 #include <mutex>
 #include <chrono>
 #include <future>
@@ -25,6 +26,7 @@
 #include "mesh_data.hpp"
 #include "aabb.hpp"
 #include "bvh_tree.hpp"
+#include "bvh_cache.hpp"
 #include "blender_jsd_loader.hpp"
 
 #include "materials/pbr_material.hpp"
@@ -57,13 +59,31 @@ int main(int argc, char **argv)
 	// Initial camera setup
 	rt::camera &cam = scene.get_camera();
 
-	// Build BVH
-	std::cerr << "building BVH..." << std::endl;
-	auto t_bvh_start = std::chrono::high_resolution_clock::now();
-	scene.init_accelerator<rt::bvh_tree>();
-	auto t_bvh_end = std::chrono::high_resolution_clock::now();
-	std::chrono::duration<double> t_bvh = t_bvh_end - t_bvh_start;
-	std::cerr << "done - took " << t_bvh.count() << "s" << std::endl;
+	// Start rendering on a quickly built tree
+	std::cerr << "building preview BVH..." << std::endl;
+	auto t_preview_start = std::chrono::high_resolution_clock::now();
+	rt::bvh_build_params preview_params;
+	preview_params.method = rt::bvh_build_method::LBVH;
+	scene.init_accelerator<rt::bvh_tree>(preview_params);
+	std::chrono::duration<double> t_preview = std::chrono::high_resolution_clock::now() - t_preview_start;
+	std::cerr << "done - took " << t_preview.count() << "s" << std::endl;
+
+	// Build the SAH tree or load it from the cache in the background
+	rt::bvh_cache bvh_cache{"bvh_cache"};
+	auto bvh_future = std::async(std::launch::async, [&bvh_cache, &scene]()
+	{
+		auto t_bvh_start = std::chrono::high_resolution_clock::now();
+		auto bvh = bvh_cache.get_tree(scene);
+		auto bvh_stats = bvh->get_build_stats();
+		std::chrono::duration<double> t_bvh = std::chrono::high_resolution_clock::now() - t_bvh_start;
+		std::cerr << "BVH ready - took " << t_bvh.count() << "s (";
+		if (bvh->is_mapped())
+			std::cerr << "loaded from cache";
+		else
+			std::cerr << "tree build " << bvh_stats.build_time.count() << "s on " << bvh_stats.threads << " threads";
+		std::cerr << ", SAH cost " << bvh->get_sah_cost() << ")" << std::endl;
+		return bvh;
+	});
 
 	// Open a SFML window
 	sf::RenderWindow window(sf::VideoMode(window_size.x, window_size.y), "rt");
@@ -80,11 +100,45 @@ int main(int argc, char **argv)
 	// The renderer
 	const int render_threads = 6;
 	rt::renderer ren(scene, render_size.x, render_size.y, rnd(), render_threads);
+
+	// Tiles stop being sampled once their noise falls below this (0 disables adaptive sampling)
+	const float noise_threshold = 0.01f;
+	ren.set_noise_threshold(noise_threshold);
 	ren.start();
 
+	// With --optimize-bvh, subtrees of the SAH tree visited by more rays than SAH expects are rebuilt
+	// in the background. The tree is profiled while it's rendered with, then its copy is optimized
+	// and swapped in. Profiling slows traversal down, so it's off by default.
+	const bool optimize_bvh = std::find(argv + 1, argv + argc, std::string{"--optimize-bvh"}) != argv + argc;
+	std::atomic<bool> optimize_cancel{false};
+	std::future<std::shared_ptr<rt::bvh_tree>> optimize_future;
+	auto optimize_for_rays = [&ren, &optimize_cancel](std::shared_ptr<rt::bvh_tree> tree)
+	{
+		return std::async(std::launch::async, [&ren, &optimize_cancel, tree]() -> std::shared_ptr<rt::bvh_tree>
+		{
+			// The image's sample count stops growing once any tile converges, so whole rounds over
+			// the tiles are counted instead - the second one is entirely rendered with the tree
+			int passes = ren.get_pass_count();
+			while (ren.get_pass_count() < passes + 2 && !ren.is_converged())
+			{
+				if (optimize_cancel) return nullptr;
+				std::this_thread::sleep_for(10ms);
+			}
+
+			// The copy is swapped in even if it's unchanged - it doesn't count node visits anymore.
+			// rt_bench reports the traversal cost before and after the optimization.
+			auto optimized = std::make_shared<rt::bvh_tree>(*tree);
+			bool changed = optimized->optimize_for_rays();
+			std::cerr << "BVH " << (changed ? "optimized" : "unchanged") << " for the rays" << std::endl;
+
+			return optimized;
+		});
+	};
+
 	// Start time and sample count
 	auto t_start = std::chrono::high_resolution_clock::now();
 	int samples = 0, last_samples = 0;
+	bool converged = false;
 
 	// Changes with mouse drags
 	glm::vec2 drag_pos{rt::pi<> * 0.5f, 0.f}, drag_start{0.f};
@@ -166,6 +220,17 @@ int main(int argc, char **argv)
 						spr.getTexture()->copyToImage().saveToFile(ss.str());
 						std::cerr << "saved '" << ss.str() << "'..." << std::endl;
 					}
+
+					if (ev.key.code == sf::Keyboard::H)
+					{
+						std::stringstream ss;
+						ss << std::time(nullptr) << "-heatmap.png";
+						rt::image<rt::rgba_pixel> heatmap{ren.compute_heatmap()};
+						sf::Image out;
+						out.create(heatmap.get_width(), heatmap.get_height(), reinterpret_cast<const std::uint8_t*>(heatmap.get_data().data()));
+						out.saveToFile(ss.str());
+						std::cerr << "saved '" << ss.str() << "'..." << std::endl;
+					}
 					
 					if (ev.key.code == sf::Keyboard::P && is_running)
 					{
@@ -207,6 +272,23 @@ int main(int argc, char **argv)
 			}			
 		}
 
+		// Swap in the SAH tree once it's ready - tracers pick it up at the start of their next tile.
+		// Profiling has to start before any ray is cast on the tree.
+		if (bvh_future.valid() && bvh_future.wait_for(0s) == std::future_status::ready)
+		{
+			std::shared_ptr<rt::bvh_tree> bvh = bvh_future.get();
+			if (optimize_bvh) bvh->begin_ray_profile();
+			scene.set_accelerator(bvh);
+			if (optimize_bvh) optimize_future = optimize_for_rays(std::move(bvh));
+		}
+
+		// Swap in the optimized tree - the profiled one is released when the last tile using it is done
+		if (optimize_future.valid() && optimize_future.wait_for(0s) == std::future_status::ready)
+		{
+			if (auto bvh = optimize_future.get())
+				scene.set_accelerator(std::move(bvh));
+		}
+
 		// Move the camera
 		if (glm::length(camera_velocity) > 0.0001f) ren.clear();
 		cam.set_position(cam.get_position() + cam.get_matrix() * camera_velocity * dt);
@@ -255,6 +337,10 @@ int main(int argc, char **argv)
 				<< "s, per sample/th = " << std::setw(8) << std::fixed << t_total.count() / samples * render_threads << std::endl;
 			std::cout << ren << std::endl;
 		}
+
+		if (ren.is_converged() && !converged)
+			std::cout << "all tiles below noise threshold " << noise_threshold << " - " << samples << " samples" << std::endl;
+		converged = ren.is_converged();
 		
 		// Draw
 		tex.update(reinterpret_cast<const std::uint8_t*>(img.get_data().data()));
@@ -264,6 +350,8 @@ int main(int argc, char **argv)
 		window.display();
 	}
 
+	optimize_cancel = true;
+	if (optimize_future.valid()) optimize_future.wait();
 	ren.stop();
 	return EXIT_SUCCESS;	
 }
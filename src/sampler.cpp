@@ -0,0 +1,222 @@
+#include "sampler.hpp"
+#include <array>
+#include <stdexcept>
+
+using rt::sampler;
+using rt::independent_sampler;
+using rt::stratified_sampler;
+using rt::sobol_sampler;
+using rt::pmj02_sampler;
+
+namespace {
+
+/**
+	Integer hash with low bias (lowbias32 by Chris Wellons)
+*/
+std::uint32_t hash(std::uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+std::uint32_t hash_combine(std::uint32_t seed, std::uint32_t v)
+{
+	return hash(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+/**
+	Converts highest 24 bits to a float in [0, 1)
+*/
+float to_float(std::uint32_t x)
+{
+	return (x >> 8) * 0x1p-24f;
+}
+
+std::uint32_t reverse_bits(std::uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+/**
+	Random permutation of [0, l) - Kensler, "Correlated Multi-Jittered Sampling"
+*/
+std::uint32_t permute(std::uint32_t i, std::uint32_t l, std::uint32_t p)
+{
+	std::uint32_t w = l - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+
+	// Values outside of the range are permuted again (cycle walking)
+	do
+	{
+		i ^= p;
+		i *= 0xe170893du;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;
+		i *= 0x0929eb3fu;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | p >> 27;
+		i *= 0x6935fa69u;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303u;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3u;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3dfu;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= l);
+
+	return (i + p) % l;
+}
+
+/**
+	Hash-based equivalent of a random permutation of bit-reversed
+	numbers - each bit is flipped depending on the lower bits only
+*/
+std::uint32_t laine_karras_permutation(std::uint32_t x, std::uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+/**
+	Owen scrambling - each bit is flipped depending on the higher bits
+*/
+std::uint32_t nested_uniform_scramble(std::uint32_t x, std::uint32_t seed)
+{
+	return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+/**
+	Generator matrices of the first 4 Sobol dimensions, computed from
+	primitive polynomials and direction numbers of Joe and Kuo
+*/
+using sobol_matrix = std::array<std::uint32_t, 32>;
+std::array<sobol_matrix, 4> make_sobol_matrices()
+{
+	struct direction_numbers
+	{
+		std::uint32_t s;
+		std::uint32_t a;
+		std::uint32_t m[3];
+	};
+
+	const direction_numbers dims[3] = {
+		{1, 0, {1}},
+		{2, 1, {1, 3}},
+		{3, 1, {1, 3, 1}},
+	};
+
+	std::array<sobol_matrix, 4> matrices;
+	for (std::uint32_t k = 0; k < 32; k++)
+		matrices[0][k] = 1u << (31 - k);
+
+	for (int d = 0; d < 3; d++)
+	{
+		const direction_numbers &dn = dims[d];
+		sobol_matrix &v = matrices[d + 1];
+
+		for (std::uint32_t k = 0; k < 32; k++)
+		{
+			if (k < dn.s)
+			{
+				v[k] = dn.m[k] << (31 - k);
+				continue;
+			}
+
+			v[k] = v[k - dn.s] ^ (v[k - dn.s] >> dn.s);
+			for (std::uint32_t j = 1; j < dn.s; j++)
+				if ((dn.a >> (dn.s - 1 - j)) & 1)
+					v[k] ^= v[k - j];
+		}
+	}
+
+	return matrices;
+}
+
+std::uint32_t sobol(std::uint32_t index, int dimension)
+{
+	static const std::array<sobol_matrix, 4> matrices = make_sobol_matrices();
+
+	std::uint32_t x = 0;
+	for (int k = 0; index; index >>= 1, k++)
+		if (index & 1)
+			x ^= matrices[dimension][k];
+	return x;
+}
+
+/**
+	Returns a dimension of an Owen-scrambled Sobol point. Sample order is
+	shuffled by scrambling the index, which keeps power-of-two prefixes of
+	the sequence stratified.
+*/
+float scrambled_sobol(std::uint32_t index, int dimension, std::uint32_t seed)
+{
+	std::uint32_t shuffled = nested_uniform_scramble(index, seed);
+	return to_float(nested_uniform_scramble(sobol(shuffled, dimension), hash_combine(seed, dimension)));
+}
+
+}
+
+float independent_sampler::get(std::uint32_t pixel, std::uint32_t index, std::uint32_t dimension) const
+{
+	return to_float(hash_combine(hash_combine(hash_combine(m_seed, pixel), index), dimension));
+}
+
+float stratified_sampler::get(std::uint32_t pixel, std::uint32_t index, std::uint32_t dimension) const
+{
+	std::uint32_t seed = hash_combine(hash_combine(m_seed, pixel), dimension);
+	std::uint32_t stratum = permute(index % strata_count, strata_count, hash_combine(seed, index / strata_count));
+	float jitter = to_float(hash_combine(seed ^ 0x5bd1e995u, index));
+	return (stratum + jitter) / strata_count;
+}
+
+float sobol_sampler::get(std::uint32_t pixel, std::uint32_t index, std::uint32_t dimension) const
+{
+	std::uint32_t seed = hash_combine(hash_combine(m_seed, pixel), dimension / 4);
+	return scrambled_sobol(index, dimension % 4, seed);
+}
+
+float pmj02_sampler::get(std::uint32_t pixel, std::uint32_t index, std::uint32_t dimension) const
+{
+	std::uint32_t seed = hash_combine(hash_combine(m_seed, pixel), dimension / 2);
+	return scrambled_sobol(index, dimension % 2, seed);
+}
+
+std::shared_ptr<const sampler> rt::make_sampler(sampler_type type, std::uint32_t seed)
+{
+	switch (type)
+	{
+		case sampler_type::INDEPENDENT:
+			return std::make_shared<independent_sampler>(seed);
+
+		case sampler_type::STRATIFIED:
+			return std::make_shared<stratified_sampler>(seed);
+
+		case sampler_type::SOBOL:
+			return std::make_shared<sobol_sampler>(seed);
+
+		case sampler_type::PMJ02:
+			return std::make_shared<pmj02_sampler>(seed);
+	}
+
+	throw std::runtime_error("unknown sampler type");
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <memory>
+#include <cstdint>
+
+namespace rt {
+
+/**
+	Dimensions of a pixel sample consumed by the camera ray
+*/
+enum class camera_dimension : std::uint32_t
+{
+	PIXEL_X,	//!< Anti-aliasing offset within the pixel
+	PIXEL_Y
+};
+
+//! Number of dimensions consumed by the camera ray
+constexpr std::uint32_t camera_dimension_count = 2;
+
+/**
+	Dimensions of a pixel sample consumed at each path vertex. Values
+	used together (direction) are kept in aligned pairs.
+*/
+enum class bounce_dimension : std::uint32_t
+{
+	DIRECTION_U,	//!< Sampled direction (microfacet normal or diffuse direction)
+	DIRECTION_V,
+	LOBE,			//!< Choice between specular and the other lobes
+	TRANSMISSION,	//!< Choice between transmission and diffuse lobe
+	ROULETTE		//!< Russian roulette
+};
+
+//! Number of dimensions reserved for each path vertex - even, so that pairs stay aligned
+constexpr std::uint32_t bounce_dimension_count = 6;
+
+/**
+	Returns index of a dimension of the path vertex at given depth
+*/
+inline std::uint32_t get_sample_dimension(int depth, bounce_dimension dimension)
+{
+	return camera_dimension_count + depth * bounce_dimension_count + static_cast<std::uint32_t>(dimension);
+}
+
+/**
+	Returns index of a camera ray dimension
+*/
+inline std::uint32_t get_sample_dimension(camera_dimension dimension)
+{
+	return static_cast<std::uint32_t>(dimension);
+}
+
+/**
+	Sample generators available to the renderer
+*/
+enum class sampler_type
+{
+	INDEPENDENT,	//!< Uncorrelated random numbers
+	STRATIFIED,		//!< Each dimension jittered in strata, strata visited in shuffled order
+	SOBOL,			//!< Owen-scrambled Sobol sequence, padded in groups of 4 dimensions
+	PMJ02			//!< Progressive multi-jittered (0,2) sequences in pairs of dimensions
+};
+
+/**
+	Generates sample values in [0, 1). A value is keyed by the pixel, index
+	of the pixel's sample and dimension, so it doesn't depend on the thread,
+	tile or order in which paths are traced. Samplers have no mutable state
+	and can be shared by all path tracers.
+
+	Each path consumes fixed dimensions (see `camera_dimension` and
+	`bounce_dimension`), so low-discrepancy samplers can stratify e.g. the
+	anti-aliasing offsets or the lobe choice at the first vertex across
+	samples of a pixel. Sequences are progressive - any number of samples
+	can be taken.
+*/
+class sampler
+{
+public:
+	explicit sampler(std::uint32_t seed) :
+		m_seed(seed)
+	{}
+
+	sampler(const sampler &) = default;
+	sampler(sampler &&) = default;
+
+	sampler &operator=(const sampler &) = default;
+	sampler &operator=(sampler &&) = default;
+
+	virtual ~sampler() = default;
+
+	/**
+		Returns value of the dimension of the pixel's sample with given index
+	*/
+	virtual float get(std::uint32_t pixel, std::uint32_t index, std::uint32_t dimension) const = 0;
+
+protected:
+	std::uint32_t m_seed;
+};
+
+/**
+	Hashes the key - values are not correlated in any way.
+*/
+class independent_sampler : public sampler
+{
+public:
+	using sampler::sampler;
+	float get(std::uint32_t pixel, std::uint32_t index, std::uint32_t dimension) const override;
+};
+
+/**
+	Splits each dimension into `strata_count` strata. Each run of `strata_count`
+	samples of a pixel visits all strata in a random order, with a random offset
+	within each stratum. Dimensions are stratified independently of each other.
+*/
+class stratified_sampler : public sampler
+{
+public:
+	static constexpr std::uint32_t strata_count = 16;
+
+	using sampler::sampler;
+	float get(std::uint32_t pixel, std::uint32_t index, std::uint32_t dimension) const override;
+};
+
+/**
+	Owen-scrambled Sobol sequence with hash-based scrambling (Burley, "Practical
+	Hash-based Owen Scrambling"). Only the first 4 Sobol dimensions are used -
+	following dimensions repeat them in groups of 4, each group with its own
+	scrambling and shuffled sample order, so the groups aren't correlated.
+*/
+class sobol_sampler : public sampler
+{
+public:
+	using sampler::sampler;
+	float get(std::uint32_t pixel, std::uint32_t index, std::uint32_t dimension) const override;
+};
+
+/**
+	Progressive multi-jittered (0,2) sequences (Christensen et al., "Progressive
+	Multi-Jittered Sample Sequences") - each pair of dimensions is a (0,2)-sequence,
+	so every power-of-two prefix of a pixel's samples is stratified in all elementary
+	intervals of the pair. The points are taken from the first two dimensions of an
+	Owen-scrambled Sobol sequence, which are a (0,2)-sequence, so no tables are
+	needed. Each pair has its own scrambling and shuffled sample order.
+*/
+class pmj02_sampler : public sampler
+{
+public:
+	using sampler::sampler;
+	float get(std::uint32_t pixel, std::uint32_t index, std::uint32_t dimension) const override;
+};
+
+/**
+	Creates sampler of given type
+*/
+std::shared_ptr<const sampler> make_sampler(sampler_type type, std::uint32_t seed);
+
+}
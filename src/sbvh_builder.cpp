@@ -0,0 +1,466 @@
+#include "sbvh_builder.hpp"
+
+#include <stack>
+#include <tuple>
+#include <chrono>
+#include <algorithm>
+
+using rt::sbvh_builder;
+
+namespace {
+
+/**
+	Box accumulated during binning
+*/
+struct sbvh_bin
+{
+	glm::vec3 min{HUGE_VALF};
+	glm::vec3 max{-HUGE_VALF};
+
+	//! Number of references (object splits) or references starting in the bin (spatial splits)
+	long count = 0;
+
+	//! Number of references ending in the bin (spatial splits)
+	long exits = 0;
+
+	void grow(const glm::vec3 &bmin, const glm::vec3 &bmax)
+	{
+		min = glm::min(min, bmin);
+		max = glm::max(max, bmax);
+	}
+
+	float get_surface_area() const
+	{
+		if (min.x > max.x) return 0.f;
+		glm::vec3 d = max - min;
+		return 2.f * (d.x * d.y + d.x * d.z + d.y * d.z);
+	}
+};
+
+}
+
+void sbvh_builder::build(const std::vector<triangle> &triangles)
+{
+	m_nodes.clear();
+	m_references.clear();
+	m_depth = 0;
+	m_stats = bvh_build_stats{};
+	if (triangles.empty()) return;
+
+	auto t_start = std::chrono::high_resolution_clock::now();
+	m_work_ns = 0;
+	m_triangles = &triangles;
+	m_split_budget = static_cast<long>(triangles.size() * m_params.max_duplication);
+
+	// Initial references cover entire triangles
+	auto root = std::make_unique<build_node>();
+	root->refs.resize(triangles.size());
+	glm::vec3 min{HUGE_VALF}, max{-HUGE_VALF};
+	for (std::uint32_t i = 0; i < triangles.size(); i++)
+	{
+		aabb box{triangles[i].get_aabb()};
+		root->refs[i] = {box.get_min(), box.get_max(), i};
+		min = glm::min(min, box.get_min());
+		max = glm::max(max, box.get_max());
+	}
+	root->bounding_volume = aabb{min, max};
+	m_root_area = root->bounding_volume.get_surface_area();
+
+	thread_pool pool{m_params.threads};
+	{
+		thread_pool::task_group group{pool};
+		group.run([&]{ build_subtree(root.get(), group); });
+		group.wait();
+	}
+
+	auto t_flatten_start = std::chrono::high_resolution_clock::now();
+	flatten_tree(root.get());
+	root.reset();
+
+	auto t_end = std::chrono::high_resolution_clock::now();
+	m_stats.threads = pool.get_thread_count();
+	m_stats.build_time = t_end - t_start;
+	m_stats.work_time = std::chrono::nanoseconds{m_work_ns} + (t_end - t_flatten_start);
+}
+
+/**
+	Builds subtree starting at given node. Big enough subtrees are
+	passed to other threads in the task group.
+*/
+void sbvh_builder::build_subtree(build_node *root, thread_pool::task_group &group)
+{
+	bvh_work_timer timer{m_work_ns};
+
+	std::stack<build_node*> to_process;
+	to_process.push(root);
+
+	while (!to_process.empty())
+	{
+		auto node = to_process.top();
+		to_process.pop();
+
+		if (!split_node(*node))
+			continue;
+
+		for (auto child : {node->left.get(), node->right.get()})
+		{
+			if (static_cast<long>(child->refs.size()) >= parallel_build_threshold)
+				group.run([this, child, &group]{ build_subtree(child, group); });
+			else
+				to_process.push(child);
+		}
+	}
+}
+
+/**
+	Computes bounding box of the part of the referenced triangle between lo and hi
+	planes along given axis. The result is limited to the reference bounds.
+
+	\returns false if nothing is left after clipping
+*/
+bool sbvh_builder::clip_triangle(const reference &ref, int axis, float lo, float hi, glm::vec3 &min, glm::vec3 &max) const
+{
+	const triangle &t = (*m_triangles)[ref.index];
+	min = glm::vec3{HUGE_VALF};
+	max = glm::vec3{-HUGE_VALF};
+
+	for (int i = 0; i < 3; i++)
+	{
+		const glm::vec3 &a = t.vertices[i];
+		const glm::vec3 &b = t.vertices[(i + 1) % 3];
+
+		if (a[axis] >= lo && a[axis] <= hi)
+		{
+			min = glm::min(min, a);
+			max = glm::max(max, a);
+		}
+
+		// Points where the edge crosses the planes
+		for (float plane : {lo, hi})
+		{
+			if ((a[axis] < plane) == (b[axis] < plane))
+				continue;
+
+			glm::vec3 p = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+			p[axis] = plane;
+			min = glm::min(min, p);
+			max = glm::max(max, p);
+		}
+	}
+
+	min = glm::max(min, ref.min);
+	max = glm::min(max, ref.max);
+	return min.x <= max.x && min.y <= max.y && min.z <= max.z;
+}
+
+/**
+	Finds the best object or spatial split of the node and creates its children.
+
+	\returns false if the node should remain a leaf
+*/
+bool sbvh_builder::split_node(build_node &node)
+{
+	using sah = bvh_builder<bvh_primitive_ref>;
+
+	std::vector<reference> &refs = node.refs;
+	long np = refs.size();
+	if (np < 2) return false;
+
+	// SAH is undefined for degenerate boxes - such nodes are split at the median if they're too big
+	float Sp = node.bounding_volume.get_surface_area();
+	bool use_sah = Sp > 0.f;
+	glm::vec3 nmin = node.bounding_volume.get_min();
+	glm::vec3 nmax = node.bounding_volume.get_max();
+
+	// Object split - binned by reference centroids
+	glm::vec3 cmin{HUGE_VALF}, cmax{-HUGE_VALF};
+	for (const auto &r : refs)
+	{
+		glm::vec3 c = (r.min + r.max) * 0.5f;
+		cmin = glm::min(cmin, c);
+		cmax = glm::max(cmax, c);
+	}
+
+	float object_cost = HUGE_VALF;
+	int object_axis = -1;
+	int object_bin = 0;
+	sbvh_bin object_left, object_right;
+
+	for (int axis = 0; use_sah && axis < 3; axis++)
+	{
+		float extent = cmax[axis] - cmin[axis];
+		if (extent <= 0.f) continue;
+		float scale = bin_count / extent;
+
+		sbvh_bin bins[bin_count];
+		for (const auto &r : refs)
+		{
+			int b = std::min(static_cast<int>(((r.min[axis] + r.max[axis]) * 0.5f - cmin[axis]) * scale), bin_count - 1);
+			bins[b].grow(r.min, r.max);
+			bins[b].count++;
+		}
+
+		sbvh_bin right[bin_count];
+		for (int i = bin_count - 1; i > 0; i--)
+		{
+			right[i] = i + 1 < bin_count ? right[i + 1] : sbvh_bin{};
+			right[i].grow(bins[i].min, bins[i].max);
+			right[i].count += bins[i].count;
+		}
+
+		sbvh_bin acc;
+		for (int i = 0; i < bin_count - 1; i++)
+		{
+			acc.grow(bins[i].min, bins[i].max);
+			acc.count += bins[i].count;
+			if (acc.count == 0 || right[i + 1].count == 0) continue;
+
+			float c = sah::sah_ct + (acc.get_surface_area() * acc.count + right[i + 1].get_surface_area() * right[i + 1].count) / Sp * sah::sah_ci;
+			if (c < object_cost)
+			{
+				object_cost = c;
+				object_axis = axis;
+				object_bin = i;
+				object_left = acc;
+				object_right = right[i + 1];
+			}
+		}
+	}
+
+	// Spatial splits are only worth trying if children of the object split overlap
+	bool try_spatial = use_sah && node.depth < max_spatial_depth && m_split_budget > 0;
+	if (try_spatial && object_axis >= 0)
+	{
+		sbvh_bin overlap;
+		overlap.min = glm::max(object_left.min, object_right.min);
+		overlap.max = glm::min(object_left.max, object_right.max);
+		bool overlapping = overlap.min.x <= overlap.max.x && overlap.min.y <= overlap.max.y && overlap.min.z <= overlap.max.z;
+		try_spatial = overlapping && overlap.get_surface_area() / m_root_area > overlap_threshold;
+	}
+
+	// Spatial split - bins spread evenly over the node bounds
+	float spatial_cost = HUGE_VALF;
+	int spatial_axis = -1;
+	int spatial_bin = 0;
+	sbvh_bin spatial_left, spatial_right;
+
+	for (int axis = 0; try_spatial && axis < 3; axis++)
+	{
+		float extent = nmax[axis] - nmin[axis];
+		if (extent <= 0.f) continue;
+		float width = extent / bin_count;
+
+		sbvh_bin bins[bin_count];
+		for (const auto &r : refs)
+		{
+			int b0 = std::clamp(static_cast<int>((r.min[axis] - nmin[axis]) / width), 0, bin_count - 1);
+			int b1 = std::clamp(static_cast<int>((r.max[axis] - nmin[axis]) / width), b0, bin_count - 1);
+
+			for (int b = b0; b <= b1; b++)
+			{
+				float lo = nmin[axis] + b * width;
+				float hi = (b == bin_count - 1) ? nmax[axis] : nmin[axis] + (b + 1) * width;
+				glm::vec3 min, max;
+				if (clip_triangle(r, axis, lo, hi, min, max))
+					bins[b].grow(min, max);
+			}
+
+			bins[b0].count++;
+			bins[b1].exits++;
+		}
+
+		sbvh_bin right[bin_count];
+		for (int i = bin_count - 1; i > 0; i--)
+		{
+			right[i] = i + 1 < bin_count ? right[i + 1] : sbvh_bin{};
+			right[i].grow(bins[i].min, bins[i].max);
+			right[i].exits += bins[i].exits;
+		}
+
+		sbvh_bin acc;
+		for (int i = 0; i < bin_count - 1; i++)
+		{
+			acc.grow(bins[i].min, bins[i].max);
+			acc.count += bins[i].count;
+			long nl = acc.count;
+			long nr = right[i + 1].exits;
+			if (nl == 0 || nr == 0) continue;
+
+			float c = sah::sah_ct + (acc.get_surface_area() * nl + right[i + 1].get_surface_area() * nr) / Sp * sah::sah_ci;
+			if (c < spatial_cost)
+			{
+				spatial_cost = c;
+				spatial_axis = axis;
+				spatial_bin = i;
+				spatial_left = acc;
+				spatial_left.count = nl;
+				spatial_right = right[i + 1];
+				spatial_right.count = nr;
+			}
+		}
+	}
+
+	std::vector<reference> left, right;
+
+	// Spatial split - references straddling the plane are either clipped
+	// and duplicated, or moved entirely to one side if that's cheaper
+	if (spatial_axis >= 0 && spatial_cost < object_cost && spatial_cost <= np * sah::sah_ci)
+	{
+		int axis = spatial_axis;
+		float width = (nmax[axis] - nmin[axis]) / bin_count;
+		float plane = nmin[axis] + (spatial_bin + 1) * width;
+		sbvh_bin lbox = spatial_left, rbox = spatial_right;
+
+		for (const auto &r : refs)
+		{
+			int b0 = std::clamp(static_cast<int>((r.min[axis] - nmin[axis]) / width), 0, bin_count - 1);
+			int b1 = std::clamp(static_cast<int>((r.max[axis] - nmin[axis]) / width), b0, bin_count - 1);
+
+			if (b1 <= spatial_bin)
+			{
+				left.push_back(r);
+				continue;
+			}
+
+			if (b0 > spatial_bin)
+			{
+				right.push_back(r);
+				continue;
+			}
+
+			// Reference unsplitting
+			sbvh_bin lgrown = lbox, rgrown = rbox;
+			lgrown.grow(r.min, r.max);
+			rgrown.grow(r.min, r.max);
+			float c_split = lbox.get_surface_area() * lbox.count + rbox.get_surface_area() * rbox.count;
+			float c_left = lgrown.get_surface_area() * lbox.count + rbox.get_surface_area() * (rbox.count - 1);
+			float c_right = lbox.get_surface_area() * (lbox.count - 1) + rgrown.get_surface_area() * rbox.count;
+
+			glm::vec3 lmin, lmax, rmin, rmax;
+			bool split = std::min(c_left, c_right) >= c_split && m_split_budget.fetch_sub(1) > 0;
+			if (split && clip_triangle(r, axis, -HUGE_VALF, plane, lmin, lmax) && clip_triangle(r, axis, plane, HUGE_VALF, rmin, rmax))
+			{
+				left.push_back({lmin, lmax, r.index});
+				right.push_back({rmin, rmax, r.index});
+			}
+			else if (c_left <= c_right)
+			{
+				left.push_back(r);
+				lbox = lgrown;
+				rbox.count--;
+			}
+			else
+			{
+				right.push_back(r);
+				rbox = rgrown;
+				lbox.count--;
+			}
+		}
+
+		// Fall back to other splits if everything ended up on one side
+		if (left.empty() || right.empty())
+		{
+			left.clear();
+			right.clear();
+		}
+		else
+			node.axis = axis;
+	}
+
+	// Object split
+	if (left.empty() && object_axis >= 0 && object_cost <= np * sah::sah_ci)
+	{
+		float scale = bin_count / (cmax[object_axis] - cmin[object_axis]);
+		for (const auto &r : refs)
+		{
+			int b = std::min(static_cast<int>(((r.min[object_axis] + r.max[object_axis]) * 0.5f - cmin[object_axis]) * scale), bin_count - 1);
+			(b <= object_bin ? left : right).push_back(r);
+		}
+		node.axis = object_axis;
+	}
+
+	// Too big leaves are split in half along the longest axis
+	if (left.empty() && np > sah::max_leaf_size)
+	{
+		const glm::vec3 &size = node.bounding_volume.get_size();
+		int axis = (size.x > size.y && size.x > size.z) ? 0 : (size.y > size.z ? 1 : 2);
+		auto mid = refs.begin() + np / 2;
+		std::nth_element(refs.begin(), mid, refs.end(), [axis](const reference &a, const reference &b){
+			return a.min[axis] + a.max[axis] < b.min[axis] + b.max[axis];
+		});
+		left.assign(refs.begin(), mid);
+		right.assign(mid, refs.end());
+		node.axis = axis;
+	}
+
+	if (left.empty())
+		return false;
+
+	// Create children and release references of this node
+	auto make_child = [&node](std::vector<reference> &&child_refs)
+	{
+		glm::vec3 min{HUGE_VALF}, max{-HUGE_VALF};
+		for (const auto &r : child_refs)
+		{
+			min = glm::min(min, r.min);
+			max = glm::max(max, r.max);
+		}
+
+		auto child = std::make_unique<build_node>();
+		child->bounding_volume = aabb{min, max};
+		child->refs = std::move(child_refs);
+		child->depth = node.depth + 1;
+		return child;
+	};
+
+	node.left = make_child(std::move(left));
+	node.right = make_child(std::move(right));
+	std::vector<reference>{}.swap(node.refs);
+	return true;
+}
+
+/**
+	Copies the temporary tree into the flat node array. Nodes are stored in
+	depth-first order with siblings next to each other.
+*/
+void sbvh_builder::flatten_tree(const build_node *root)
+{
+	m_nodes.emplace_back();
+
+	// Build node, its index in the array and depth
+	std::stack<std::tuple<const build_node*, std::uint32_t, int>> to_process;
+	to_process.emplace(root, 0, 1);
+
+	while (!to_process.empty())
+	{
+		auto [node, index, depth] = to_process.top();
+		to_process.pop();
+		m_depth = std::max(m_depth, depth);
+
+		bvh_tree_node &n = m_nodes[index];
+		n.min = node->bounding_volume.get_min();
+		n.max = node->bounding_volume.get_max();
+		n.axis = node->axis;
+		n.padding = 0;
+
+		if (node->left)
+		{
+			std::uint32_t child_index = m_nodes.size();
+			m_nodes.emplace_back();
+			m_nodes.emplace_back();
+			m_nodes[index].offset = child_index;
+			m_nodes[index].count = 0;
+
+			// Left subtree goes first
+			to_process.emplace(node->right.get(), child_index + 1, depth + 1);
+			to_process.emplace(node->left.get(), child_index, depth + 1);
+		}
+		else
+		{
+			n.offset = m_references.size();
+			n.count = node->refs.size();
+			for (const auto &r : node->refs)
+				m_references.push_back(r.index);
+		}
+	}
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+#include "primitive.hpp"
+#include "bvh_builder.hpp"
+
+namespace rt {
+
+/**
+	Builds a binary BVH over triangles using the SBVH algorithm
+	(Stich et al., "Spatial Splits in Bounding Volume Hierarchies").
+
+	Besides regular object splits, nodes can be split by a plane in space.
+	Triangles straddling the plane are then clipped and referenced by both
+	children, which reduces overlap of siblings for big or long and thin triangles.
+
+	Leaves reference ranges of the reference array, which contains indices
+	of the triangles (not reordered). A triangle can be referenced more than once.
+*/
+class sbvh_builder
+{
+public:
+	explicit sbvh_builder(const bvh_build_params &params = {}) :
+		m_params(params)
+	{}
+
+	void build(const std::vector<triangle> &triangles);
+
+	/**
+		Provides access to the built nodes, so they can be moved out
+	*/
+	std::vector<bvh_tree_node> &get_nodes()
+	{
+		return m_nodes;
+	}
+
+	/**
+		Provides access to triangle indices referenced by the leaves
+	*/
+	std::vector<std::uint32_t> &get_references()
+	{
+		return m_references;
+	}
+
+	int get_depth() const
+	{
+		return m_depth;
+	}
+
+	const bvh_build_stats &get_stats() const
+	{
+		return m_stats;
+	}
+
+private:
+	/**
+		Triangle reference - the bounds are clipped by spatial splits
+	*/
+	struct reference
+	{
+		glm::vec3 min;
+		glm::vec3 max;
+		std::uint32_t index;
+	};
+
+	struct build_node
+	{
+		aabb bounding_volume;
+		std::vector<reference> refs;
+		int axis = 0;
+		int depth = 1;
+
+		std::unique_ptr<build_node> left;
+		std::unique_ptr<build_node> right;
+	};
+
+	//! Number of bins used for both object and spatial splits
+	static constexpr int bin_count = 32;
+
+	//! Spatial splits are only considered if siblings' overlap relative to the root exceeds this
+	static constexpr float overlap_threshold = 1e-5f;
+
+	//! Spatial splits are disabled below this depth
+	static constexpr int max_spatial_depth = 48;
+
+	//! Number of references above which a subtree is built as a separate task
+	static constexpr long parallel_build_threshold = 4096;
+
+	void build_subtree(build_node *root, thread_pool::task_group &group);
+	bool split_node(build_node &node);
+	void flatten_tree(const build_node *root);
+
+	bool clip_triangle(const reference &ref, int axis, float lo, float hi, glm::vec3 &min, glm::vec3 &max) const;
+
+	bvh_build_params m_params;
+	bvh_build_stats m_stats;
+	std::atomic<long long> m_work_ns{0};
+
+	const std::vector<triangle> *m_triangles = nullptr;
+	float m_root_area = 0.f;
+
+	//! Number of references that can still be duplicated
+	std::atomic<long> m_split_budget{0};
+
+	std::vector<bvh_tree_node> m_nodes;
+	std::vector<std::uint32_t> m_references;
+	int m_depth = 0;
+};
+
+}
@@ -1,7 +1,29 @@
 #include "scene.hpp"
 
+#include <iterator>
+#include <algorithm>
+
 using rt::scene;
 
+rt::primitive_collection scene::get_transformed_primitives(std::vector<std::uint32_t> *object_offsets) const
+{
+	if (object_offsets)
+		object_offsets->clear();
+
+	rt::primitive_collection primitives;
+	for (const auto &obj_ptr : m_objects)
+	{
+		if (object_offsets)
+			object_offsets->push_back(primitives.triangles.size());
+
+		rt::primitive_collection col{obj_ptr->get_transformed_primitive_collection()};
+		std::copy(col.triangles.begin(), col.triangles.end(), std::back_inserter(primitives.triangles));
+		std::copy(col.spheres.begin(), col.spheres.end(), std::back_inserter(primitives.spheres));
+		std::copy(col.planes.begin(), col.planes.end(), std::back_inserter(primitives.planes));
+	}
+	return primitives;
+}
+
 rt::ray_hit scene::cast_ray(const rt::ray &r, const rt::ray_accelerator &accel) const
 {
 	// Nearest intersection
@@ -13,13 +35,27 @@ rt::ray_hit scene::cast_ray(const rt::ray &r, const rt::ray_accelerator &accel)
 	}
 	else
 	{
-		rt::ray_hit world_hit;
-		world_hit.distance = HUGE_VALF;
-		world_hit.position = {HUGE_VALF, HUGE_VALF, HUGE_VALF};
-		world_hit.direction = r.direction;
-		world_hit.normal = -r.direction;
-		// world_hit.geometry = nullptr;
-		world_hit.material = m_world_material.get();
-		return world_hit;
+		return get_world_hit(r);
 	}
-}
\ No newline at end of file
+}
+
+void scene::cast_packet(const rt::ray_packet &packet, const rt::ray_accelerator &accel, rt::ray_hit *hits) const
+{
+	accel.cast_packet(packet, hits);
+
+	for (int i = 0; i < packet.size; i++)
+		if (hits[i].distance == rt::ray_miss)
+			hits[i] = get_world_hit(packet.rays[i]);
+}
+
+rt::ray_hit scene::get_world_hit(const rt::ray &r) const
+{
+	rt::ray_hit world_hit;
+	world_hit.distance = HUGE_VALF;
+	world_hit.position = {HUGE_VALF, HUGE_VALF, HUGE_VALF};
+	world_hit.direction = r.direction;
+	world_hit.normal = -r.direction;
+	// world_hit.geometry = nullptr;
+	world_hit.material = m_world_material.get();
+	return world_hit;
+}
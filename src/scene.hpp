@@ -1,6 +1,7 @@
 #pragma once
 #include <vector>
 #include <memory>
+#include <cstdint>
 #include "ray.hpp"
 #include "camera.hpp"
 #include "material.hpp"
@@ -79,9 +80,25 @@ public:
 	{
 		return m_objects;
 	}
+
+	const std::vector<std::shared_ptr<rt::abstract_material>> &get_materials() const
+	{
+		return m_materials;
+	}
+
+	/**
+		Gathers primitives of all objects with their transforms applied. If `object_offsets`
+		is given, index of the first triangle of each object is stored there.
+	*/
+	primitive_collection get_transformed_primitives(std::vector<std::uint32_t> *object_offsets = nullptr) const;
 	
 	ray_hit cast_ray(const ray &r, const ray_accelerator &accel) const;
 
+	/**
+		Traces all rays of the packet at once. Rays which miss everything hit the world.
+	*/
+	void cast_packet(const ray_packet &packet, const ray_accelerator &accel, ray_hit *hits) const;
+
 	void set_camera(const std::shared_ptr<rt::camera> &c)
 	{
 		m_camera = c;
@@ -97,30 +114,40 @@ public:
 		return *m_camera;
 	}
 
-	template <typename T>
-	void init_accelerator()
+	template <typename T, typename... Args>
+	void init_accelerator(Args&&... args)
 	{
-		m_accelerator_ptr = std::make_unique<T>(*this);
+		set_accelerator(std::make_unique<T>(*this, std::forward<Args>(args)...));
 	}
 
-	void set_accelerator(std::unique_ptr<rt::ray_accelerator> ptr)
+	/**
+		Replaces the accelerator. This can be done while rendering - path tracers keep
+		the accelerator they started a tile with, and the old one is destroyed
+		when the last tile using it is finished.
+	*/
+	void set_accelerator(std::shared_ptr<const rt::ray_accelerator> ptr)
 	{
-		m_accelerator_ptr = std::move(ptr);
+		std::atomic_store(&m_accelerator_ptr, std::move(ptr));
 	}
 
-	const rt::ray_accelerator &get_accelerator() const
+	/**
+		Returns the current accelerator. The pointer keeps it alive if it's replaced.
+	*/
+	std::shared_ptr<const rt::ray_accelerator> get_accelerator() const
 	{
-		return *m_accelerator_ptr;
+		return std::atomic_load(&m_accelerator_ptr);
 	}
 
 private:
+	ray_hit get_world_hit(const ray &r) const;
+
 	std::vector<std::shared_ptr<rt::scene_object>> m_objects;
 	std::vector<std::shared_ptr<rt::abstract_material>> m_materials;
 
 	std::unique_ptr<abstract_material> m_world_material = std::make_unique<simple_sky_material>();
 
 	std::shared_ptr<rt::camera> m_camera;
-	std::unique_ptr<rt::ray_accelerator> m_accelerator_ptr;
+	std::shared_ptr<const rt::ray_accelerator> m_accelerator_ptr;
 };
 
 }
\ No newline at end of file
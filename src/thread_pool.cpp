@@ -0,0 +1,130 @@
+#include "thread_pool.hpp"
+
+using rt::thread_pool;
+
+/**
+	Identifies the pool and the queue of the current worker thread
+*/
+static thread_local const thread_pool *tl_pool = nullptr;
+static thread_local int tl_queue_index = -1;
+
+thread_pool::thread_pool(int num_threads)
+{
+	if (num_threads <= 0)
+		num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	// One queue per worker and the shared one at the end
+	for (int i = 0; i < num_threads + 1; i++)
+		m_queues.emplace_back(std::make_unique<task_queue>());
+
+	for (int i = 0; i < num_threads; i++)
+		m_threads.emplace_back(&thread_pool::worker_thread, this, i);
+}
+
+thread_pool::~thread_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock{m_wake_mutex};
+		m_stop = true;
+	}
+	m_wake_cv.notify_all();
+
+	for (auto &t : m_threads)
+		t.join();
+}
+
+void thread_pool::submit(std::function<void()> task)
+{
+	int index = (tl_pool == this) ? tl_queue_index : m_queues.size() - 1;
+
+	{
+		std::lock_guard<std::mutex> lock{m_queues[index]->mutex};
+		m_queues[index]->tasks.push_back(std::move(task));
+	}
+
+	{
+		std::lock_guard<std::mutex> lock{m_wake_mutex};
+		m_pending++;
+	}
+	m_wake_cv.notify_one();
+}
+
+/**
+	Takes a task from own queue (LIFO) or steals one from
+	other queues (FIFO)
+*/
+bool thread_pool::pop_task(std::function<void()> &task)
+{
+	int count = m_queues.size();
+	int own = (tl_pool == this) ? tl_queue_index : count - 1;
+
+	for (int i = 0; i < count; i++)
+	{
+		int index = (own + i) % count;
+		auto &q = *m_queues[index];
+		std::lock_guard<std::mutex> lock{q.mutex};
+		if (q.tasks.empty()) continue;
+
+		if (i == 0)
+		{
+			task = std::move(q.tasks.back());
+			q.tasks.pop_back();
+		}
+		else
+		{
+			task = std::move(q.tasks.front());
+			q.tasks.pop_front();
+		}
+
+		m_pending--;
+		return true;
+	}
+
+	return false;
+}
+
+bool thread_pool::try_run_pending()
+{
+	std::function<void()> task;
+	if (!pop_task(task))
+		return false;
+
+	task();
+	return true;
+}
+
+int thread_pool::get_thread_index() const
+{
+	return (tl_pool == this) ? tl_queue_index : -1;
+}
+
+void thread_pool::worker_thread(int index)
+{
+	tl_pool = this;
+	tl_queue_index = index;
+
+	while (true)
+	{
+		if (try_run_pending())
+			continue;
+
+		std::unique_lock<std::mutex> lock{m_wake_mutex};
+		m_wake_cv.wait(lock, [this]{ return m_stop || m_pending > 0; });
+		if (m_stop) break;
+	}
+}
+
+void thread_pool::task_group::wait()
+{
+	while (m_count > 0)
+		if (!m_pool->try_run_pending())
+			std::this_thread::yield();
+
+	std::lock_guard<std::mutex> lock{m_exception_mutex};
+	if (m_exception)
+	{
+		auto ex = m_exception;
+		m_exception = nullptr;
+		std::rethrow_exception(ex);
+	}
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <memory>
+
+namespace rt {
+
+/**
+	Fixed-size work-stealing thread pool.
+
+	Each worker owns a task queue. Tasks submitted from a worker thread go
+	to the back of its own queue and are taken from there in LIFO order. Idle
+	workers steal from the front of other queues. Tasks submitted from outside
+	the pool go to a separate shared queue.
+*/
+class thread_pool
+{
+public:
+	class task_group;
+
+	/**
+		Creates pool with given number of worker threads. Non-positive values
+		mean std::thread::hardware_concurrency() threads.
+	*/
+	explicit thread_pool(int num_threads = 0);
+	~thread_pool();
+
+	thread_pool(const thread_pool &) = delete;
+	thread_pool &operator=(const thread_pool &) = delete;
+
+	/**
+		Schedules a task for execution
+	*/
+	void submit(std::function<void()> task);
+
+	/**
+		Executes one pending task in the calling thread (if there is any).
+		Used by waiting threads so they don't block the workers.
+
+		\returns true if a task has been executed
+	*/
+	bool try_run_pending();
+
+	/**
+		Returns index of the calling worker thread or -1 if the thread doesn't belong to the pool
+	*/
+	int get_thread_index() const;
+
+	/**
+		Returns number of worker threads
+	*/
+	int get_thread_count() const
+	{
+		return m_threads.size();
+	}
+
+private:
+	struct task_queue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	bool pop_task(std::function<void()> &task);
+	void worker_thread(int index);
+
+	//! Worker queues + one queue for tasks submitted from outside
+	std::vector<std::unique_ptr<task_queue>> m_queues;
+	std::vector<std::thread> m_threads;
+
+	//! Number of tasks waiting in the queues
+	std::atomic<int> m_pending{0};
+	std::atomic<bool> m_stop{false};
+
+	std::mutex m_wake_mutex;
+	std::condition_variable m_wake_cv;
+};
+
+/**
+	A group of tasks that can be waited on. Thread waiting for the group
+	executes pending tasks meanwhile, so waiting from within a task is fine.
+
+	The first exception thrown by any of the tasks is rethrown by wait().
+*/
+class thread_pool::task_group
+{
+public:
+	explicit task_group(thread_pool &pool) :
+		m_pool(&pool)
+	{}
+
+	~task_group()
+	{
+		try
+		{
+			wait();
+		}
+		catch (...)
+		{
+		}
+	}
+
+	task_group(const task_group &) = delete;
+	task_group &operator=(const task_group &) = delete;
+
+	/**
+		Schedules a task in the group
+	*/
+	template <typename F>
+	void run(F &&f)
+	{
+		m_count++;
+		m_pool->submit([this, f = std::forward<F>(f)]() mutable
+		{
+			try
+			{
+				f();
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock{m_exception_mutex};
+				if (!m_exception) m_exception = std::current_exception();
+			}
+
+			m_count--;
+		});
+	}
+
+	/**
+		Waits for all tasks in the group to finish
+	*/
+	void wait();
+
+	thread_pool &get_pool() const
+	{
+		return *m_pool;
+	}
+
+private:
+	thread_pool *m_pool;
+	std::atomic<int> m_count{0};
+	std::mutex m_exception_mutex;
+	std::exception_ptr m_exception;
+};
+
+}
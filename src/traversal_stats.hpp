@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+namespace rt {
+
+/**
+	Work done by ray traversal in the calling thread. Accelerators only
+	update the counters when built with RT_TRAVERSAL_STATS defined, so
+	regular builds don't pay for them.
+*/
+struct traversal_counters
+{
+	//! Visited nodes (or grid cells)
+	std::uint64_t nodes = 0;
+
+	//! Primitives tested for intersection
+	std::uint64_t primitives = 0;
+};
+
+/**
+	Returns counters of the calling thread
+*/
+inline traversal_counters &get_traversal_counters()
+{
+	static thread_local traversal_counters counters;
+	return counters;
+}
+
+}
+
+#ifdef RT_TRAVERSAL_STATS
+#define RT_COUNT_NODES(n) (rt::get_traversal_counters().nodes += (n))
+#define RT_COUNT_PRIMITIVES(n) (rt::get_traversal_counters().primitives += (n))
+#else
+#define RT_COUNT_NODES(n) ((void)0)
+#define RT_COUNT_PRIMITIVES(n) ((void)0)
+#endif
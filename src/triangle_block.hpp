@@ -0,0 +1,285 @@
+#pragma once
+
+#include <cstdint>
+#include <cfloat>
+#include <glm/glm.hpp>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "ray.hpp"
+#include "primitive.hpp"
+
+namespace rt {
+
+/**
+	Up to 8 triangles stored in SoA layout for vectorized intersection tests.
+	Only data required by the test is kept here - first vertex and two edges.
+	Triangles are identified by their indices in a separate array containing
+	full triangle data (normals, UVs and materials), which is only accessed
+	for the final hit.
+
+	Unused slots contain degenerate triangles which are never hit.
+*/
+struct alignas(32) triangle_block
+{
+	static constexpr int width = 8;
+
+	//! Returned by ray_intersect() when no closer triangle is found
+	static constexpr std::uint32_t miss = UINT32_MAX;
+
+	inline void set(int slot, const triangle &t, std::uint32_t index);
+	inline void clear(int slot);
+
+	static inline std::uint32_t ray_intersect(const triangle_block *begin, const triangle_block *end, const ray &r, ray_intersection &isec);
+	static inline bool ray_occluded(const triangle_block *begin, const triangle_block *end, const ray &r, float tmax);
+
+	/**
+		Returns number of blocks needed to store n triangles
+	*/
+	static constexpr std::uint32_t get_block_count(std::uint32_t n)
+	{
+		return (n + width - 1) / width;
+	}
+
+	float v0_x[width];
+	float v0_y[width];
+	float v0_z[width];
+	float e1_x[width];
+	float e1_y[width];
+	float e1_z[width];
+	float e2_x[width];
+	float e2_y[width];
+	float e2_z[width];
+	std::uint32_t index[width];
+
+private:
+#ifdef __AVX2__
+	/**
+		Ray origin and direction broadcast to all lanes
+	*/
+	struct simd_ray
+	{
+		explicit simd_ray(const ray &r) :
+			ox(_mm256_set1_ps(r.origin.x)),
+			oy(_mm256_set1_ps(r.origin.y)),
+			oz(_mm256_set1_ps(r.origin.z)),
+			dx(_mm256_set1_ps(r.direction.x)),
+			dy(_mm256_set1_ps(r.direction.y)),
+			dz(_mm256_set1_ps(r.direction.z))
+		{}
+
+		__m256 ox, oy, oz;
+		__m256 dx, dy, dz;
+	};
+
+	static inline int intersect(const triangle_block &b, const simd_ray &r, __m256 tmax, __m256 &t, __m256 &u, __m256 &v);
+#else
+	static inline bool intersect(const triangle_block &b, int i, const ray &r, float tmax, float &t, float &u, float &v);
+#endif
+};
+
+/**
+	Stores triangle in given slot
+*/
+inline void triangle_block::set(int slot, const triangle &t, std::uint32_t i)
+{
+	glm::vec3 e1 = t.vertices[1] - t.vertices[0];
+	glm::vec3 e2 = t.vertices[2] - t.vertices[0];
+
+	v0_x[slot] = t.vertices[0].x;
+	v0_y[slot] = t.vertices[0].y;
+	v0_z[slot] = t.vertices[0].z;
+	e1_x[slot] = e1.x;
+	e1_y[slot] = e1.y;
+	e1_z[slot] = e1.z;
+	e2_x[slot] = e2.x;
+	e2_y[slot] = e2.y;
+	e2_z[slot] = e2.z;
+	index[slot] = i;
+}
+
+/**
+	Fills given slot with a degenerate triangle (zero edges)
+*/
+inline void triangle_block::clear(int slot)
+{
+	v0_x[slot] = v0_y[slot] = v0_z[slot] = 0.f;
+	e1_x[slot] = e1_y[slot] = e1_z[slot] = 0.f;
+	e2_x[slot] = e2_y[slot] = e2_z[slot] = 0.f;
+	index[slot] = miss;
+}
+
+#ifdef __AVX2__
+/**
+	Möller-Trumbore test of all triangles in the block.
+
+	\returns mask of triangles hit closer than tmax - distances and barycentric coordinates are written to t, u and v
+*/
+inline int triangle_block::intersect(const triangle_block &b, const simd_ray &r, __m256 tmax, __m256 &t, __m256 &u, __m256 &v)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.f);
+
+	__m256 e1x = _mm256_load_ps(b.e1_x);
+	__m256 e1y = _mm256_load_ps(b.e1_y);
+	__m256 e1z = _mm256_load_ps(b.e1_z);
+	__m256 e2x = _mm256_load_ps(b.e2_x);
+	__m256 e2y = _mm256_load_ps(b.e2_y);
+	__m256 e2z = _mm256_load_ps(b.e2_z);
+
+	// P = D x E2
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(r.dy, e2z), _mm256_mul_ps(r.dz, e2y));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(r.dz, e2x), _mm256_mul_ps(r.dx, e2z));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(r.dx, e2y), _mm256_mul_ps(r.dy, e2x));
+
+	// det = P * E1
+	__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, e1x), _mm256_mul_ps(py, e1y)), _mm256_mul_ps(pz, e1z));
+	__m256 inv_det = _mm256_div_ps(one, det);
+
+	// T = O - V0
+	__m256 tx = _mm256_sub_ps(r.ox, _mm256_load_ps(b.v0_x));
+	__m256 ty = _mm256_sub_ps(r.oy, _mm256_load_ps(b.v0_y));
+	__m256 tz = _mm256_sub_ps(r.oz, _mm256_load_ps(b.v0_z));
+
+	// Q = T x E1
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+
+	// t = Q * E2, u = P * T, v = Q * D
+	t = _mm256_mul_ps(inv_det, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, e2x), _mm256_mul_ps(qy, e2y)), _mm256_mul_ps(qz, e2z)));
+	u = _mm256_mul_ps(inv_det, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, tx), _mm256_mul_ps(py, ty)), _mm256_mul_ps(pz, tz)));
+	v = _mm256_mul_ps(inv_det, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, r.dx), _mm256_mul_ps(qy, r.dy)), _mm256_mul_ps(qz, r.dz)));
+
+	// Bounds checks - NaNs from degenerate triangles fail ordered comparisons
+	__m256 valid = _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ);
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, tmax, _CMP_LT_OQ));
+
+	return _mm256_movemask_ps(valid);
+}
+#else
+/**
+	Möller-Trumbore test of a single triangle in the block. See triangle::ray_intersect().
+
+	\returns true if the triangle is hit closer than tmax - distance and barycentric coordinates are written to t, u and v
+*/
+inline bool triangle_block::intersect(const triangle_block &b, int i, const ray &r, float tmax, float &t, float &u, float &v)
+{
+	glm::vec3 E1{b.e1_x[i], b.e1_y[i], b.e1_z[i]};
+	glm::vec3 E2{b.e2_x[i], b.e2_y[i], b.e2_z[i]};
+	glm::vec3 P = glm::cross(r.direction, E2);
+	float det = glm::dot(P, E1);
+	if (det == 0.f)
+		return false;
+
+	glm::vec3 T = r.origin - glm::vec3{b.v0_x[i], b.v0_y[i], b.v0_z[i]};
+	glm::vec3 Q = glm::cross(T, E1);
+	float inv_det = 1.f / det;
+	t = glm::dot(Q, E2) * inv_det;
+	u = glm::dot(P, T) * inv_det;
+	v = glm::dot(Q, r.direction) * inv_det;
+
+	if (u < 0.f || v < 0.f || u + v > 1.f)
+		return false;
+
+	return t >= 0.f && t < tmax;
+}
+#endif
+
+/**
+	Tests a ray against all triangles in the blocks, 8 at a time.
+
+	\note This function accounts for distance already stored in isec parameter! Farther intersections
+		won't be reported.
+
+	\returns index of the nearest intersected triangle or triangle_block::miss
+*/
+inline std::uint32_t triangle_block::ray_intersect(const triangle_block *begin, const triangle_block *end, const ray &r, ray_intersection &isec)
+{
+	std::uint32_t best_index = miss;
+
+#ifdef __AVX2__
+	const simd_ray sr{r};
+
+	for (const triangle_block *b = begin; b != end; b++)
+	{
+		__m256 t, u, v;
+		int mask = intersect(*b, sr, _mm256_set1_ps(isec.distance), t, u, v);
+		if (!mask) continue;
+
+		// Pick the closest hit
+		alignas(32) float ts[width], us[width], vs[width];
+		_mm256_store_ps(ts, t);
+		_mm256_store_ps(us, u);
+		_mm256_store_ps(vs, v);
+
+		int best = __builtin_ctz(mask);
+		for (mask &= mask - 1; mask; mask &= mask - 1)
+		{
+			int i = __builtin_ctz(mask);
+			if (ts[i] < ts[best]) best = i;
+		}
+
+		isec.distance = ts[best];
+		isec.u = us[best];
+		isec.v = vs[best];
+		best_index = b->index[best];
+	}
+#else
+	for (const triangle_block *b = begin; b != end; b++)
+	{
+		for (int i = 0; i < width; i++)
+		{
+			float t, u, v;
+			if (!intersect(*b, i, r, isec.distance, t, u, v))
+				continue;
+
+			isec.distance = t;
+			isec.u = u;
+			isec.v = v;
+			best_index = b->index[i];
+		}
+	}
+#endif
+
+	return best_index;
+}
+
+/**
+	Checks whether any triangle in the blocks is hit closer than tmax.
+	Stops at the first hit found.
+*/
+inline bool triangle_block::ray_occluded(const triangle_block *begin, const triangle_block *end, const ray &r, float tmax)
+{
+#ifdef __AVX2__
+	const simd_ray sr{r};
+	const __m256 tm = _mm256_set1_ps(tmax);
+
+	for (const triangle_block *b = begin; b != end; b++)
+	{
+		__m256 t, u, v;
+		if (intersect(*b, sr, tm, t, u, v))
+			return true;
+	}
+#else
+	for (const triangle_block *b = begin; b != end; b++)
+	{
+		for (int i = 0; i < width; i++)
+		{
+			float t, u, v;
+			if (intersect(*b, i, r, tmax, t, u, v))
+				return true;
+		}
+	}
+#endif
+
+	return false;
+}
+
+}
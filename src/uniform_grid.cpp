@@ -0,0 +1,228 @@
+#include "uniform_grid.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "traversal_stats.hpp"
+
+using rt::uniform_grid;
+
+uniform_grid::uniform_grid(const rt::scene &scene, float density)
+{
+	rt::primitive_collection primitives{scene.get_transformed_primitives()};
+	m_triangles = std::move(primitives.triangles);
+	m_spheres = std::move(primitives.spheres);
+	m_planes = std::move(primitives.planes);
+
+	bool bad_mat = false;
+	for (auto &p : m_triangles)
+		bad_mat |= p.material == nullptr;
+	for (auto &p : m_spheres)
+		bad_mat |= p.material == nullptr;
+	for (auto &p : m_planes)
+		bad_mat |= p.material == nullptr;
+
+	if (bad_mat)
+		throw std::runtime_error("Some primitives don't have any material assigned. Cannot proceed!");
+
+	build(density);
+}
+
+/**
+	Chooses the grid resolution and fills cell lists. Primitives are assigned
+	to all cells overlapped by their bounding boxes.
+*/
+void uniform_grid::build(float density)
+{
+	std::uint32_t count = m_triangles.size() + m_spheres.size();
+	if (count == 0) return;
+
+	auto get_aabb = [this](std::uint32_t i)
+	{
+		return i < m_triangles.size() ? m_triangles[i].get_aabb() : m_spheres[i - m_triangles.size()].get_aabb();
+	};
+
+	m_min = glm::vec3{HUGE_VALF};
+	glm::vec3 max{-HUGE_VALF};
+	for (std::uint32_t i = 0; i < count; i++)
+	{
+		aabb box{get_aabb(i)};
+		m_min = glm::min(m_min, box.get_min());
+		max = glm::max(max, box.get_max());
+	}
+
+	// Flat scenes are given some thickness, so that the volume is not zero
+	glm::vec3 size = max - m_min;
+	float max_size = std::max(std::max(size.x, size.y), size.z);
+	size = glm::max(size, glm::vec3{max_size > 0.f ? max_size * 1e-3f : 1.f});
+	m_max = m_min + size;
+
+	float scale = std::cbrt(density * count / (size.x * size.y * size.z));
+	for (int axis = 0; axis < 3; axis++)
+		m_resolution[axis] = std::clamp(static_cast<int>(std::ceil(size[axis] * scale)), 1, max_resolution);
+	m_cell_size = size / glm::vec3{m_resolution};
+
+	// Range of cells overlapped by a box
+	auto get_cells = [this](const aabb &box, glm::ivec3 &lo, glm::ivec3 &hi)
+	{
+		lo = glm::clamp(glm::ivec3{glm::floor((box.get_min() - m_min) / m_cell_size)}, glm::ivec3{0}, m_resolution - 1);
+		hi = glm::clamp(glm::ivec3{glm::floor((box.get_max() - m_min) / m_cell_size)}, glm::ivec3{0}, m_resolution - 1);
+	};
+
+	auto for_each_cell = [&](std::uint32_t i, auto &&f)
+	{
+		glm::ivec3 lo, hi;
+		get_cells(get_aabb(i), lo, hi);
+		for (int z = lo.z; z <= hi.z; z++)
+			for (int y = lo.y; y <= hi.y; y++)
+				for (int x = lo.x; x <= hi.x; x++)
+					f((z * m_resolution.y + y) * m_resolution.x + x);
+	};
+
+	// Count primitives in each cell and turn counts into offsets
+	std::size_t cell_count = static_cast<std::size_t>(m_resolution.x) * m_resolution.y * m_resolution.z;
+	m_cell_offsets.assign(cell_count + 1, 0);
+	for (std::uint32_t i = 0; i < count; i++)
+		for_each_cell(i, [this](std::size_t cell){ m_cell_offsets[cell + 1]++; });
+
+	for (std::size_t i = 0; i < cell_count; i++)
+		m_cell_offsets[i + 1] += m_cell_offsets[i];
+
+	std::vector<std::uint32_t> fill(m_cell_offsets.begin(), m_cell_offsets.end() - 1);
+	m_cell_primitives.resize(m_cell_offsets.back());
+	for (std::uint32_t i = 0; i < count; i++)
+		for_each_cell(i, [&](std::size_t cell){ m_cell_primitives[fill[cell]++] = i; });
+}
+
+bool uniform_grid::intersect_primitive(std::uint32_t index, const rt::ray &r, ray_intersection &isec) const
+{
+	if (index < m_triangles.size())
+	{
+		const rt::triangle *t = &m_triangles[index];
+		return rt::triangle::ray_intersect(t, t + 1, r, isec) != nullptr;
+	}
+
+	const rt::sphere *s = &m_spheres[index - m_triangles.size()];
+	return rt::sphere::ray_intersect(s, s + 1, r, isec) != nullptr;
+}
+
+/**
+	Visits cells pierced by the ray in front-to-back order using 3D-DDA
+	(Amanatides & Woo). The cell callback gets the range of primitives in
+	the cell and the distance at which the ray leaves it. It returns true
+	to end the traversal.
+*/
+template <typename F>
+void uniform_grid::traverse(const rt::ray &r, float tmax, F &&visit_cell) const
+{
+	if (m_cell_offsets.empty()) return;
+
+	rt::traversal_ray tr{r, 0.f, tmax};
+	float t = rt::ray_box_intersection_distance(tr, m_min, m_max);
+	if (t == rt::ray_miss) return;
+
+	// Cell containing the entry point
+	glm::vec3 entry = (r.origin + r.direction * t - m_min) / m_cell_size;
+	glm::ivec3 cell = glm::clamp(glm::ivec3{glm::floor(entry)}, glm::ivec3{0}, m_resolution - 1);
+
+	// Distance to the next cell boundary and between two boundaries along each axis
+	glm::ivec3 step{0}, stop{0};
+	glm::vec3 t_next{HUGE_VALF}, t_delta{HUGE_VALF};
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (r.direction[axis] == 0.f) continue;
+
+		step[axis] = tr.sign[axis] ? -1 : 1;
+		stop[axis] = tr.sign[axis] ? -1 : m_resolution[axis];
+		float boundary = m_min[axis] + (cell[axis] + !tr.sign[axis]) * m_cell_size[axis];
+		t_next[axis] = (boundary - r.origin[axis]) * tr.inv_direction[axis];
+		t_delta[axis] = m_cell_size[axis] * std::abs(tr.inv_direction[axis]);
+	}
+
+	while (true)
+	{
+		RT_COUNT_NODES(1);
+
+		// The ray leaves the cell through the closest boundary
+		int axis = t_next.x < t_next.y ? (t_next.x < t_next.z ? 0 : 2) : (t_next.y < t_next.z ? 1 : 2);
+		float t_exit = t_next[axis];
+
+		std::size_t index = (static_cast<std::size_t>(cell.z) * m_resolution.y + cell.y) * m_resolution.x + cell.x;
+		if (visit_cell(m_cell_offsets[index], m_cell_offsets[index + 1], t_exit))
+			return;
+
+		if (t_exit > tmax) return;
+		cell[axis] += step[axis];
+		if (cell[axis] == stop[axis]) return;
+		t_next[axis] += t_delta[axis];
+	}
+}
+
+bool uniform_grid::cast_ray(const rt::ray &r, ray_hit &best_hit) const
+{
+	// Assume miss
+	best_hit.distance = rt::ray_miss;
+
+	// Nearset intersection
+	rt::ray_intersection isec;
+	isec.distance = rt::ray_miss;
+
+	// Check planes
+	const rt::plane *best_plane = rt::plane::ray_intersect(m_planes.data(), m_planes.data() + m_planes.size(), r, isec);
+	if (best_plane) best_hit = best_plane->get_ray_hit(isec, r);
+
+	// Primitives overlapping multiple cells can be hit outside of the visited one,
+	// so the traversal only ends when the closest hit lies within the cell. Testing
+	// them again in the following cells can't change the result - the mailbox skips that.
+	std::uint32_t best = UINT32_MAX;
+	mailbox tested;
+	traverse(r, isec.distance, [&](std::uint32_t first, std::uint32_t last, float t_exit)
+	{
+		for (std::uint32_t i = first; i < last; i++)
+		{
+			std::uint32_t index = m_cell_primitives[i];
+			if (tested.test_and_set(index)) continue;
+
+			RT_COUNT_PRIMITIVES(1);
+			if (intersect_primitive(index, r, isec))
+				best = index;
+		}
+
+		return isec.distance <= t_exit;
+	});
+
+	if (best < m_triangles.size())
+		best_hit = m_triangles[best].get_ray_hit(isec, r);
+	else if (best != UINT32_MAX)
+		best_hit = m_spheres[best - m_triangles.size()].get_ray_hit(isec, r);
+
+	return best_hit.distance != rt::ray_miss;
+}
+
+bool uniform_grid::occluded(const rt::ray &r, float tmax) const
+{
+	rt::ray_intersection isec;
+	isec.distance = tmax;
+	if (rt::plane::ray_intersect(m_planes.data(), m_planes.data() + m_planes.size(), r, isec))
+		return true;
+
+	bool hit = false;
+	mailbox tested;
+	traverse(r, tmax, [&](std::uint32_t first, std::uint32_t last, float)
+	{
+		for (std::uint32_t i = first; i < last && !hit; i++)
+		{
+			std::uint32_t index = m_cell_primitives[i];
+			if (tested.test_and_set(index)) continue;
+
+			RT_COUNT_PRIMITIVES(1);
+			hit = intersect_primitive(index, r, isec);
+		}
+
+		return hit;
+	});
+
+	return hit;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <glm/glm.hpp>
+
+#include "ray_accelerator.hpp"
+#include "primitive.hpp"
+#include "scene.hpp"
+
+namespace rt {
+
+/**
+	Uniform grid over triangles and spheres. Each cell lists primitives whose
+	bounding boxes overlap it, and rays walk through the cells in order using
+	3D-DDA. Grid resolution is chosen so that there are about `density` cells
+	per primitive, with cells as close to cubes as possible.
+
+	Cell lists are stored in a single array - `m_cell_offsets[i]` is the index
+	of the first primitive of cell i. Primitive indices below the triangle
+	count refer to triangles, the remaining ones to spheres.
+
+	Primitives spanning multiple cells are listed in each of them. A per-ray
+	mailbox remembers recently tested primitives, so they're usually tested
+	only once per ray.
+*/
+class uniform_grid : public ray_accelerator
+{
+public:
+	explicit uniform_grid(const scene &scene, float density = default_density);
+	bool cast_ray(const rt::ray &r, ray_hit &hit) const override;
+	bool occluded(const rt::ray &r, float tmax) const override;
+
+	const glm::ivec3 &get_resolution() const
+	{
+		return m_resolution;
+	}
+
+	/**
+		Returns memory taken by cell lists in bytes
+	*/
+	std::size_t get_memory_usage() const
+	{
+		return (m_cell_offsets.size() + m_cell_primitives.size()) * sizeof(std::uint32_t);
+	}
+
+private:
+	//! Default number of cells per primitive
+	static constexpr float default_density = 2.f;
+
+	//! Max number of cells along each axis
+	static constexpr int max_resolution = 512;
+
+	/**
+		Direct-mapped cache of primitives already tested by a ray. Collisions
+		only evict entries, so at worst a primitive is tested again.
+	*/
+	class mailbox
+	{
+	public:
+		static constexpr std::uint32_t size = 32;
+		static_assert((size & (size - 1)) == 0, "Mailbox size must be a power of 2");
+
+		mailbox()
+		{
+			std::fill(std::begin(m_ids), std::end(m_ids), UINT32_MAX);
+		}
+
+		//! Returns true if the primitive has already been tested and marks it as tested otherwise
+		bool test_and_set(std::uint32_t index)
+		{
+			std::uint32_t &slot = m_ids[index & (size - 1)];
+			if (slot == index) return true;
+			slot = index;
+			return false;
+		}
+
+	private:
+		std::uint32_t m_ids[size];
+	};
+
+	void build(float density);
+
+	template <typename F>
+	void traverse(const rt::ray &r, float tmax, F &&visit_cell) const;
+
+	bool intersect_primitive(std::uint32_t index, const rt::ray &r, ray_intersection &isec) const;
+
+	glm::vec3 m_min;
+	glm::vec3 m_max;
+	glm::vec3 m_cell_size;
+	glm::ivec3 m_resolution{0};
+
+	std::vector<std::uint32_t> m_cell_offsets;
+	std::vector<std::uint32_t> m_cell_primitives;
+
+	std::vector<triangle> m_triangles;
+	std::vector<sphere> m_spheres;
+	std::vector<plane> m_planes;
+};
+
+}
@@ -0,0 +1,307 @@
+#include "wide_bvh.hpp"
+
+#include <stack>
+#include <tuple>
+#include <cfloat>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "containers/short_stack.hpp"
+#include "traversal_stats.hpp"
+
+using rt::wide_bvh;
+using rt::wide_bvh_node;
+
+wide_bvh::wide_bvh(const rt::scene &scene, const bvh_build_params &params)
+{
+	// Build binary tree and collapse it
+	bvh_tree tree{scene, params};
+	m_depth = collapse_tree(tree.get_nodes(), m_nodes);
+	m_sphere_depth = collapse_tree(tree.get_sphere_nodes(), m_sphere_nodes);
+
+	m_blocks.assign(tree.get_blocks().begin(), tree.get_blocks().end());
+	m_triangles.assign(tree.get_triangles().begin(), tree.get_triangles().end());
+	m_spheres = tree.get_spheres();
+	m_planes = tree.get_planes();
+}
+
+/**
+	Converts binary BVH into the wide one. Children of each wide node are gathered
+	by repeatedly replacing the interior child with the largest surface area with
+	its own children.
+
+	\returns depth of the wide tree
+*/
+int wide_bvh::collapse_tree(const rt::mappable_vector<bvh_tree_node> &nodes, std::vector<wide_bvh_node> &wide_nodes)
+{
+	constexpr int width = wide_bvh_node::width;
+
+	wide_nodes.clear();
+	int max_depth = 0;
+	if (nodes.empty()) return 0;
+
+	auto surface_area = [](const bvh_tree_node &n)
+	{
+		glm::vec3 d = n.max - n.min;
+		return 2.f * (d.x * d.y + d.x * d.z + d.y * d.z);
+	};
+
+	// Binary node index, wide node index and depth
+	std::stack<std::tuple<std::uint32_t, std::uint32_t, int>> to_process;
+	wide_nodes.emplace_back();
+	to_process.emplace(0, 0, 1);
+
+	while (!to_process.empty())
+	{
+		auto [bin_index, wide_index, depth] = to_process.top();
+		to_process.pop();
+		max_depth = std::max(max_depth, depth);
+
+		// Gather children
+		std::uint32_t children[width];
+		int n;
+		if (nodes[bin_index].is_leaf())
+		{
+			children[0] = bin_index;
+			n = 1;
+		}
+		else
+		{
+			children[0] = nodes[bin_index].offset;
+			children[1] = nodes[bin_index].offset + 1;
+			n = 2;
+
+			while (n < width)
+			{
+				int best = -1;
+				float best_area = -1.f;
+				for (int i = 0; i < n; i++)
+				{
+					const bvh_tree_node &c = nodes[children[i]];
+					if (!c.is_leaf() && surface_area(c) > best_area)
+					{
+						best = i;
+						best_area = surface_area(c);
+					}
+				}
+
+				if (best < 0) break;
+				std::uint32_t expanded = children[best];
+				children[best] = nodes[expanded].offset;
+				children[n++] = nodes[expanded].offset + 1;
+			}
+		}
+
+		// Fill the node - unused slots get inverted bounds
+		wide_bvh_node node;
+		for (int i = 0; i < width; i++)
+		{
+			node.min_x[i] = node.min_y[i] = node.min_z[i] = FLT_MAX;
+			node.max_x[i] = node.max_y[i] = node.max_z[i] = -FLT_MAX;
+			node.child[i] = 0;
+			node.count[i] = 0;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			const bvh_tree_node &c = nodes[children[i]];
+			node.min_x[i] = c.min.x;
+			node.min_y[i] = c.min.y;
+			node.min_z[i] = c.min.z;
+			node.max_x[i] = c.max.x;
+			node.max_y[i] = c.max.y;
+			node.max_z[i] = c.max.z;
+
+			if (c.is_leaf())
+			{
+				node.child[i] = c.offset;
+				node.count[i] = c.count;
+			}
+			else
+			{
+				node.child[i] = wide_nodes.size();
+				wide_nodes.emplace_back();
+				to_process.emplace(children[i], node.child[i], depth + 1);
+			}
+		}
+
+		wide_nodes[wide_index] = node;
+	}
+
+	return max_depth;
+}
+
+/**
+	Tests all children of a wide node against the ray. Near and far slab
+	planes are selected based on ray direction signs, so unused slots with
+	inverted bounds never produce a hit.
+
+	\returns bit mask of children hit within the ray range. Entry distances are written to `t` (32-byte aligned)
+*/
+static inline int intersect_children(const wide_bvh_node &node, const rt::traversal_ray &r, float *t)
+{
+	const float *near_x = r.sign[0] ? node.max_x : node.min_x;
+	const float *near_y = r.sign[1] ? node.max_y : node.min_y;
+	const float *near_z = r.sign[2] ? node.max_z : node.min_z;
+	const float *far_x = r.sign[0] ? node.min_x : node.max_x;
+	const float *far_y = r.sign[1] ? node.min_y : node.max_y;
+	const float *far_z = r.sign[2] ? node.min_z : node.max_z;
+
+#ifdef __AVX2__
+	const __m256 ix = _mm256_set1_ps(r.inv_direction.x);
+	const __m256 iy = _mm256_set1_ps(r.inv_direction.y);
+	const __m256 iz = _mm256_set1_ps(r.inv_direction.z);
+	const __m256 ox = _mm256_set1_ps(r.origin.x);
+	const __m256 oy = _mm256_set1_ps(r.origin.y);
+	const __m256 oz = _mm256_set1_ps(r.origin.z);
+
+	__m256 tnear = _mm256_max_ps(
+		_mm256_max_ps(
+			_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_x), ox), ix),
+			_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_y), oy), iy)),
+		_mm256_max_ps(
+			_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_z), oz), iz),
+			_mm256_set1_ps(r.tmin)));
+
+	__m256 tfar = _mm256_min_ps(
+		_mm256_min_ps(
+			_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_x), ox), ix),
+			_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_y), oy), iy)),
+		_mm256_min_ps(
+			_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_z), oz), iz),
+			_mm256_set1_ps(r.tmax)));
+
+	_mm256_store_ps(t, tnear);
+	return _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+#else
+	int mask = 0;
+	for (int i = 0; i < wide_bvh_node::width; i++)
+	{
+		float tn = std::max(
+			std::max((near_x[i] - r.origin.x) * r.inv_direction.x, (near_y[i] - r.origin.y) * r.inv_direction.y),
+			std::max((near_z[i] - r.origin.z) * r.inv_direction.z, r.tmin));
+
+		float tf = std::min(
+			std::min((far_x[i] - r.origin.x) * r.inv_direction.x, (far_y[i] - r.origin.y) * r.inv_direction.y),
+			std::min((far_z[i] - r.origin.z) * r.inv_direction.z, r.tmax));
+
+		t[i] = tn;
+		mask |= (tn <= tf) << i;
+	}
+	return mask;
+#endif
+}
+
+bool wide_bvh::cast_ray(const rt::ray &r, ray_hit &best_hit) const
+{
+	// The stack never outgrows the tree depth - deeper trees use a heap-allocated one
+	if (std::max(m_depth, m_sphere_depth) * (wide_bvh_node::width - 1) < traversal_stack_size)
+	{
+		rt::short_stack<node_intersection, traversal_stack_size> intersections;
+		return cast_ray_impl(r, best_hit, intersections);
+	}
+	else
+	{
+		std::stack<node_intersection, std::vector<node_intersection>> intersections;
+		return cast_ray_impl(r, best_hit, intersections);
+	}
+}
+
+template <typename Stack>
+bool wide_bvh::cast_ray_impl(const rt::ray &r, ray_hit &best_hit, Stack &intersections) const
+{
+	// Assume miss
+	best_hit.distance = rt::ray_miss;
+
+	// Nearset intersection
+	rt::ray_intersection isec;
+	isec.distance = rt::ray_miss;
+
+	// Check planes
+	const rt::plane *best_plane = rt::plane::ray_intersect(m_planes.data(), m_planes.data() + m_planes.size(), r, isec);
+	if (best_plane) best_hit = best_plane->get_ray_hit(isec, r);
+
+	// Ray used for traversal - its range ends at the closest hit found so far
+	rt::traversal_ray tr{r, 0.f, isec.distance};
+
+	// Check spheres
+	traverse_closest(m_sphere_nodes, tr, intersections, [&](std::uint32_t first, std::uint16_t count)
+	{
+		const rt::sphere *begin = m_spheres.data() + first;
+		const rt::sphere *best_sphere = rt::sphere::ray_intersect(begin, begin + count, r, isec);
+		if (best_sphere)
+		{
+			best_hit = best_sphere->get_ray_hit(isec, r);
+			tr.tmax = isec.distance;
+		}
+	});
+
+	// Check triangles
+	traverse_closest(m_nodes, tr, intersections, [&](std::uint32_t first, std::uint16_t count)
+	{
+		const rt::triangle_block *begin = m_blocks.data() + first;
+		std::uint32_t index = rt::triangle_block::ray_intersect(begin, begin + triangle_block::get_block_count(count), r, isec);
+		if (index != rt::triangle_block::miss)
+		{
+			best_hit = m_triangles[index].get_ray_hit(isec, r);
+			tr.tmax = isec.distance;
+		}
+	});
+
+	return best_hit.distance != rt::ray_miss;
+}
+
+/**
+	Visits leaves of a tree hit by the ray in front-to-back order. The leaf
+	callback is expected to shorten the ray range when it finds a hit.
+*/
+template <typename Stack, typename F>
+void wide_bvh::traverse_closest(const std::vector<wide_bvh_node> &nodes, const rt::traversal_ray &tr, Stack &intersections, F &&intersect_leaf) const
+{
+	// The root node itself is not tested - only its children are
+	if (!nodes.empty())
+		intersections.emplace(0, 0, 0.f);
+
+	while (!intersections.empty())
+	{
+		auto node_isec = intersections.top();
+		intersections.pop();
+
+		// If an intersection was found earlier, closer than this volume itself - skip
+		if (tr.tmax < node_isec.t) continue;
+		RT_COUNT_NODES(1);
+
+		// Leaves - intersect all primitives
+		if (node_isec.count != 0)
+		{
+			RT_COUNT_PRIMITIVES(node_isec.count);
+			intersect_leaf(node_isec.child, node_isec.count);
+			continue;
+		}
+
+		// Test all children at once
+		const wide_bvh_node &node = nodes[node_isec.child];
+		alignas(32) float t[wide_bvh_node::width];
+		int mask = intersect_children(node, tr, t);
+
+		// Sort hit children by descending distance
+		int hits[wide_bvh_node::width];
+		int n = 0;
+		while (mask)
+		{
+			int i = __builtin_ctz(mask);
+			mask &= mask - 1;
+
+			int j = n++;
+			for (; j > 0 && t[hits[j - 1]] < t[i]; j--)
+				hits[j] = hits[j - 1];
+			hits[j] = i;
+		}
+
+		// Push them, so the closest one is on the top
+		for (int k = 0; k < n; k++)
+			intersections.emplace(node.child[hits[k]], node.count[hits[k]], t[hits[k]]);
+	}
+}
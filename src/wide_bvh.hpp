@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "ray_accelerator.hpp"
+#include "primitive.hpp"
+#include "scene.hpp"
+#include "bvh_tree.hpp"
+
+namespace rt {
+
+/**
+	A node of a wide BVH with bounds of all children stored in SoA layout,
+	so they can be tested against a ray with a single SIMD slab test.
+
+	Children with zero count are interior nodes and `child` is their index.
+	Otherwise `child` is the index of the first primitive (or triangle block)
+	of a leaf and `count` is the number of primitives in it.
+	Unused slots have inverted bounds and are never hit.
+*/
+struct alignas(32) wide_bvh_node
+{
+	static constexpr int width = 8;
+
+	float min_x[width];
+	float min_y[width];
+	float min_z[width];
+	float max_x[width];
+	float max_y[width];
+	float max_z[width];
+
+	std::uint32_t child[width];
+	std::uint16_t count[width];
+};
+
+/**
+	8-wide BVH built by collapsing binary SAH trees built by `bvh_tree`.
+	Spheres have a tree of their own, just like in `bvh_tree`.
+*/
+class wide_bvh : public ray_accelerator
+{
+public:
+	wide_bvh(const scene &scene, const bvh_build_params &params = {});
+	bool cast_ray(const rt::ray &r, ray_hit &hit) const override;
+
+	/**
+		Returns number of nodes in the tree
+	*/
+	std::size_t get_node_count() const
+	{
+		return m_nodes.size();
+	}
+
+	/**
+		Returns memory taken by nodes of both trees and triangle blocks in bytes
+	*/
+	std::size_t get_memory_usage() const
+	{
+		return (m_nodes.size() + m_sphere_nodes.size()) * sizeof(wide_bvh_node) + m_blocks.size() * sizeof(triangle_block);
+	}
+
+private:
+	struct node_intersection
+	{
+		node_intersection() = default;
+
+		node_intersection(std::uint32_t c, std::uint16_t n, float u) :
+			child(c),
+			count(n),
+			t(u)
+		{}
+
+		std::uint32_t child;
+		std::uint16_t count;
+		float t;
+	};
+
+	//! Traversal stack size used for trees that are not too deep
+	static constexpr int traversal_stack_size = 512;
+
+	static int collapse_tree(const mappable_vector<bvh_tree_node> &nodes, std::vector<wide_bvh_node> &wide_nodes);
+
+	template <typename Stack>
+	bool cast_ray_impl(const rt::ray &r, ray_hit &hit, Stack &intersections) const;
+
+	template <typename Stack, typename F>
+	void traverse_closest(const std::vector<wide_bvh_node> &nodes, const rt::traversal_ray &tr, Stack &intersections, F &&intersect_leaf) const;
+
+	std::vector<wide_bvh_node> m_nodes;
+	int m_depth = 0;
+	std::vector<triangle_block> m_blocks;
+	std::vector<triangle> m_triangles;
+	std::vector<wide_bvh_node> m_sphere_nodes;
+	int m_sphere_depth = 0;
+	std::vector<sphere> m_spheres;
+	std::vector<plane> m_planes;
+};
+
+}